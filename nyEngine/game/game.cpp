@@ -6,6 +6,11 @@
 
 // The version and platform strings
 CVar * g_version, * g_platform;
+// Log the frame rate and script collector times every second
+CVar * g_framestats;
+
+// Engine event atoms
+static uint eventDraw;
 
 GameApplication * GameApplication::singleton;
 
@@ -22,7 +27,11 @@ void gameInit()
 	g_platform = CVar::Create("g_platform", "windows", VAR_READONLY | VAR_NOSYNC | VAR_NOLOAD);
 #endif
 	
+	g_framestats = CVar::Create("g_framestats", false, VAR_NOSYNC);
+
 	CVar::DumpToDebug(true);
+
+	eventDraw = atomIntern("@DRAW");
 }
 
 void gameRun()
@@ -214,6 +223,7 @@ void GameApplication::go()
 	int framerate = 0;
 	int updateCount;
 	int desiredFramerate = 60;
+	double gcTime = 0, gcLongest = 0, gcPause;
 
 	desiredDeltaTime = 1.0 / desiredFramerate;
 	//desiredDeltaTime = 0.016f;
@@ -238,8 +248,14 @@ void GameApplication::go()
 		if(framerateDelta >= 1.0)
 		{
 			framerateDelta -= 1.0;
-			// dbgOut("FPS: %i", framerate);
+			if(g_framestats->GetBool())
+			{
+				dbgOut("FPS: %i, script gc %.2fms (longest %.2fms, %u cycles), script heap %uk", framerate,
+					gcTime * 1000, gcLongest * 1000, luaManager.gcCycles, (uint)(luaManager.allocator.Stats().bytes >> 10));
+			}
 			framerate = 0;
+			gcTime = gcLongest = 0;
+			luaManager.gcCycles = 0;
 		}
 
 		//now = frameTimer.getMilliseconds();
@@ -308,6 +324,12 @@ void GameApplication::go()
 
 			if(!mRoot->renderOneFrame())
 				looping = false;
+
+			// Whatever is left of the frame goes to the script collector, less the fudge so the next frame isn't late
+			gcPause = luaManager.CollectGarbage(fudgeLower - (frameTimer.getMicrosecondsCPU() - now) / 1000000.0);
+			gcTime += gcPause;
+			if(gcPause > gcLongest)
+				gcLongest = gcPause;
 		}
 #endif
 	}
@@ -480,7 +502,7 @@ bool GameApplication::tick()
 	}
 
 	// Now that everything in the scene has been drawn, run the draw scripts
-	luaManager.Tick(deltaTime, "@DRAW");
+	luaManager.Tick(deltaTime, eventDraw);
 
 	return true;
 }
@@ -7,6 +7,8 @@ typedef unsigned char uint8, byte;
 typedef signed int int32;
 typedef signed short int16;
 typedef signed char int8;
+typedef unsigned long long uint64;
+typedef signed long long int64;
 
 #ifndef SUPPRESS_DEBUG_NEW
 #ifdef _DEBUG
@@ -24,6 +26,8 @@ typedef signed char int8;
 #include "util\file.h"
 #include "util\string.h"
 #include "util\lock.h"
+#include "util\thread.h"
+#include "util\atom.h"
 #include "platform\platform.h"
 #include "dbg\dbg.h"
 #include "var\Var.h"
@@ -0,0 +1,99 @@
+/*
+* hashbench.c -- times string interning and string-keyed tables
+* Not part of the engine build. From the nyEngine directory:
+*   cl /O2 /Ilua lua\etc\hashbench.c lua\l*.c pluto\pdep.c
+* Build it again with an older lstring.c to compare string hashes.
+*/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lstate.h"
+
+#define N	200000
+#define RUNS	5
+
+static char names[N][96];
+
+static double now (void) {
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/* assets share a long prefix and differ only in a short part near the end */
+static void assetnames (void) {
+  static const char *const kinds[] = { "models", "sounds", "scripts", "textures" };
+  int i;
+  for (i = 0; i < N; i++)
+    sprintf(names[i], "sp/helloworld/%s/level%02d/props/entity_%05d_lod%d.asset",
+            kinds[i & 3], (i >> 2) % 40, i / 160, i % 3);
+}
+
+static void identnames (void) {
+  int i;
+  for (i = 0; i < N; i++)
+    sprintf(names[i], "v%x", (unsigned)i * 2654435761u);
+}
+
+static void chains (lua_State *L) {
+  stringtable *tb = &G(L)->strt;
+  int i, used = 0, longest = 0;
+  for (i = 0; i < tb->size; i++) {
+    int n = 0;
+    GCObject *o;
+    for (o = tb->hash[i]; o; o = o->gch.next) n++;
+    if (n) used++;
+    if (n > longest) longest = n;
+  }
+  printf("  strings %d, buckets %d (%d used), average chain %.1f, longest %d\n",
+         tb->nuse, tb->size, used, (double)tb->nuse / used, longest);
+}
+
+static void bench (const char *what) {
+  double inew = 1e9, iold = 1e9, tab = 1e9, t;
+  int i, r;
+  printf("%s:\n", what);
+  for (r = 0; r < RUNS; r++) {
+    lua_State *L = luaL_newstate();
+    lua_gc(L, LUA_GCSTOP, 0);
+    lua_createtable(L, N, 0);
+    t = now();
+    for (i = 0; i < N; i++) {  /* intern new strings */
+      lua_pushstring(L, names[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+    t = now() - t; if (t < inew) inew = t;
+    t = now();
+    for (i = 0; i < N; i++) {  /* look up strings that are already interned */
+      lua_pushstring(L, names[i]);
+      lua_pop(L, 1);
+    }
+    t = now() - t; if (t < iold) iold = t;
+    lua_newtable(L);
+    t = now();
+    for (i = 0; i < N; i++) {  /* use them as table keys */
+      lua_rawgeti(L, -2, i + 1);
+      lua_pushboolean(L, 1);
+      lua_rawset(L, -3);
+    }
+    for (i = 0; i < N; i++) {
+      lua_rawgeti(L, -2, i + 1);
+      lua_rawget(L, -2);
+      lua_pop(L, 1);
+    }
+    t = now() - t; if (t < tab) tab = t;
+    if (r == 0) chains(L);
+    lua_close(L);
+  }
+  printf("  intern new %.0fms, intern existing %.0fms, table set+get %.0fms\n",
+         inew * 1000, iold * 1000, tab * 1000);
+}
+
+int main (void) {
+  assetnames();
+  bench("asset paths");
+  identnames();
+  bench("short identifiers");
+  return 0;
+}
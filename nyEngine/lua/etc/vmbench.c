@@ -0,0 +1,114 @@
+/*
+* vmbench.c -- times luaV_execute on script-like workloads
+* Not part of the engine build. From the nyEngine directory:
+*   cl /O2 /Ilua lua\etc\vmbench.c lua\l*.c pluto\pdep.c
+* Add -DLUA_USE_COMPUTEDGOTO with gcc or clang to time the threaded dispatch.
+* Each state has a count hook installed, like the manager's slice hook.
+* The namespace workload calls C functions in _G through { __index = _G },
+* the way scripts loaded by the manager do.
+*/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define RUNS	15
+
+static const char *const work[][2] = {
+  {"fib",
+   "local function fib(n) if n < 2 then return n end return fib(n-1) + fib(n-2) end "
+   "return fib(27)"},
+  {"entities",
+   "local ents = {} "
+   "for i = 1, 2000 do ents[i] = { x = i, y = 0, vx = 1, vy = 2, hp = 100, alive = true } end "
+   "for f = 1, 300 do for i = 1, #ents do local e = ents[i] if e.alive then "
+   "e.x = e.x + e.vx * 0.05 e.y = e.y + e.vy * 0.05 if e.y > 50 then e.vy = -e.vy end "
+   "e.hp = e.hp - 0.01 if e.hp < 0 then e.alive = false end end end end "
+   "return ents[1].x"},
+  {"methods",
+   "local C = {} C.__index = C "
+   "function C.new(v) return setmetatable({ v = v }, C) end "
+   "function C.get(self) return self.v end "
+   "function C.add(self, o) return C.new(self.v + o.get(o)) end "
+   "local a = C.new(0) for i = 1, 300000 do a = a.add(a, C.new(1)) end "
+   "return a.v"},
+  {"strings",
+   "local t = {} for i = 1, 100000 do t[#t+1] = 'ev' .. (i % 100) end "
+   "local n = 0 for i, s in ipairs(t) do if s == 'ev5' then n = n + 1 end end "
+   "return n"},
+  {"closures",
+   "local s = 0 for i = 1, 200000 do local f = function(x) return x + i end s = s + f(1) end "
+   "return s"},
+  {"namespace",
+   "local N = setmetatable({}, { __index = _G }) "
+   "local body = function(self, n) local s = 0 for i = 1, n do "
+   "notify(self, 1) s = s + varGetInt('g_x') wait(0) "
+   "if math.abs(s) > 1e9 then s = 0 end update(self) end return s end "
+   "N.update = function(self) self.t = (self.t or 0) + 1 end "
+   "setfenv(body, N) setfenv(N.update, N) "
+   "return body({}, 300000)"},
+};
+
+static double now (void) {
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void hook (lua_State *L, lua_Debug *ar) {
+  (void)L; (void)ar;
+}
+
+static int cnone (lua_State *L) {
+  (void)L;
+  return 0;
+}
+
+static int cnumber (lua_State *L) {
+  lua_pushnumber(L, 1);
+  return 1;
+}
+
+/* stand-ins for the engine bindings, _G holds a few hundred of them */
+static void engine (lua_State *L) {
+  char name[32];
+  int i;
+  lua_register(L, "notify", cnone);
+  lua_register(L, "wait", cnone);
+  lua_register(L, "varGetInt", cnumber);
+  for (i = 0; i < 300; i++) {
+    sprintf(name, "engine%d", i);
+    lua_register(L, name, cnone);
+  }
+}
+
+int main (void) {
+  double total = 0, best, t;
+  int w, r;
+  for (w = 0; w < (int)(sizeof(work) / sizeof(work[0])); w++) {
+    best = 1e9;
+    for (r = 0; r < RUNS; r++) {
+      lua_State *L = luaL_newstate();
+      luaL_openlibs(L);
+      engine(L);
+      lua_sethook(L, hook, LUA_MASKCOUNT, 1000);
+      if (luaL_loadstring(L, work[w][1])) {
+        printf("%s: %s\n", work[w][0], lua_tostring(L, -1));
+        return 1;
+      }
+      t = now();
+      if (lua_pcall(L, 0, 1, 0)) {
+        printf("%s: %s\n", work[w][0], lua_tostring(L, -1));
+        return 1;
+      }
+      t = now() - t;
+      if (t < best) best = t;
+      lua_close(L);
+    }
+    printf("%-10s %8.1fms\n", work[w][0], best * 1000);
+    total += best;
+  }
+  printf("%-10s %8.1fms\n", "total", total * 1000);
+  return 0;
+}
@@ -710,6 +710,8 @@ LUA_API int lua_setmetatable (lua_State *L, int objindex) {
   }
   switch (ttype(obj)) {
     case LUA_TTABLE: {
+      luaH_markdirty(L, hvalue(obj));
+      luaH_newversion(L, hvalue(obj));
       hvalue(obj)->metatable = mt;
       if (mt)
         luaC_objbarriert(L, hvalue(obj), mt);
@@ -911,6 +913,11 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       g->GCthreshold = g->totalbytes;
       break;
     }
+    case LUA_GCLIMIT: {  /* nyEngine */
+      lu_mem limit = (cast(lu_mem, data) << 10);
+      g->GCthreshold = (limit > g->totalbytes) ? limit : g->totalbytes;
+      break;
+    }
     case LUA_GCCOLLECT: {
       luaC_fullgc(L);
       break;
@@ -1052,10 +1059,18 @@ static const char *aux_upvalue (StkId fi, int n, TValue **val) {
 }
 
 
+/* nyEngine: the upvalue names of a lazily undumped function are in its body */
+static void loadlazy (lua_State *L, StkId fi) {
+  if (ttisfunction(fi) && !clvalue(fi)->c.isC && clvalue(fi)->l.p->lazy)
+    luaU_loadlazy(L, clvalue(fi)->l.p);
+}
+
+
 LUA_API const char *lua_getupvalue (lua_State *L, int funcindex, int n) {
   const char *name;
   TValue *val;
   lua_lock(L);
+  loadlazy(L, index2adr(L, funcindex));
   name = aux_upvalue(index2adr(L, funcindex), n, &val);
   if (name) {
     setobj2s(L, L->top, val);
@@ -1071,6 +1086,7 @@ LUA_API const char *lua_setupvalue (lua_State *L, int funcindex, int n) {
   TValue *val;
   StkId fi;
   lua_lock(L);
+  loadlazy(L, index2adr(L, funcindex));
   fi = index2adr(L, funcindex);
   api_checknelems(L, 1);
   name = aux_upvalue(fi, n, &val);
@@ -1083,3 +1099,68 @@ LUA_API const char *lua_setupvalue (lua_State *L, int funcindex, int n) {
   return name;
 }
 
+
+/*
+** nyEngine: write tracking for delta saves
+*/
+
+/* push an array of every table written since it was cleaned, they are clean again */
+LUA_API int lua_takedirty (lua_State *L) {
+  global_State *g = G(L);
+  Table *t;
+  int n = 0;
+  lua_newtable(L);
+  while ((t = g->dirtytables) != NULL) {
+    luaH_clean(t);
+    /* a table the collector has already found dead can't be handed out */
+    if (isdead(g, obj2gco(t)))
+      continue;
+    lua_lock(L);
+    sethvalue(L, L->top, t);
+    api_incr_top(L);
+    lua_unlock(L);
+    lua_rawseti(L, -2, ++n);
+  }
+  return n;
+}
+
+
+/* start tracking writes to a table */
+LUA_API void lua_setclean (lua_State *L, int idx) {
+  StkId o;
+  lua_lock(L);
+  o = index2adr(L, idx);
+  api_check(L, ttistable(o));
+  luaH_clean(hvalue(o));
+  lua_unlock(L);
+}
+
+
+/*
+** a Lua function whose upvalues are all closed, so none live on a thread's
+** stack, or a thread with no open upvalues on its stack
+*/
+LUA_API int lua_upvaluesclosed (lua_State *L, int funcindex) {
+  Closure *cl;
+  int i;
+  StkId fi = index2adr(L, funcindex);
+  if (ttisthread(fi)) return thvalue(fi)->openupval == NULL;
+  if (!ttisfunction(fi)) return 0;
+  cl = clvalue(fi);
+  if (cl->c.isC) return 0;
+  for (i = 0; i < cl->l.nupvalues; i++) {
+    if (cl->l.upvals[i]->v != &cl->l.upvals[i]->u.value)
+      return 0;
+  }
+  return 1;
+}
+
+
+/*
+** nyEngine: lazy undump, see lundump.c
+*/
+LUA_API void lua_setlazyundump (lua_State *L, int lazy) {
+  lua_lock(L);
+  G(L)->lazyundump = cast_byte(lazy != 0);
+  lua_unlock(L);
+}
@@ -26,6 +26,7 @@
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "lundump.h"
 #include "lvm.h"
 
 
@@ -179,9 +180,12 @@ static void collectvalidlines (lua_State *L, Closure *f) {
     setnilvalue(L->top);
   }
   else {
-    Table *t = luaH_new(L, 0, 0);
-    int *lineinfo = f->l.p->lineinfo;
+    Table *t;
+    int *lineinfo;
     int i;
+    if (f->l.p->lazy) luaU_loadlazy(L, f->l.p);  /* nyEngine: see lundump.c */
+    t = luaH_new(L, 0, 0);
+    lineinfo = f->l.p->lineinfo;
     for (i=0; i<f->l.p->sizelineinfo; i++)
       setbvalue(luaH_setnum(L, t, lineinfo[i]), 1);
     sethvalue(L, L->top, t); 
@@ -273,6 +273,8 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
     CallInfo *ci;
     StkId st, base;
     Proto *p = cl->p;
+    if (p->lazy)  /* nyEngine: first call of a function left in its chunk */
+      luaU_loadlazy(L, p);
     luaD_checkstack(L, p->maxstacksize);
     func = restorestack(L, funcr);
     if (!p->is_vararg) {  /* no varargs? */
@@ -452,6 +454,12 @@ LUA_API int lua_yield (lua_State *L, int nresults) {
 }
 
 
+/* nyEngine: lets hooks check that lua_yield won't cross a C call */
+LUA_API int lua_isyieldable (lua_State *L) {
+  return L->nCcalls <= L->baseCcalls;
+}
+
+
 int luaD_pcall (lua_State *L, Pfunc func, void *u,
                 ptrdiff_t old_top, ptrdiff_t ef) {
   int status;
@@ -128,6 +128,7 @@ static void DumpDebug(const Proto* f, DumpState* D)
 
 static void DumpFunction(const Proto* f, const TString* p, DumpState* D)
 {
+ if (f->lazy) luaU_loadlazy(D->L,(Proto*)f);	/* nyEngine: see lundump.c */
  DumpString((f->source==p || D->strip) ? NULL : f->source,D);
  DumpInt(f->linedefined,D);
  DumpInt(f->lastlinedefined,D);
@@ -134,6 +134,9 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+  f->lazy = NULL;
+  f->lazypos = 0;
+  f->gcache = NULL;
   return f;
 }
 
@@ -145,6 +148,7 @@ void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
   luaM_freearray(L, f->locvars, f->sizelocvars, struct LocVar);
   luaM_freearray(L, f->upvalues, f->sizeupvalues, TString *);
+  if (f->gcache) luaM_freearray(L, f->gcache, f->sizek, GlobalCache);
   luaM_free(L, f);
 }
 
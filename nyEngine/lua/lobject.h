@@ -237,6 +237,7 @@ typedef struct Proto {
   struct LocVar *locvars;  /* information about local variables */
   TString **upvalues;  /* upvalue names */
   TString  *source;
+  TString  *lazy;  /* nyEngine: chunk the body is still in, see lundump.c */
   int sizeupvalues;
   int sizek;  /* size of `k' */
   int sizecode;
@@ -245,6 +246,8 @@ typedef struct Proto {
   int sizelocvars;
   int linedefined;
   int lastlinedefined;
+  int lazypos;  /* nyEngine: where the body starts in `lazy' */
+  struct GlobalCache *gcache;  /* nyEngine: global lookups by constant, see lvm.c */
   GCObject *gclist;
   lu_byte nups;  /* number of upvalues */
   lu_byte numparams;
@@ -339,15 +342,34 @@ typedef struct Table {
   CommonHeader;
   lu_byte flags;  /* 1<<p means tagmethod(p) is not present */ 
   lu_byte lsizenode;  /* log2 of size of `node' array */
+  lu_byte dirty;  /* nyEngine: write tracking for delta saves, see ltable.h */
   struct Table *metatable;
   TValue *array;  /* array part */
   Node *node;
   Node *lastfree;  /* any free position is before this position */
   GCObject *gclist;
   int sizearray;  /* size of `array' array */
+  struct Table *dirtynext;  /* nyEngine: the dirty list */
+  struct Table **dirtyprev;
+  lu_int32 version;  /* nyEngine: new stamp whenever the shape changes, see ltable.h */
 } Table;
 
 
+/*
+** nyEngine: a cached global lookup, the global was in `owner', either the
+** environment itself or the table its metatable's __index holds
+*/
+typedef struct GlobalCache {
+  struct Table *env;  /* NULL when nothing is cached */
+  struct Table *owner;
+  const TValue *index;  /* the __index slot, NULL when owner is env */
+  const TValue *slot;  /* the global in owner */
+  lu_int32 envversion;
+  lu_int32 mtversion;
+  lu_int32 ownerversion;
+} GlobalCache;
+
+
 
 /*
 ** `module' operation for hashing (size is always a power of 2)
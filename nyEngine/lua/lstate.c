@@ -166,6 +166,10 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   setnilvalue(registry(L));
   luaZ_initbuffer(L, &g->buff);
   g->panic = NULL;
+  g->dirtytables = NULL;
+  g->lazyundump = 0;
+  g->seed = luai_makeseed(L);
+  g->tableversion = 0;
   g->gcstate = GCSpause;
   g->rootgc = obj2gco(L);
   g->sweepstrgc = 0;
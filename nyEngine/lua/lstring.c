@@ -72,13 +72,47 @@ static TString *newlstr (lua_State *L, const char *str, size_t l,
 }
 
 
+/*
+** nyEngine: hash every byte, four at a time (MurmurHash3, x86_32)
+** The stock hash looked at no more than 32 characters of a string, and
+** paths sharing a long prefix piled up in the same buckets
+*/
+#define rotl32(x,n)	(((x) << (n)) | ((x) >> (32 - (n))))
+#define mixword(k)	((k) *= 0xcc9e2d51, (k) = rotl32(k, 15), (k) *= 0x1b873593)
+
+unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
+  lu_int32 h = seed ^ cast(lu_int32, l);
+  lu_int32 k;
+  size_t i;
+  for (i = 0; i + 4 <= l; i += 4) {
+    memcpy(&k, str + i, 4);  /* strings have no alignment */
+    mixword(k);
+    h ^= k;
+    h = rotl32(h, 13);
+    h = h * 5 + 0xe6546b64;
+  }
+  k = 0;
+  switch (l & 3) {
+    case 3: k ^= cast(lu_int32, cast(unsigned char, str[i + 2])) << 16;
+      /* FALLTHROUGH */
+    case 2: k ^= cast(lu_int32, cast(unsigned char, str[i + 1])) << 8;
+      /* FALLTHROUGH */
+    case 1: k ^= cast(lu_int32, cast(unsigned char, str[i]));
+      mixword(k);
+      h ^= k;
+  }
+  h ^= h >> 16;  /* final mix */
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+
 TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
   GCObject *o;
-  unsigned int h = cast(unsigned int, l);  /* seed */
-  size_t step = (l>>5)+1;  /* if string is too long, don't hash all its chars */
-  size_t l1;
-  for (l1=l; l1>=step; l1-=step)  /* compute hash */
-    h = h ^ ((h<<5)+(h>>2)+cast(unsigned char, str[l1-1]));
+  unsigned int h = luaS_hash(str, l, G(L)->seed);
   for (o = G(L)->strt.hash[lmod(h, G(L)->strt.size)];
        o != NULL;
        o = o->gch.next) {
@@ -299,6 +299,7 @@ static void resize (lua_State *L, Table *t, int nasize, int nhsize) {
   int oldasize = t->sizearray;
   int oldhsize = t->lsizenode;
   Node *nold = t->node;  /* save old hash ... */
+  luaH_newversion(L, t);
   if (nasize > oldasize)  /* array part must grow? */
     setarrayvector(L, t, nasize);
   /* create new hash part with appropriate size */
@@ -360,6 +361,10 @@ Table *luaH_new (lua_State *L, int narray, int nhash) {
   luaC_link(L, obj2gco(t), LUA_TTABLE);
   t->metatable = NULL;
   t->flags = cast_byte(~0);
+  t->dirty = TABLE_UNTRACKED;
+  t->dirtynext = NULL;
+  t->dirtyprev = NULL;
+  luaH_newversion(L, t);
   /* temporary values (kept only if some malloc fails) */
   t->array = NULL;
   t->sizearray = 0;
@@ -372,6 +377,7 @@ Table *luaH_new (lua_State *L, int narray, int nhash) {
 
 
 void luaH_free (lua_State *L, Table *t) {
+  luaH_clean(t);
   if (t->node != dummynode)
     luaM_freearray(L, t->node, sizenode(t), Node);
   luaM_freearray(L, t->array, t->sizearray, TValue);
@@ -423,6 +429,7 @@ static TValue *newkey (lua_State *L, Table *t, const TValue *key) {
     }
   }
   gkey(mp)->value = key->value; gkey(mp)->tt = key->tt;
+  luaH_newversion(L, t);
   luaC_barriert(L, t, key);
   lua_assert(ttisnil(gval(mp)));
   return gval(mp);
@@ -491,11 +498,39 @@ const TValue *luaH_get (Table *t, const TValue *key) {
 }
 
 
+void luaH_linkdirty (lua_State *L, Table *t) {
+  global_State *g = G(L);
+  t->dirty = TABLE_DIRTY;
+  t->dirtynext = g->dirtytables;
+  t->dirtyprev = &g->dirtytables;
+  if (g->dirtytables)
+    g->dirtytables->dirtyprev = &t->dirtynext;
+  g->dirtytables = t;
+}
+
+
+/* take a table off the dirty list, it is tracked from now on */
+void luaH_clean (Table *t) {
+  if (t->dirty == TABLE_DIRTY) {
+    *t->dirtyprev = t->dirtynext;
+    if (t->dirtynext)
+      t->dirtynext->dirtyprev = t->dirtyprev;
+    t->dirtynext = NULL;
+    t->dirtyprev = NULL;
+  }
+  t->dirty = TABLE_CLEAN;
+}
+
+
 TValue *luaH_set (lua_State *L, Table *t, const TValue *key) {
   const TValue *p = luaH_get(t, key);
   t->flags = 0;
-  if (p != luaO_nilobject)
+  luaH_markdirty(L, t);
+  if (p != luaO_nilobject) {
+    if (ttisnil(p) && ttisstring(key))
+      luaH_newversion(L, t);  /* nyEngine: a global may appear */
     return cast(TValue *, p);
+  }
   else {
     if (ttisnil(key)) luaG_runerror(L, "table index is nil");
     else if (ttisnumber(key) && luai_numisnan(nvalue(key)))
@@ -507,6 +542,7 @@ TValue *luaH_set (lua_State *L, Table *t, const TValue *key) {
 
 TValue *luaH_setnum (lua_State *L, Table *t, int key) {
   const TValue *p = luaH_getnum(t, key);
+  luaH_markdirty(L, t);
   if (p != luaO_nilobject)
     return cast(TValue *, p);
   else {
@@ -519,8 +555,11 @@ TValue *luaH_setnum (lua_State *L, Table *t, int key) {
 
 TValue *luaH_setstr (lua_State *L, Table *t, TString *key) {
   const TValue *p = luaH_getstr(t, key);
-  if (p != luaO_nilobject)
+  luaH_markdirty(L, t);
+  if (p != luaO_nilobject) {
+    if (ttisnil(p)) luaH_newversion(L, t);  /* nyEngine: a global may appear */
     return cast(TValue *, p);
+  }
   else {
     TValue k;
     setsvalue(L, &k, key);
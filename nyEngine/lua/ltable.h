@@ -25,6 +25,31 @@ LUAI_FUNC TValue *luaH_setstr (lua_State *L, Table *t, TString *key);
 LUAI_FUNC const TValue *luaH_get (Table *t, const TValue *key);
 LUAI_FUNC TValue *luaH_set (lua_State *L, Table *t, const TValue *key);
 LUAI_FUNC Table *luaH_new (lua_State *L, int narray, int lnhash);
+
+/*
+** nyEngine: write tracking for delta saves
+** New tables aren't tracked, once a table is cleaned the first write after
+** puts it on the global dirty list
+*/
+#define TABLE_UNTRACKED	0
+#define TABLE_CLEAN	1
+#define TABLE_DIRTY	2
+
+#define luaH_markdirty(L,t) \
+	{ if ((t)->dirty == TABLE_CLEAN) luaH_linkdirty(L, t); }
+
+/*
+** nyEngine: version stamps for the global caches in lvm.c
+** Every table gets a new stamp from a counter in global_State when it is
+** made and whenever a key is added, the table is resized, a nil slot is
+** written or its metatable changes. A cached slot pointer stays good while
+** the stamp it was cached with does, and stamps are never reused (until
+** the counter wraps), so a freed table's stamp can't match a new one's.
+*/
+#define luaH_newversion(L,t)	((t)->version = ++G(L)->tableversion)
+
+LUAI_FUNC void luaH_linkdirty (lua_State *L, Table *t);
+LUAI_FUNC void luaH_clean (Table *t);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, int nasize);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
@@ -213,6 +213,20 @@ LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data);
 LUA_API int  (lua_yield) (lua_State *L, int nresults);
 LUA_API int  (lua_resume) (lua_State *L, int narg);
 LUA_API int  (lua_status) (lua_State *L);
+LUA_API int  (lua_isyieldable) (lua_State *L);
+
+/*
+** nyEngine: write tracking for delta saves
+*/
+LUA_API int  (lua_takedirty) (lua_State *L);
+LUA_API void (lua_setclean) (lua_State *L, int idx);
+LUA_API int  (lua_upvaluesclosed) (lua_State *L, int funcindex);
+
+/*
+** nyEngine: lazy undump, the nested functions of binary chunks loaded while
+** this is on are only loaded the first time they are called
+*/
+LUA_API void (lua_setlazyundump) (lua_State *L, int lazy);
 
 /*
 ** garbage-collection function and options
@@ -226,6 +240,8 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCSTEP		5
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
+/* nyEngine: stop the collector until the heap reaches data Kbytes */
+#define LUA_GCLIMIT		8
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -706,13 +706,38 @@ union luai_Cast { double l_d; long l_l; };
 #endif
 
 
+/*
+@@ LUA_USE_COMPUTEDGOTO makes luaV_execute dispatch instructions with
+@* computed gotos (threaded code) instead of a switch.
+** nyEngine: opt-in, define it for the build. It needs the labels-as-values
+** extension of GCC and Clang, other compilers keep the switch.
+*/
+#if defined(LUA_USE_COMPUTEDGOTO) && !defined(__GNUC__)
+#undef LUA_USE_COMPUTEDGOTO
+#endif
+
+
+/*
+@@ luai_makeseed is the seed of the string hash in a new state.
+** nyEngine: the order pairs() walks a table in follows the hash, so the
+** seed is a constant to keep that order the same from run to run.
+*/
+#define luai_makeseed(L)	((unsigned int)0x2545F491)
+
+
 /*
 @@ LUAI_EXTRASPACE allows you to add user-specific data in a lua_State
 @* (the data goes just *before* the lua_State pointer).
 ** CHANGE (define) this if you really need that. This value must be
 ** a multiple of the maximum alignment required for your machine.
 */
-#define LUAI_EXTRASPACE		0
+#define LUAI_EXTRASPACE		sizeof(double)
+
+/*
+@@ lua_extraspace is the pointer stored in the extra space of a lua_State.
+** nyEngine keeps the scheduler record of a script thread here.
+*/
+#define lua_extraspace(L)	(*(void **)((char *)(L) - LUAI_EXTRASPACE))
 
 
 /*
@@ -720,9 +745,9 @@ union luai_Cast { double l_d; long l_l; };
 ** CHANGE them if you defined LUAI_EXTRASPACE and need to do something
 ** extra when a thread is created/deleted/resumed/yielded.
 */
-#define luai_userstateopen(L)		((void)L)
+#define luai_userstateopen(L)		(lua_extraspace(L) = NULL)
 #define luai_userstateclose(L)		((void)L)
-#define luai_userstatethread(L,L1)	((void)L)
+#define luai_userstatethread(L,L1)	(lua_extraspace(L1) = NULL)
 #define luai_userstatefree(L)		((void)L)
 #define luai_userstateresume(L,n)	((void)L)
 #define luai_userstateyield(L,n)	((void)L)
@@ -14,8 +14,10 @@
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
+#include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lstate.h"
 #include "lstring.h"
 #include "lundump.h"
 #include "lzio.h"
@@ -25,6 +27,7 @@ typedef struct {
  ZIO* Z;
  Mbuffer* b;
  const char* name;
+ TString* lazy;		/* nyEngine: whole chunk when nested functions are left in it */
 } LoadState;
 
 #ifdef LUAC_TRUST_BINARIES
@@ -96,7 +99,7 @@ static void LoadCode(LoadState* S, Proto* f)
  LoadVector(S,f->code,n,sizeof(Instruction));
 }
 
-static Proto* LoadFunction(LoadState* S, TString* p);
+static Proto* LoadFunction(LoadState* S, TString* p, int lazy);
 
 static void LoadConstants(LoadState* S, Proto* f)
 {
@@ -122,6 +125,7 @@ static void LoadConstants(LoadState* S, Proto* f)
 	break;
    case LUA_TSTRING:
 	setsvalue2n(S->L,o,LoadString(S));
+	luaC_barrier(S->L,f,o);		/* nyEngine: f can be black in luaU_loadlazy */
 	break;
    default:
 	error(S,"bad constant");
@@ -132,7 +136,11 @@ static void LoadConstants(LoadState* S, Proto* f)
  f->p=luaM_newvector(S->L,n,Proto*);
  f->sizep=n;
  for (i=0; i<n; i++) f->p[i]=NULL;
- for (i=0; i<n; i++) f->p[i]=LoadFunction(S,f->source);
+ for (i=0; i<n; i++)
+ {
+  f->p[i]=LoadFunction(S,f->source,S->lazy!=NULL);
+  luaC_objbarrier(S->L,f,f->p[i]);
+ }
 }
 
 static void LoadDebug(LoadState* S, Proto* f)
@@ -149,6 +157,7 @@ static void LoadDebug(LoadState* S, Proto* f)
  for (i=0; i<n; i++)
  {
   f->locvars[i].varname=LoadString(S);
+  if (f->locvars[i].varname) luaC_objbarrier(S->L,f,f->locvars[i].varname);
   f->locvars[i].startpc=LoadInt(S);
   f->locvars[i].endpc=LoadInt(S);
  }
@@ -156,10 +165,95 @@ static void LoadDebug(LoadState* S, Proto* f)
  f->upvalues=luaM_newvector(S->L,n,TString*);
  f->sizeupvalues=n;
  for (i=0; i<n; i++) f->upvalues[i]=NULL;
- for (i=0; i<n; i++) f->upvalues[i]=LoadString(S);
+ for (i=0; i<n; i++)
+ {
+  f->upvalues[i]=LoadString(S);
+  if (f->upvalues[i]) luaC_objbarrier(S->L,f,f->upvalues[i]);
+ }
+}
+
+static void LoadBody(LoadState* S, Proto* f)
+{
+ LoadCode(S,f);
+ LoadConstants(S,f);
+ LoadDebug(S,f);
+ IF (!luaG_checkcode(f), "bad code");
+}
+
+/*
+** nyEngine: lazy undump
+** With G(L)->lazyundump set the whole chunk is kept as a string and only
+** the main function is loaded. Nested functions get their header fields
+** and remember where their body starts, the body is checked and skipped
+** and only loaded by luaU_loadlazy the first time the function is called
+** (or dumped, persisted, or asked for its upvalue names or lines).
+*/
+
+static void SkipBlock(LoadState* S, size_t size)
+{
+ IF (size>S->Z->n, "unexpected end");
+ S->Z->p+=size;
+ S->Z->n-=size;
+}
+
+static void SkipVector(LoadState* S, int n, size_t size)
+{
+ IF ((size_t)n>S->Z->n/size, "unexpected end");
+ SkipBlock(S,n*size);
+}
+
+static void SkipString(LoadState* S)
+{
+ size_t size;
+ LoadVar(S,size);
+ SkipBlock(S,size);
 }
 
-static Proto* LoadFunction(LoadState* S, TString* p)
+static void SkipBody(LoadState* S)
+{
+ int i,n;
+ SkipVector(S,LoadInt(S),sizeof(Instruction));
+ n=LoadInt(S);
+ for (i=0; i<n; i++)
+ {
+  switch (LoadChar(S))
+  {
+   case LUA_TNIL:
+	break;
+   case LUA_TBOOLEAN:
+	SkipBlock(S,1);
+	break;
+   case LUA_TNUMBER:
+	SkipBlock(S,sizeof(lua_Number));
+	break;
+   case LUA_TSTRING:
+	SkipString(S);
+	break;
+   default:
+	error(S,"bad constant");
+	break;
+  }
+ }
+ n=LoadInt(S);
+ for (i=0; i<n; i++)
+ {
+  SkipString(S);
+  LoadInt(S); LoadInt(S);
+  SkipBlock(S,4);	/* nups, numparams, is_vararg, maxstacksize */
+  SkipBody(S);
+ }
+ SkipVector(S,LoadInt(S),sizeof(int));
+ n=LoadInt(S);
+ for (i=0; i<n; i++)
+ {
+  SkipString(S);
+  LoadInt(S); LoadInt(S);
+ }
+ n=LoadInt(S);
+ for (i=0; i<n; i++) SkipString(S);
+}
+
+static Proto* LoadFunction(LoadState* S, TString* p, int lazy)
 {
  Proto* f=luaF_newproto(S->L);
  setptvalue2s(S->L,S->L->top,f); incr_top(S->L);
@@ -170,10 +264,14 @@ static Proto* LoadFunction(LoadState* S, TString* p)
  f->numparams=LoadByte(S);
  f->is_vararg=LoadByte(S);
  f->maxstacksize=LoadByte(S);
- LoadCode(S,f);
- LoadConstants(S,f);
- LoadDebug(S,f);
- IF (!luaG_checkcode(f), "bad code");
+ if (lazy)
+ {
+  f->lazy=S->lazy;
+  f->lazypos=cast_int(S->Z->p-getstr(S->lazy));
+  SkipBody(S);
+ }
+ else
+  LoadBody(S,f);
  S->L->top--;
  return f;
 }
@@ -187,23 +285,102 @@ static void LoadHeader(LoadState* S)
  IF (memcmp(h,s,LUAC_HEADERSIZE)!=0, "bad header");
 }
 
+static const char* NoReader(lua_State* L, void* ud, size_t* size)
+{
+ UNUSED(L); UNUSED(ud);
+ *size=0;
+ return NULL;
+}
+
+static void OpenLazy(LoadState* S, ZIO* z, size_t pos)
+{
+ luaZ_init(S->L,z,NoReader,NULL);
+ z->p=getstr(S->lazy)+pos;
+ z->n=S->lazy->tsv.len-pos;
+ S->Z=z;
+}
+
+static Proto* LoadLazy(LoadState* S)
+{
+ ZIO z;
+ Proto* f;
+ size_t n=0;
+ while (luaZ_lookahead(S->Z)!=EOZ)	/* gather the rest of the chunk */
+ {
+  size_t m=S->Z->n;
+  if (n+m>luaZ_sizebuffer(S->b))
+  {
+   size_t size=2*luaZ_sizebuffer(S->b);
+   luaZ_resizebuffer(S->L,S->b,size>n+m ? size : n+m);
+  }
+  memcpy(luaZ_buffer(S->b)+n,S->Z->p,m);
+  n+=m;
+  S->Z->p+=m;
+  S->Z->n=0;
+ }
+ S->lazy=luaS_newlstr(S->L,luaZ_buffer(S->b),n);
+ setsvalue2s(S->L,S->L->top,S->lazy); incr_top(S->L);
+ OpenLazy(S,&z,0);
+ f=LoadFunction(S,luaS_newliteral(S->L,"=?"),0);
+ S->L->top--;
+ return f;
+}
+
+static const char* ChunkName(const char* name)
+{
+ if (*name=='@' || *name=='=')
+  return name+1;
+ else if (*name==LUA_SIGNATURE[0])
+  return "binary string";
+ else
+  return name;
+}
+
 /*
 ** load precompiled chunk
 */
 Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
 {
  LoadState S;
- if (*name=='@' || *name=='=')
-  S.name=name+1;
- else if (*name==LUA_SIGNATURE[0])
-  S.name="binary string";
- else
-  S.name=name;
+ S.name=ChunkName(name);
  S.L=L;
  S.Z=Z;
  S.b=buff;
+ S.lazy=NULL;
  LoadHeader(&S);
- return LoadFunction(&S,luaS_newliteral(L,"=?"));
+ if (G(L)->lazyundump) return LoadLazy(&S);
+ return LoadFunction(&S,luaS_newliteral(L,"=?"),0);
+}
+
+/*
+** nyEngine: load the body of a function left in its chunk by a lazy undump
+*/
+void luaU_loadlazy (lua_State* L, Proto* f)
+{
+ LoadState S;
+ ZIO z;
+ S.name=ChunkName(getstr(f->source));
+ S.L=L;
+ S.b=&G(L)->buff;
+ S.lazy=f->lazy;
+ /* drop whatever a load that failed part way left behind */
+ if (f->gcache) luaM_freearray(L, f->gcache, f->sizek, GlobalCache);
+ f->gcache=NULL;
+ luaM_freearray(L, f->code, f->sizecode, Instruction);
+ luaM_freearray(L, f->p, f->sizep, Proto *);
+ luaM_freearray(L, f->k, f->sizek, TValue);
+ luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
+ luaM_freearray(L, f->locvars, f->sizelocvars, struct LocVar);
+ luaM_freearray(L, f->upvalues, f->sizeupvalues, TString *);
+ f->code=NULL; f->sizecode=0;
+ f->p=NULL; f->sizep=0;
+ f->k=NULL; f->sizek=0;
+ f->lineinfo=NULL; f->sizelineinfo=0;
+ f->locvars=NULL; f->sizelocvars=0;
+ f->upvalues=NULL; f->sizeupvalues=0;
+ OpenLazy(&S,&z,f->lazypos);
+ LoadBody(&S,f);
+ f->lazy=NULL;
 }
 
 /*
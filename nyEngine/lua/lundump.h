@@ -13,6 +13,9 @@
 /* load one chunk; from lundump.c */
 LUAI_FUNC Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name);
 
+/* nyEngine: load a function left in its chunk by a lazy undump; from lundump.c */
+LUAI_FUNC void luaU_loadlazy (lua_State* L, Proto* f);
+
 /* make header; from lundump.c */
 LUAI_FUNC void luaU_header (char* h);
 
@@ -54,65 +54,88 @@ void CMapLoader::mapAdd(LOADED_MAP& map)
 	LoadScripts(map.map);
 }
 
-sectionitem_t* CMapLoader::LoadItem(const char * path, uint section, LOADED_MAP * map)
+// The item with this id in one map, if its name and section match as well
+// The id ignores case, so names are checked case sensitively like mapLookupItem does
+static sectionitem_t* matchItem(map_t * map, uint id, const char * path, uint section)
+{
+	sectionitem_t* item;
+
+	if(map == NULL || (item = mapLookupId(*map, id, false)) == NULL)
+		return NULL;
+
+	if((path && strcmp(item->name, path) != 0) || (section != MSectionCount && item->section != section))
+		return NULL;
+
+	return item;
+}
+
+// Find an item across the loaded maps, patches are checked before their map
+// If a path is given, the name of the item must match it, MSectionCount matches any section
+sectionitem_t* CMapLoader::lookupItem(uint id, const char * path, uint section, LOADED_MAP * map, map_t ** owner)
 {
 	uint i;
 	sectionitem_t* item;
 	for(i = 0;i < mapList.size();i++)
 	{
-		if(((mapList[i].patch) && ((item = mapLookupItem(*mapList[i].patch, section, path)))) ||
-				(item = mapLookupItem(*mapList[i].map, section, path)))
-		{
+		if((item = matchItem(mapList[i].patch, id, path, section)) != NULL)
+			*owner = mapList[i].patch;
+		else if((item = matchItem(mapList[i].map, id, path, section)) != NULL)
+			*owner = mapList[i].map;
+		else
+			continue;
+
+		if(map)
 			*map = mapList[i];
-			return item;
-		}
+
+		return item;
 	}
 
 	return NULL;
 }
 
+sectionitem_t* CMapLoader::LoadItem(const char * path, uint section, LOADED_MAP * map)
+{
+	map_t * owner;
+	sectionitem_t* item = lookupItem(mapResourceId(path), path, section, map, &owner);
+
+	if(item == NULL)
+		return NULL;
+
+	return mapLoadItem(*owner, item->section, item->index);
+}
+
 sectionitem_t* CMapLoader::LoadItem(const char * path, LOADED_MAP * map)
 {
-	uint i, j;
-	sectionitem_t* item;
-	for(i = 0;i < mapList.size();i++)
-	{
-		for(j = 0;j < MSectionCount;j++) 
-		{
-			if(((mapList[i].patch) && ((item = mapLookupItem(*mapList[i].patch, j, path)))) ||
-				(item = mapLookupItem(*mapList[i].map, j, path)))
-			{
-				if(map)
-					*map = mapList[i];
-
-				return item;
-			}
-		}
-	}
+	map_t * owner;
+	sectionitem_t* item = lookupItem(mapResourceId(path), path, MSectionCount, map, &owner);
 
-	return NULL;
+	if(item == NULL)
+		return NULL;
+
+	return mapLoadItem(*owner, item->section, item->index);
+}
+
+sectionitem_t* CMapLoader::LoadItem(uint id, LOADED_MAP * map)
+{
+	map_t * owner;
+	sectionitem_t* item = lookupItem(id, NULL, MSectionCount, map, &owner);
+
+	if(item == NULL)
+		return NULL;
+
+	return mapLoadItem(*owner, item->section, item->index);
 }
 
 sectionitem_t* CMapLoader::FindItem(const char * path, LOADED_MAP * map)
 {
-	uint i, j;
-	sectionitem_t* item;
-	for(i = 0;i < mapList.size();i++)
-	{
-		for(j = 0;j < MSectionCount;j++) 
-		{
-			if(((mapList[i].patch) && ((item = mapLookupItem(*mapList[i].patch, j, path, false)))) ||
-				(item = mapLookupItem(*mapList[i].map, j, path, false)))
-			{
-				if(map)
-					*map = mapList[i];
-
-				return item;
-			}
-		}
-	}
+	map_t * owner;
+	return lookupItem(mapResourceId(path), path, MSectionCount, map, &owner);
+}
 
-	return NULL;
+sectionitem_t* CMapLoader::FindItem(uint id, LOADED_MAP * map)
+{
+	map_t * owner;
+	return lookupItem(id, NULL, MSectionCount, map, &owner);
 }
 
 void CMapLoader::SetupScripts()
@@ -149,8 +172,13 @@ void CMapLoader::LoadMap(const char * name, LOADED_MAP * map, bool keepLoaded)
 		loadedPatch = NULL;
 	}
 	else
+	{
 		dbgOut("map '%s' has patch", name);
 
+		// Delta items in the patch are rebuilt from this map
+		mapSetBase(*loadedPatch, *loadedMap);
+	}
+
 	// Add the patch before the map so that the patch resources are used first
 	ldmap.map = loadedMap;
 	ldmap.patch = loadedPatch;
@@ -25,11 +25,13 @@ public:
 
 	void init(class CLuaManager * lua);
 	void deinit();
-	// Load the first item with this name
+	// Load the first item with this name or resource id
 	sectionitem_t* LoadItem(const char * path, uint section, LOADED_MAP * map = NULL);
 	sectionitem_t* LoadItem(const char * path, LOADED_MAP * map = NULL);
+	sectionitem_t* LoadItem(uint id, LOADED_MAP * map = NULL);
 	// Find the item, but do not load it
 	sectionitem_t* FindItem(const char * path, LOADED_MAP * map = NULL);
+	sectionitem_t* FindItem(uint id, LOADED_MAP * map = NULL);
 	// Load and unload stuff
 	void SetupScripts();
 	void LoadMap(const char * name, LOADED_MAP * map = NULL, bool keepLoaded = false);
@@ -46,6 +48,7 @@ public:
 
 private:
 	void mapAdd(LOADED_MAP& map);
+	sectionitem_t* lookupItem(uint id, const char * path, uint section, LOADED_MAP * map, map_t ** owner);
 
 	bool hasInit;
 	class CLuaManager * luaManager;
@@ -2,12 +2,48 @@
 #include "..\util\LuaManager.h"
 #include <io.h>
 #include <vector>
+#include <map>
 #include <../zlib.h>
 
 #ifdef _WIN32
 #include <Windows.h>
 #endif // _WIN32
 
+uint mapResourceId(const char * name)
+{
+	// FNV-1a over the lower case name, item names are not case sensitive
+	uint id = 2166136261u;
+
+	while(*name)
+	{
+		id ^= (byte)tolower(*name++);
+		id *= 16777619u;
+	}
+
+	if(id == MAP_INVALID_ID)
+		id = 1;
+
+	return id;
+}
+
+// Turn a name into an upper case C identifier
+void mapResourceSymbol(const char * name, string& symbol)
+{
+	char buffer[0x200];
+	uint i;
+
+	for(i = 0;name[i] && i < sizeof(buffer) - 1;i++)
+	{
+		if(isalnum((byte)name[i]))
+			buffer[i] = toupper(name[i]);
+		else
+			buffer[i] = '_';
+	}
+
+	buffer[i] = 0;
+	symbol = buffer;
+}
+
 // Strip this code from release builds
 #ifdef _DEBUG
 void mapGatherDirectory(string& dir, string& prefix, int dirClip, std::vector<string>& files)
@@ -91,17 +127,213 @@ void mapCompileLua(const char * filename, const char * outname)
 	out.close();
 }
 
-void mapCompile(const char * filename, const char * path, const char * prefix)
+// Delta compression settings
+#define DELTA_HASH_BITS 16
+#define DELTA_MIN_MATCH 16
+#define DELTA_MAX_CHAIN 32
+
+static uint mapDeltaHash(const byte * data)
+{
+	uint a, b;
+
+	memcpy(&a, data, sizeof(a));
+	memcpy(&b, data + 4, sizeof(b));
+
+	return ((a * 2654435761u) ^ (b * 2246822519u)) >> (32 - DELTA_HASH_BITS);
+}
+
+static void mapDeltaWrite(std::vector<byte>& delta, uint x)
+{
+	byte * c = (byte*)&x;
+	delta.insert(delta.end(), c, c + sizeof(x));
+}
+
+static void mapDeltaInsert(std::vector<byte>& delta, const byte * data, uint length)
+{
+	if(length == 0)
+		return;
+
+	delta.push_back((byte)MAP_DELTA_INSERT);
+	mapDeltaWrite(delta, length);
+	delta.insert(delta.end(), data, data + length);
+}
+
+// Build a delta that turns the base item into 'data'
+void mapCompileDelta(sectionitem_t * base, const byte * data, uint size, std::vector<byte>& delta)
+{
+	uint i, literal;
+	int candidate, chain, bestOffset;
+	uint bestLength, length;
+	std::vector<int> head, prev;
+
+	delta.clear();
+	mapDeltaWrite(delta, base->size);
+	mapDeltaWrite(delta, crc32(0, base->data, base->size));
+
+	// Hash every position of the base item, the chains are walked newest first
+	head.resize(1 << DELTA_HASH_BITS, -1);
+	if(base->size >= DELTA_MIN_MATCH)
+	{
+		prev.resize(base->size);
+		for(i = 0;i + DELTA_MIN_MATCH <= base->size;i++)
+		{
+			uint h = mapDeltaHash(base->data + i);
+			prev[i] = head[h];
+			head[h] = i;
+		}
+	}
+
+	i = 0;
+	literal = 0;
+	while(i < size)
+	{
+		bestLength = 0;
+		bestOffset = 0;
+
+		if(i + DELTA_MIN_MATCH <= size && base->size >= DELTA_MIN_MATCH)
+		{
+			candidate = head[mapDeltaHash(data + i)];
+			for(chain = 0;candidate != -1 && chain < DELTA_MAX_CHAIN;chain++)
+			{
+				length = 0;
+				while(i + length < size && candidate + length < base->size &&
+					data[i + length] == base->data[candidate + length])
+					length++;
+
+				if(length > bestLength)
+				{
+					bestLength = length;
+					bestOffset = candidate;
+				}
+
+				candidate = prev[candidate];
+			}
+		}
+
+		if(bestLength < DELTA_MIN_MATCH)
+		{
+			i++;
+			continue;
+		}
+
+		// Flush any literal data before the match
+		mapDeltaInsert(delta, data + literal, i - literal);
+
+		delta.push_back((byte)MAP_DELTA_COPY);
+		mapDeltaWrite(delta, (uint)bestOffset);
+		mapDeltaWrite(delta, bestLength);
+
+		i += bestLength;
+		literal = i;
+	}
+
+	mapDeltaInsert(delta, data + literal, size - literal);
+	delta.push_back((byte)MAP_DELTA_END);
+}
+
+// Deflate a block of data into the map, returns the compressed size
+uint mapCompileData(file& map, const byte * data, uint size)
 {
-	uint i, j, k, l;
-	char buffer[(1024 * 3) / 2];
 	char compBuffer[1024 * 3];
-	uint readLen, writeLen;
+	uint writeLen, compressedSize = 0;
+	z_stream str;
+	int err;
+
+	if(size == 0)
+		return 0;
+
+	memset(&str, 0, sizeof(str));
+	if(deflateInit(&str, 7) < Z_OK)
+		dbgError("deflateInit failed");
+
+	str.next_in = (Bytef*)data;
+	str.avail_in = size;
+
+	do
+	{
+		str.next_out = (Bytef*)compBuffer;
+		str.avail_out = sizeof(compBuffer);
+
+		err = deflate(&str, Z_FINISH);
+		if(err < Z_OK)
+			dbgError("failed to deflate");
+
+		writeLen = sizeof(compBuffer) - str.avail_out;
+		if(writeLen)
+		{
+			map.write(compBuffer, writeLen);
+			compressedSize += writeLen;
+		}
+	} while(err != Z_STREAM_END);
+
+	deflateEnd(&str);
+
+	return compressedSize;
+}
+
+// Write the resource id header for a map
+void mapCompileHeader(const char * filename, std::vector<string>& names, std::vector<uint>& ids)
+{
+	file out;
+	string headerName, symbol, line;
+	char buffer[0x20], baseName[0x200];
+	char * c;
+	uint i;
+
+	// map.nym -> map.h
+	memset(baseName, 0, sizeof(baseName));
+	strncpy(baseName, filename, sizeof(baseName) - 1);
+	if((c = strrchr(baseName, '.')) != NULL)
+		*c = 0;
+
+	mapResourceSymbol(baseName, symbol);
+	headerName = baseName;
+	headerName += ".h";
+
+	if(!out.openWrite(headerName.c_str(), false))
+		dbgError("unable to open '%s' for writing", headerName.c_str());
+
+	line = "// Resource ids for '";
+	line += filename;
+	line += "', generated by mapCompile\n";
+	line += "#ifndef _RES_";
+	line += symbol;
+	line += "_H\n#define _RES_";
+	line += symbol;
+	line += "_H\n\n";
+	out.write(line.c_str(), line.length());
+
+	for(i = 0;i < names.size();i++)
+	{
+		mapResourceSymbol(names[i].c_str(), symbol);
+		_snprintf(buffer, sizeof(buffer), " 0x%08X // ", ids[i]);
+		buffer[sizeof(buffer) - 1] = 0;
+
+		line = "#define RES_";
+		line += symbol;
+		line += buffer;
+		line += names[i];
+		line += "\n";
+		out.write(line.c_str(), line.length());
+	}
+
+	line = "\n#endif\n";
+	out.write(line.c_str(), line.length());
+	out.close();
+}
+
+void mapCompile(const char * filename, const char * path, const char * prefix, map_t * base)
+{
+	uint i, j, k, l;
 	file map, item;
 	string dir = path, pre = prefix, name;
-	std::vector<string> files;
+	std::vector<string> files, names;
 	std::vector<int> types;
-	z_stream str;
+	std::vector<uint> ids;
+	std::map<uint, uint> idOwners;
+	std::map<uint, uint>::iterator owner;
+	uint id;
+	std::vector<byte> delta;
 	int typeCounts[MSectionCount] = {0};
 	const char * extensions[] =
 	{
@@ -162,6 +394,19 @@ void mapCompile(const char * filename, const char * path, const char * prefix)
 
 		types.push_back(fileType);
 		typeCounts[fileType]++;
+
+		// Assign the resource id, these must be unique within a map
+		name = prefix;
+		name += files[i];
+
+		id = mapResourceId(name.c_str());
+		owner = idOwners.find(id);
+		if(owner != idOwners.end())
+			dbgError("resource id collision between '%s' and '%s'", names[owner->second].c_str(), name.c_str());
+
+		idOwners[id] = names.size();
+		names.push_back(name);
+		ids.push_back(id);
 	}
 
 	// Build the map
@@ -190,8 +435,10 @@ void mapCompile(const char * filename, const char * path, const char * prefix)
 		// Items
 		for(j = 0;j < files.size();j++)
 		{
-			uint compressedSize = 0;
-			uint size, compressedSizeOffset;
+			uint compressedSize, deltaSize;
+			uint size, payloadSize, compressedSizeOffset;
+			byte * data, * payload;
+			sectionitem_t * baseItem;
 
 			if(types[j] != i)
 				continue;
@@ -220,73 +467,41 @@ void mapCompile(const char * filename, const char * path, const char * prefix)
 			name += files[j];
 
 			size = item.size();
+			data = (byte*)malloc(size + 1);
+			if(data == NULL)
+				dbgError("mapCompile - out of memory");
 
-			map.write(size);
-			compressedSizeOffset = map.offset();
-			map.write((uint)0);
+			item.read(data, size);
+			item.close();
 
-			name.save(map);
+			// Store the item as a delta if it exists in the base map and the delta is worth it
+			deltaSize = 0;
+			payload = data;
+			payloadSize = size;
 
-			memset(&str, 0, sizeof(str));
-			if(deflateInit(&str, 7) < Z_OK)
-				dbgError("deflateInit failed");
-			
-			while(size)
+			if(base && (baseItem = mapLookupItem(*base, i, name.c_str())) != NULL)
 			{
-				readLen = sizeof(buffer);
-
-				if(readLen > size)
-					readLen = size;
-
-				writeLen = readLen;
-
-				size -= readLen;
+				mapCompileDelta(baseItem, data, size, delta);
+				mapUnloadItem(baseItem);
 
-				item.read(buffer, readLen);
-				str.next_in = (Bytef*)buffer;
-				str.avail_in = readLen;
-				str.next_out = (Bytef*)compBuffer;
-				str.avail_out = sizeof(compBuffer);
-
-				while(str.avail_in)
+				if(delta.size() < size - size / 8)
 				{
-					if(deflate(&str, Z_NO_FLUSH) < Z_OK)
-						dbgError("deflate failed");
-
-					writeLen = sizeof(compBuffer) - str.avail_out;
-					if(writeLen)
-					{
-						map.write(compBuffer, writeLen);
-						str.next_out = (Bytef*)compBuffer;
-						str.avail_out = sizeof(compBuffer);
-						compressedSize += writeLen;
-					}
+					deltaSize = delta.size();
+					payload = &delta[0];
+					payloadSize = deltaSize;
 				}
 			}
 
-			if(item.size())
-			{
-				int err;
-				do
-				{
-					err = deflate(&str, Z_FINISH);
-					if(err < Z_OK)
-						dbgError("failed to deflate");
-
-					writeLen = sizeof(compBuffer) - str.avail_out;
-					if(writeLen)
-					{
-						map.write(compBuffer, writeLen);
-						str.next_out = (Bytef*)compBuffer;
-						str.avail_out = sizeof(compBuffer);
-						compressedSize += writeLen;
-					}
-				} while(err != Z_STREAM_END);
-
-				deflateEnd(&str);
-			}
+			map.write(size);
+			compressedSizeOffset = map.offset();
+			map.write((uint)0);
+			map.write(deltaSize);
+			map.write(ids[j]);
 
-			item.close();
+			name.save(map);
+
+			compressedSize = mapCompileData(map, payload, payloadSize);
+			free(data);
 
 			uint tmp = map.offset();
 			map.seek(compressedSizeOffset);
@@ -303,6 +518,9 @@ void mapCompile(const char * filename, const char * path, const char * prefix)
 	}
 
 	map.write((uint)MAP_FOOTER);
+	map.close();
+
+	mapCompileHeader(filename, names, ids);
 
 	// Cleanup the compiled scripts folder
 #ifdef _WIN32
@@ -358,8 +576,10 @@ void mapCompileAll(const char * dir)
 void mapCompilePatch(const char * dir, const char * prefix)
 {
 	intptr_t find;
-	string mapname, builddir, prefixdir, search = dir;
+	string mapname, basename, builddir, prefixdir, search = dir;
 	_finddata32_t data;
+	map_t base;
+	bool hasBase;
 
 	search += "/*";
 
@@ -388,21 +608,51 @@ void mapCompilePatch(const char * dir, const char * prefix)
 			prefixdir += "/";
 			prefixdir += data.name;
 
-			mapCompile(mapname.c_str(), builddir.c_str(), prefixdir.c_str());
+			// The patch is built as deltas against the map it patches, if it has been built
+			basename = prefix;
+			basename += "_";
+			basename += data.name;
+			basename += ".nym";
+
+			hasBase = mapTryLoad(basename.c_str(), base);
+
+			mapCompile(mapname.c_str(), builddir.c_str(), prefixdir.c_str(), hasBase ? &base : NULL);
+
+			if(hasBase)
+				mapUnload(base);
 		}
 	} while(_findnext32(find, &data) == 0);
 }
 #endif // _DEBUG
 
+// Add an item to the resource id table
+void mapAddId(map_t& header, sectionitem_t * item)
+{
+	uint slot = item->id & header.idTableMask;
+
+	while(header.idTable[slot])
+	{
+		if(header.idTable[slot]->id == item->id)
+			dbgError("duplicate resource id for '%s' in map '%s'", item->name, header.name);
+
+		slot = (slot + 1) & header.idTableMask;
+	}
+
+	header.idTable[slot] = item;
+}
+
 void mapLoad(file& f, map_t& header)
 {
-	uint len;
+	uint len, count;
 	uint i, j, offset;
 	ushort major, minor;
 	string itemName;
 
 	header.f = &f;
 	header.deleteFile = false;
+	header.base = NULL;
+	header.itemLock = new lock();
+	header.itemLoaded = new condition();
 
 	// Check the magic
 	if(f.readuint32() != MAP_MAGIC)
@@ -443,10 +693,13 @@ void mapLoad(file& f, map_t& header)
 		{
 			// Item index
 			header.sections[i].items[j].index = j;
+			header.sections[i].items[j].section = i;
 
 			// Item size
 			header.sections[i].items[j].size = f.readuint32();
 			header.sections[i].items[j].compressedSize = f.readuint32();
+			header.sections[i].items[j].deltaSize = f.readuint32();
+			header.sections[i].items[j].id = f.readuint32();
 			
 			// Item name
 			itemName.load(f);
@@ -460,10 +713,16 @@ void mapLoad(file& f, map_t& header)
 
 			// Item data
 			header.sections[i].items[j].data = NULL;
+			header.sections[i].items[j].baseItem = NULL;
+			header.sections[i].items[j].owner = &header;
+			header.sections[i].items[j].refCount = 0;
+			header.sections[i].items[j].loading = false;
 
 			// Seek to the next item
 			if(header.sections[i].items[j].compressedSize)
 				f.seek(f.offset() + header.sections[i].items[j].compressedSize);
+			else if(header.sections[i].items[j].deltaSize)
+				f.seek(f.offset() + header.sections[i].items[j].deltaSize);
 			else
 				f.seek(f.offset() + header.sections[i].items[j].size);
 		}
@@ -474,6 +733,21 @@ void mapLoad(file& f, map_t& header)
 
 	if(f.readuint32() != MAP_FOOTER)
 		dbgError("map has invalid footer");
+
+	// Build the resource id table, kept at most half full
+	for(i = 0,count = 0;i < MSectionCount;i++)
+		count += header.sections[i].itemCount;
+
+	for(len = 16;len < count * 2;len <<= 1);
+
+	header.idTableMask = len - 1;
+	header.idTable = (sectionitem_t**)calloc(len, sizeof(sectionitem_t*));
+
+	for(i = 0;i < MSectionCount;i++)
+	{
+		for(j = 0;j < header.sections[i].itemCount;j++)
+			mapAddId(header, &header.sections[i].items[j]);
+	}
 }
 
 void mapLoad(const char * name, map_t& header)
@@ -505,21 +779,37 @@ bool mapTryLoad(const char * name, map_t& header)
 	return true;
 }
 
-sectionitem_t * mapLoadItem(map_t& header, uint section, uint item)
+void mapSetBase(map_t& patch, map_t& base)
 {
-	z_stream str;
-	uint size, read;
-	char compBuffer[1024 * 2];
-	sectionitem_t& sectionitem = header.sections[section].items[item];
+	uint i, j;
+	sectionitem_t * item;
 
-	if(item >= header.sections[section].itemCount)
-		dbgError("invalid section item; cannot load");
+	patch.base = &base;
 
-	if(sectionitem.data != NULL)
-		return &sectionitem;
+	// Resolve the base item of every delta up front
+	for(i = 0;i < MSectionCount;i++)
+	{
+		for(j = 0;j < patch.sections[i].itemCount;j++)
+		{
+			item = &patch.sections[i].items[j];
+			if(item->deltaSize == 0)
+				continue;
 
-	// Allocate a buffer to store the data
-	sectionitem.data = (byte*)malloc(sectionitem.size);
+			item->baseItem = mapLookupItem(base, i, item->name, false);
+			if(item->baseItem == NULL)
+				dbgError("patch item '%s' does not exist in map '%s'", item->name, base.name);
+		}
+	}
+}
+
+// Read the stored data of an item, inflating it if required
+void mapReadItemData(map_t& header, sectionitem_t& sectionitem, byte * data, uint length)
+{
+	z_stream str;
+	uint size, read, offset;
+	char compBuffer[1024 * 2];
+
+	offset = sectionitem.dataOffset;
 
 	if(sectionitem.compressedSize)
 	{
@@ -528,10 +818,8 @@ sectionitem_t * mapLoadItem(map_t& header, uint section, uint item)
 		if(inflateInit(&str) < Z_OK)
 			dbgError("inflateInit failed");
 
-		str.next_out = sectionitem.data;
-		str.avail_out = sectionitem.size;
-
-		header.f->seek(sectionitem.dataOffset);
+		str.next_out = data;
+		str.avail_out = length;
 
 		size = sectionitem.compressedSize;
 		while(size)
@@ -542,7 +830,8 @@ sectionitem_t * mapLoadItem(map_t& header, uint section, uint item)
 
 			size -= read;
 
-			header.f->read(compBuffer, read);
+			header.f->readAt(offset, compBuffer, read);
+			offset += read;
 
 			str.next_in = (Bytef*)compBuffer;
 			str.avail_in = read;
@@ -559,9 +848,126 @@ sectionitem_t * mapLoadItem(map_t& header, uint section, uint item)
 	else
 	{
 		// Read in the data
-		header.f->seek(sectionitem.dataOffset);
-		header.f->read(sectionitem.data, sectionitem.size);
+		header.f->readAt(offset, data, length);
 	}
+}
+
+// Rebuild an item from its base item and a delta
+void mapApplyDelta(const byte * delta, uint deltaSize, sectionitem_t& base, byte * data, uint size)
+{
+	const byte * end = delta + deltaSize;
+	uint offset, length, written = 0;
+	byte op;
+
+	if(deltaSize < 9)
+		dbgError("delta for '%s' is corrupt", base.name);
+
+	memcpy(&length, delta, sizeof(length));
+	memcpy(&offset, delta + 4, sizeof(offset));
+	delta += 8;
+
+	if(length != base.size || offset != crc32(0, base.data, base.size))
+		dbgError("delta for '%s' does not match the base map", base.name);
+
+	while(delta < end)
+	{
+		op = *delta++;
+
+		if(op == MAP_DELTA_END)
+			break;
+		else if(op == MAP_DELTA_COPY)
+		{
+			if(end - delta < 8)
+				dbgError("delta for '%s' is corrupt", base.name);
+
+			memcpy(&offset, delta, sizeof(offset));
+			memcpy(&length, delta + 4, sizeof(length));
+			delta += 8;
+
+			if(offset > base.size || length > base.size - offset || length > size - written)
+				dbgError("delta for '%s' is corrupt", base.name);
+
+			memcpy(data + written, base.data + offset, length);
+		}
+		else if(op == MAP_DELTA_INSERT)
+		{
+			if(end - delta < 4)
+				dbgError("delta for '%s' is corrupt", base.name);
+
+			memcpy(&length, delta, sizeof(length));
+			delta += 4;
+
+			if(length > (uint)(end - delta) || length > size - written)
+				dbgError("delta for '%s' is corrupt", base.name);
+
+			memcpy(data + written, delta, length);
+			delta += length;
+		}
+		else
+			dbgError("delta for '%s' is corrupt", base.name);
+
+		written += length;
+	}
+
+	if(written != size)
+		dbgError("delta for '%s' is corrupt", base.name);
+}
+
+sectionitem_t * mapLoadItem(map_t& header, uint section, uint item)
+{
+	byte * data, * delta;
+	sectionitem_t * baseItem;
+
+	if(item >= header.sections[section].itemCount)
+		dbgError("invalid section item; cannot load");
+
+	sectionitem_t& sectionitem = header.sections[section].items[item];
+
+	header.itemLock->enter();
+
+	// Another thread is reading this item, wait for it to finish
+	while(sectionitem.loading)
+		header.itemLoaded->wait(*header.itemLock);
+
+	if(sectionitem.data != NULL)
+	{
+		sectionitem.refCount++;
+		header.itemLock->leave();
+		return &sectionitem;
+	}
+
+	// Claim the item, the read happens outside of the lock
+	sectionitem.loading = true;
+	header.itemLock->leave();
+
+	// Allocate a buffer to store the data
+	data = (byte*)malloc(sectionitem.size);
+
+	if(sectionitem.deltaSize)
+	{
+		// The item is stored as a delta against the base map
+		if(header.base == NULL || sectionitem.baseItem == NULL)
+			dbgError("patch item '%s' has no base map", sectionitem.name);
+
+		delta = (byte*)malloc(sectionitem.deltaSize);
+		mapReadItemData(header, sectionitem, delta, sectionitem.deltaSize);
+
+		baseItem = mapLoadItem(*header.base, section, sectionitem.baseItem->index);
+		mapApplyDelta(delta, sectionitem.deltaSize, *baseItem, data, sectionitem.size);
+		mapUnloadItem(baseItem);
+
+		free(delta);
+	}
+	else
+		mapReadItemData(header, sectionitem, data, sectionitem.size);
+
+	// Publish the data
+	header.itemLock->enter();
+	sectionitem.data = data;
+	sectionitem.refCount = 1;
+	sectionitem.loading = false;
+	header.itemLock->leave();
+	header.itemLoaded->wakeAll();
 
 	// Done!
 	return &sectionitem;
@@ -576,11 +982,21 @@ void mapLoadSection(map_t& header, uint section)
 
 void mapUnloadItem(sectionitem_t* item)
 {
-	if(item->data != NULL)
+	byte * data = NULL;
+
+	item->owner->itemLock->enter();
+
+	// The data is freed once the last load has been released
+	if(item->refCount > 0 && --item->refCount == 0)
 	{
-		free(item->data);
+		data = item->data;
 		item->data = NULL;
 	}
+
+	item->owner->itemLock->leave();
+
+	if(data != NULL)
+		free(data);
 }
 
 void mapUnloadItem(map_t& header, uint section, uint item)
@@ -601,20 +1017,31 @@ void mapUnload(map_t& header)
 	uint j;
 	section_t * section;
 
-	// First unload the sections
+	// First unload the sections, whatever is still holding the items
 	for(i = 0;i < MSectionCount;i++)
 	{
-		mapUnloadSection(header, i);
-
 		section = &header.sections[i];
 
 		// The name is allocated, free it
 		for(j = 0;j < section->itemCount;j++)
+		{
+			if(section->items[j].data != NULL)
+				free(section->items[j].data);
+
 			free(section->items[j].name);
+		}
 
 		// Now free the section items
 		free(section->items);
 	}
+
+	free(header.idTable);
+	header.idTable = NULL;
+
+	delete header.itemLock;
+	header.itemLock = NULL;
+	delete header.itemLoaded;
+	header.itemLoaded = NULL;
 	
 	// Map has been unloaded, now close the file handle
 	header.f->close();
@@ -625,33 +1052,45 @@ void mapUnload(map_t& header)
 
 sectionitem_t * mapLookupItem(map_t& header, uint section, uint item, bool load)
 {
-	sectionitem_t& ptr = header.sections[section].items[item];;
+	// Loading takes a reference, even if the item is already in memory
+	if(load)
+		return mapLoadItem(header, section, item);
 
-	if(load && ptr.data == NULL)
-	{
-		// Attempt to load the item as requested
-		mapLoadItem(header, section, item);
-		return mapLookupItem(header, section, item, false);
-	}
-	
-	return &ptr;
+	return &header.sections[section].items[item];
 }
 
 sectionitem_t * mapLookupItem(map_t& header, uint section, const char * name, bool load)
 {
-	uint i;
-	string str(name);
+	sectionitem_t * item = mapLookupId(header, mapResourceId(name), false);
 
-	for(i = 0;i < header.sections[section].itemCount;i++)
+	// The id only narrows it down (it ignores case), names still match case sensitively
+	if(item == NULL || item->section != section || strcmp(item->name, name) != 0)
+		return NULL;
+
+	// Load the item if requested
+	if(load)
+		mapLoadItem(header, section, item->index);
+
+	return item;
+}
+
+sectionitem_t * mapLookupId(map_t& header, uint id, bool load)
+{
+	sectionitem_t * item;
+	uint slot = id & header.idTableMask;
+
+	while((item = header.idTable[slot]) != NULL)
 	{
-		if(str.getHash() == header.sections[section].items[i].nameHash && str == name)
+		if(item->id == id)
 		{
 			// Load the item if requested
-			if(load && header.sections[section].items[i].data == NULL)
-				mapLoadItem(header, section, i);
+			if(load)
+				mapLoadItem(header, item->section, item->index);
 
-			return &header.sections[section].items[i];
+			return item;
 		}
+
+		slot = (slot + 1) & header.idTableMask;
 	}
 
 	// Item does not exist in the map
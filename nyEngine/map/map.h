@@ -3,11 +3,16 @@
 
 // The minimum supported map build
 #define MAP_MAJOR 1
-#define MAP_MINOR 0
+#define MAP_MINOR 2
 
 #define MAP_MAGIC 'PMYN' // 'NYMP' little endian
 #define MAP_FOOTER 'TFYN' // 'NYFT' little endian
 
+// Delta item operations
+#define MAP_DELTA_END 0 // end of the delta
+#define MAP_DELTA_COPY 1 // copy a range of the base item
+#define MAP_DELTA_INSERT 2 // insert literal data
+
 enum
 {
 	MSectionZone,
@@ -23,15 +28,27 @@ enum
 	MSectionCount
 };
 
+// Resource ids are assigned by mapCompile, zero is never a valid id
+#define MAP_INVALID_ID 0
+
 typedef struct sectionitem_s
 {
 	uint index; // which item this is
+	uint section; // which section this item is in
+	uint id; // the resource id of the item, derived from the name
 	uint size; // the size of the data
 	uint compressedSize; // the size of the compressed data
+	uint deltaSize; // the size of the delta data, zero if the item is stored whole
 	char * name; // the name of the item
 	uint nameHash; // the hashtag of the name
 	uint dataOffset; // the offset of the data
 	byte * data; // the data buffer
+	struct sectionitem_s * baseItem; // the base map item that the delta applies to
+	struct map_s * owner; // the map this item belongs to
+
+	// Load state, guarded by the owner's item lock
+	uint refCount; // how many loads are holding the data
+	bool loading; // if a thread is currently reading the data
 } sectionitem_t;
 
 typedef struct section_s
@@ -46,11 +63,20 @@ typedef struct section_s
 typedef struct map_s
 {
 	// the file handle used to load map resources
+	// items are read with positional reads, so any thread may load from the map
 	file * f;
 
+	// guards the load state of the items
+	lock * itemLock;
+	// woken whenever an item finishes loading
+	condition * itemLoaded;
+
 	// if we should delete the file handle on map deletion
 	bool deleteFile;
 
+	// the map that delta items are applied to, only set on patches
+	struct map_s * base;
+
 	// map flags
 	uint flags;
 
@@ -59,10 +85,21 @@ typedef struct map_s
 
 	// the sections
 	section_t sections[MSectionCount];
+
+	// Resource id lookup table, open addressed
+	sectionitem_t ** idTable;
+	uint idTableMask;
 } map_t;
 
+// Get the resource id of an item name
+uint mapResourceId(const char * name);
+// Get the symbol used for an item name in resource id headers and scripts
+void mapResourceSymbol(const char * name, string& symbol);
+
 // Compile a map
-void mapCompile(const char * filename, const char * path, const char * prefix);
+// This also writes a header of resource ids next to the map
+// If a base map is given, items that also exist in the base are stored as deltas
+void mapCompile(const char * filename, const char * path, const char * prefix, map_t * base = NULL);
 void mapCompileAll(const char * dir);
 void mapCompilePatch(const char * dir, const char * prefix);
 
@@ -71,7 +108,12 @@ void mapLoad(file& f, map_t& header);
 void mapLoad(const char * name, map_t& header);
 bool mapTryLoad(const char * name, map_t& header);
 
+// Link a patch to the map that its delta items were built against
+void mapSetBase(map_t& patch, map_t& base);
+
 // Load a single item from a section
+// Items are reference counted, every load must be matched by an unload
+// This is safe to call from several threads on the same map
 sectionitem_t * mapLoadItem(map_t& header, uint section, uint item);
 
 // Load an entire section of a map
@@ -90,6 +132,7 @@ void mapUnload(map_t& header);
 // Lookup a section item
 sectionitem_t * mapLookupItem(map_t& header, uint section, uint item, bool load = true);
 sectionitem_t * mapLookupItem(map_t& header, uint section, const char * name, bool load = true);
+sectionitem_t * mapLookupId(map_t& header, uint id, bool load = true);
 
 // Map format notes
 /*
@@ -109,10 +152,26 @@ string name
 // {
 //     uint item length
 //     uint compressed length // if zero, item is not compressed
+//     uint delta length // if non-zero, the data is a delta against the base map item with the same name
+//     uint resource id
 //     string name
 //     // other data
 // }
 
+// Delta data (before compression)
+// uint base item length
+// uint base item crc32
+// operations, until MAP_DELTA_END
+// {
+//     byte MAP_DELTA_COPY
+//     uint base offset
+//     uint length
+//
+//     byte MAP_DELTA_INSERT
+//     uint length
+//     byte[] data : length
+// }
+
 // Zone (geometry)
 {
 	// zone data here (geometry, etc)
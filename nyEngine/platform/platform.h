@@ -3,5 +3,9 @@
 
 void platformDebugOut(const char * format);
 void platformFatal(const char * error);
+// Give up the rest of the time slice, or sleep for a number of milliseconds
+void platformSleep(uint ms);
+// High resolution time in seconds, only useful for measuring intervals
+double platformTime();
 
 #endif
\ No newline at end of file
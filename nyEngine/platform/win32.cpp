@@ -25,6 +25,27 @@ void platformFatal(const char * error)
 	exit(1);
 }
 
+void platformSleep(uint ms)
+{
+	Sleep(ms);
+}
+
+double platformTime()
+{
+	static double period = 0;
+	LARGE_INTEGER counter;
+
+	if(period == 0)
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		period = 1.0 / (double)frequency.QuadPart;
+	}
+
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart * period;
+}
+
 LONG WINAPI ExceptionHandler(EXCEPTION_POINTERS *ExceptionInfo)
 {
 	typedef BOOL (*PDUMPFN)(
@@ -50,6 +50,9 @@ Proto *pdep_newproto (lua_State *L) {
 	f->linedefined = 0;
 	f->lastlinedefined = 0;
 	f->source = NULL;
+	f->lazy = NULL;
+	f->lazypos = 0;
+	f->gcache = NULL;
 	return f;
 }
 
@@ -91,6 +91,10 @@ typedef struct global_State {
   UpVal uvhead;  /* head of double-linked list of all open upvalues */
   struct Table *mt[NUM_TAGS];  /* metatables for basic types */
   TString *tmname[TM_N];  /* array with tag-method names */
+  struct Table *dirtytables;  /* nyEngine: tables written since they were cleaned */
+  lu_byte lazyundump;  /* nyEngine: leave nested functions of binary chunks unloaded */
+  lu_int32 tableversion;  /* nyEngine: last table version stamp handed out */
+  unsigned int seed;  /* nyEngine: seed of the string hash */
 } global_State;
 
 
@@ -38,4 +38,7 @@ void pdep_growstack (lua_State *L, int n);
 void pdep_reallocCI (lua_State *L, int newsize);
 TString *pdep_newlstr (lua_State *L, const char *str, size_t l);
 
+/* nyEngine: load a function left in its chunk by a lazy undump, from lundump.c */
+void luaU_loadlazy (lua_State *L, Proto *f);
+
 #endif
@@ -55,13 +55,37 @@
 
 #define PLUTO_TPERMANENT 101
 
+/* How much output is gathered before it is handed to the writer */
+#define PLUTO_WRITEBUFFER 0x10000
+/* Starting size of the reference hash, a power of 2 */
+#define PLUTO_MINREFS 1024
+
 #define verify(x) { int v = (int)((x)); v=v; lua_assert(v); }
 
+/* An object that has been written, and the ref it was written as */
+typedef struct RefEntry_t {
+	GCObject *gc;
+	int tt;
+	int ref;
+} RefEntry;
+
 typedef struct PersistInfo_t {
 	lua_State *L;
 	int counter;
+	int maxref;
 	lua_Chunkwriter writer;
 	void *ud;
+	/* Output buffer, flushed to the writer when it fills up */
+	char *buf;
+	size_t buflen;
+	/* The reference table, an open addressed hash of object -> ref.
+	 * Its memory is a userdata in the anchor table (the reftbl stack
+	 * slot), so nothing leaks if persisting raises an error. */
+	RefEntry *refs;
+	int refmask;
+	int refcount;
+	/* Objects that only the persister holds, kept in the anchor table */
+	int anchors;
 #ifdef PLUTO_DEBUG
 	int level;
 #endif
@@ -80,6 +104,79 @@ void printindent(int indent)
 /* Mutual recursion requires prototype */
 static void persist(PersistInfo *pi);
 
+static void pflush(PersistInfo *pi)
+{
+	if(pi->buflen) {
+		pi->writer(pi->L, pi->buf, pi->buflen, pi->ud);
+		pi->buflen = 0;
+	}
+}
+
+static void pwrite(PersistInfo *pi, const void *p, size_t sz)
+{
+	if(pi->buflen + sz > PLUTO_WRITEBUFFER) {
+		pflush(pi);
+		if(sz > PLUTO_WRITEBUFFER) {
+			pi->writer(pi->L, p, sz, pi->ud);
+			return;
+		}
+	}
+	memcpy(pi->buf + pi->buflen, p, sz);
+	pi->buflen += sz;
+}
+
+static RefEntry *findref(PersistInfo *pi, GCObject *gc)
+{
+	size_t h = ((size_t)gc >> 3) * 2654435761u;
+	int i = (int)(h ^ (h >> 16)) & pi->refmask;
+	while(pi->refs[i].gc != NULL && pi->refs[i].gc != gc)
+		i = (i + 1) & pi->refmask;
+	return &pi->refs[i];
+}
+
+/* Allocate the hash with 'size' slots, moving the old entries over.
+ * The userdata replaces the old one in the anchor table. */
+static void allocrefs(PersistInfo *pi, int size)
+{
+	RefEntry *old = pi->refs;
+	int oldsize = old ? pi->refmask + 1 : 0;
+	int i;
+					/* perms reftbl ... */
+	lua_checkstack(pi->L, 1);
+	pi->refs = (RefEntry *)lua_newuserdata(pi->L, size * sizeof(RefEntry));
+	memset(pi->refs, 0, size * sizeof(RefEntry));
+	pi->refmask = size - 1;
+	for(i = 0; i < oldsize; i++) {
+		if(old[i].gc != NULL)
+			*findref(pi, old[i].gc) = old[i];
+	}
+					/* perms reftbl ... refs */
+	lua_rawseti(pi->L, 2, 1);
+					/* perms reftbl ... */
+}
+
+static void addref(PersistInfo *pi, const TValue *o, int ref)
+{
+	RefEntry *e;
+	if((pi->refcount + 1) * 2 > pi->refmask + 1)
+		allocrefs(pi, (pi->refmask + 1) * 2);
+	e = findref(pi, gcvalue(o));
+	e->gc = gcvalue(o);
+	e->tt = ttype(o);
+	e->ref = ref;
+	pi->refcount++;
+}
+
+/* Keep an object that nothing else references alive until persisting is
+ * done, so its address can't be reused by a new object */
+static void anchor(PersistInfo *pi)
+{
+					/* perms reftbl ... obj */
+	lua_checkstack(pi->L, 1);
+	lua_pushvalue(pi->L, -1);
+	lua_rawseti(pi->L, 2, ++pi->anchors);
+}
+
 /* A simple reimplementation of the unfortunately static function luaA_index.
  * Does not support the global table, registry, or upvalues. */
 static StkId getobject(lua_State *L, int stackpos)
@@ -108,7 +205,7 @@ static int persistspecialobject(PersistInfo *pi, int defaction)
 		if(defaction) {
 			{
 				int zero = 0;
-				pi->writer(pi->L, &zero, sizeof(int), pi->ud);
+				pwrite(pi, &zero, sizeof(int));
 			}
 			return 0;
 		} else {
@@ -128,7 +225,7 @@ static int persistspecialobject(PersistInfo *pi, int defaction)
 		if(defaction) {
 			{
 				int zero = 0;
-				pi->writer(pi->L, &zero, sizeof(int), pi->ud);
+				pwrite(pi, &zero, sizeof(int));
 			}
 			return 0;
 		} else {
@@ -144,7 +241,7 @@ static int persistspecialobject(PersistInfo *pi, int defaction)
 					/* perms reftbl sptbl ... obj */
 			{
 				int zero = 0;
-				pi->writer(pi->L, &zero, sizeof(int), pi->ud);
+				pwrite(pi, &zero, sizeof(int));
 			}
 			return 0;
 		} else {
@@ -160,6 +257,8 @@ static int persistspecialobject(PersistInfo *pi, int defaction)
 	lua_pushvalue(pi->L, -3);
 					/* perms reftbl ... obj mt __persist obj */
 #ifdef PLUTO_PASS_USERDATA_TO_PERSIST
+	/* The metafunction could write by itself */
+	pflush(pi);
 	lua_pushlightuserdata(pi->L, (void*)pi->writer);
 	lua_pushlightuserdata(pi->L, pi->ud);
 					/* perms reftbl ... obj mt __persist obj ud */
@@ -175,9 +274,10 @@ static int persistspecialobject(PersistInfo *pi, int defaction)
 		lua_error(pi->L);
 	}
 					/* perms reftbl ... obj mt func */
+	anchor(pi);
 	{
 		int one = 1;
-		pi->writer(pi->L, &one, sizeof(int), pi->ud);
+		pwrite(pi, &one, sizeof(int));
 	}
 	persist(pi);
 					/* perms reftbl ... obj mt func */
@@ -236,8 +336,8 @@ static void persistuserdata(PersistInfo *pi) {
 	} else {
 	/* Use literal persistence */
 		size_t length = uvalue(getobject(pi->L, -1))->len;
-		pi->writer(pi->L, &length, sizeof(size_t), pi->ud);
-		pi->writer(pi->L, lua_touserdata(pi->L, -1), length, pi->ud);
+		pwrite(pi, &length, sizeof(size_t));
+		pwrite(pi, lua_touserdata(pi->L, -1), length);
 		if(!lua_getmetatable(pi->L, -1)) {
 					/* perms reftbl ... udata */
 			lua_pushnil(pi->L);
@@ -310,7 +410,7 @@ static void persistfunction(PersistInfo *pi)
 		{
 			/* We don't really _NEED_ the number of upvals,
 			 * but it'll simplify things a bit */
-			pi->writer(pi->L, &cl->l.p->nups, sizeof(lu_byte), pi->ud);
+			pwrite(pi, &cl->l.p->nups, sizeof(lu_byte));
 		}
 		/* Persist prototype */
 		{
@@ -399,10 +499,14 @@ static void persistproto(PersistInfo *pi)
 	Proto *p = toproto(pi->L, -1);
 	lua_checkstack(pi->L, 2);
 
+	/* nyEngine: functions from a lazy undump are persisted loaded */
+	if(p->lazy)
+		luaU_loadlazy(pi->L, p);
+
 	/* Persist constant refs */
 	{
 		int i;
-		pi->writer(pi->L, &p->sizek, sizeof(int), pi->ud);
+		pwrite(pi, &p->sizek, sizeof(int));
 		for(i=0; i<p->sizek; i++) {
 			LIF(A,pushobject)(pi->L, &p->k[i]);
 					/* perms reftbl ... proto const */
@@ -416,7 +520,7 @@ static void persistproto(PersistInfo *pi)
 	/* serialize inner Proto refs */
 	{
 		int i;
-		pi->writer(pi->L, &p->sizep, sizeof(int), pi->ud);
+		pwrite(pi, &p->sizep, sizeof(int));
 		for(i=0; i<p->sizep; i++)
 		{
 			pushproto(pi->L, p->p[i]);
@@ -430,14 +534,14 @@ static void persistproto(PersistInfo *pi)
 
 	/* Serialize code */
 	{
-		pi->writer(pi->L, &p->sizecode, sizeof(int), pi->ud);
-		pi->writer(pi->L, p->code, sizeof(Instruction) * p->sizecode, pi->ud);
+		pwrite(pi, &p->sizecode, sizeof(int));
+		pwrite(pi, p->code, sizeof(Instruction) * p->sizecode);
 	}
 
 	/* Serialize upvalue names */
 	{
 		int i;
-		pi->writer(pi->L, &p->sizeupvalues, sizeof(int), pi->ud);
+		pwrite(pi, &p->sizeupvalues, sizeof(int));
 		for(i=0; i<p->sizeupvalues; i++)
 		{
 			pushstring(pi->L, p->upvalues[i]);
@@ -448,15 +552,15 @@ static void persistproto(PersistInfo *pi)
 	/* Serialize local variable infos */
 	{
 		int i;
-		pi->writer(pi->L, &p->sizelocvars, sizeof(int), pi->ud);
+		pwrite(pi, &p->sizelocvars, sizeof(int));
 		for(i=0; i<p->sizelocvars; i++)
 		{
 			pushstring(pi->L, p->locvars[i].varname);
 			persist(pi);
 			lua_pop(pi->L, 1);
 
-			pi->writer(pi->L, &p->locvars[i].startpc, sizeof(int), pi->ud);
-			pi->writer(pi->L, &p->locvars[i].endpc, sizeof(int), pi->ud);
+			pwrite(pi, &p->locvars[i].startpc, sizeof(int));
+			pwrite(pi, &p->locvars[i].endpc, sizeof(int));
 		}
 	}
 
@@ -467,23 +571,23 @@ static void persistproto(PersistInfo *pi)
 
 	/* Serialize line numbers */
 	{
-		pi->writer(pi->L, &p->sizelineinfo, sizeof(int), pi->ud);
+		pwrite(pi, &p->sizelineinfo, sizeof(int));
 		if (p->sizelineinfo)
 		{
-			pi->writer(pi->L, p->lineinfo, sizeof(int) * p->sizelineinfo, pi->ud);
+			pwrite(pi, p->lineinfo, sizeof(int) * p->sizelineinfo);
 		}
 	}
 
 	/* Serialize linedefined and lastlinedefined */
-	pi->writer(pi->L, &p->linedefined, sizeof(int), pi->ud);
-	pi->writer(pi->L, &p->lastlinedefined, sizeof(int), pi->ud);
+	pwrite(pi, &p->linedefined, sizeof(int));
+	pwrite(pi, &p->lastlinedefined, sizeof(int));
 
 	/* Serialize misc values */
 	{
-		pi->writer(pi->L, &p->nups, sizeof(lu_byte), pi->ud);
-		pi->writer(pi->L, &p->numparams, sizeof(lu_byte), pi->ud);
-		pi->writer(pi->L, &p->is_vararg, sizeof(lu_byte), pi->ud);
-		pi->writer(pi->L, &p->maxstacksize, sizeof(lu_byte), pi->ud);
+		pwrite(pi, &p->nups, sizeof(lu_byte));
+		pwrite(pi, &p->numparams, sizeof(lu_byte));
+		pwrite(pi, &p->is_vararg, sizeof(lu_byte));
+		pwrite(pi, &p->maxstacksize, sizeof(lu_byte));
 	}
 	/* We do not currently persist upvalue names, local variable names,
 	 * variable lifetimes, line info, or source code. */
@@ -519,7 +623,7 @@ static void persistthread(PersistInfo *pi)
 	/* Persist the stack */
 	posremaining = revappendstack(L2, pi->L);
 					/* perms reftbl ... thr (rev'ed contents of L2) */
-	pi->writer(pi->L, &posremaining, sizeof(size_t), pi->ud);
+	pwrite(pi, &posremaining, sizeof(size_t));
 	for(; posremaining > 0; posremaining--) {
 		persist(pi);
 		lua_pop(pi->L, 1);
@@ -528,7 +632,7 @@ static void persistthread(PersistInfo *pi)
 	/* Now, persist the CallInfo stack. */
 	{
 		size_t i, numframes = (L2->ci - L2->base_ci) + 1;
-		pi->writer(pi->L, &numframes, sizeof(size_t), pi->ud);
+		pwrite(pi, &numframes, sizeof(size_t));
 		for(i=0; i<numframes; i++) {
 			CallInfo *ci = L2->base_ci + i;
 			size_t stackbase = ci->base - L2->stack;
@@ -537,11 +641,11 @@ static void persistthread(PersistInfo *pi)
 			size_t savedpc = (ci != L2->base_ci) ?
 				ci->savedpc - ci_func(ci)->l.p->code :
 				0;
-			pi->writer(pi->L, &stackbase, sizeof(size_t), pi->ud);
-			pi->writer(pi->L, &stackfunc, sizeof(size_t), pi->ud);
-			pi->writer(pi->L, &stacktop, sizeof(size_t), pi->ud);
-			pi->writer(pi->L, &ci->nresults, sizeof(int), pi->ud);
-			pi->writer(pi->L, &savedpc, sizeof(size_t), pi->ud);
+			pwrite(pi, &stackbase, sizeof(size_t));
+			pwrite(pi, &stackfunc, sizeof(size_t));
+			pwrite(pi, &stacktop, sizeof(size_t));
+			pwrite(pi, &ci->nresults, sizeof(int));
+			pwrite(pi, &savedpc, sizeof(size_t));
 		}
 	}
 
@@ -550,10 +654,10 @@ static void persistthread(PersistInfo *pi)
 		size_t stackbase = L2->base - L2->stack;
 		size_t stacktop = L2->top - L2->stack;
 		lua_assert(L2->nCcalls <= 1);
-		pi->writer(pi->L, &L2->status, sizeof(lu_byte), pi->ud);
-		pi->writer(pi->L, &stackbase, sizeof(size_t), pi->ud);
-		pi->writer(pi->L, &stacktop, sizeof(size_t), pi->ud);
-		pi->writer(pi->L, &L2->errfunc, sizeof(ptrdiff_t), pi->ud);
+		pwrite(pi, &L2->status, sizeof(lu_byte));
+		pwrite(pi, &stackbase, sizeof(size_t));
+		pwrite(pi, &stacktop, sizeof(size_t));
+		pwrite(pi, &L2->errfunc, sizeof(ptrdiff_t));
 	}
 
 	/* Finally, record upvalues which need to be reopened */
@@ -574,7 +678,7 @@ static void persistthread(PersistInfo *pi)
 			lua_pop(pi->L, 1);
 					/* perms reftbl ... thr */
 			stackpos = uv->v - L2->stack;
-			pi->writer(pi->L, &stackpos, sizeof(size_t), pi->ud);
+			pwrite(pi, &stackpos, sizeof(size_t));
 		}
 					/* perms reftbl ... thr */
 		lua_pushnil(pi->L);
@@ -589,26 +693,26 @@ static void persistthread(PersistInfo *pi)
 static void persistboolean(PersistInfo *pi)
 {
 	int b = lua_toboolean(pi->L, -1);
-	pi->writer(pi->L, &b, sizeof(int), pi->ud);
+	pwrite(pi, &b, sizeof(int));
 }
 
 static void persistlightuserdata(PersistInfo *pi)
 {
 	void *p = lua_touserdata(pi->L, -1);
-	pi->writer(pi->L, &p, sizeof(void *), pi->ud);
+	pwrite(pi, &p, sizeof(void *));
 }
 
 static void persistnumber(PersistInfo *pi)
 {
 	lua_Number n = lua_tonumber(pi->L, -1);
-	pi->writer(pi->L, &n, sizeof(lua_Number), pi->ud);
+	pwrite(pi, &n, sizeof(lua_Number));
 }
 
 static void persiststring(PersistInfo *pi)
 {
 	size_t length = lua_strlen(pi->L, -1);
-	pi->writer(pi->L, &length, sizeof(size_t), pi->ud);
-	pi->writer(pi->L, lua_tostring(pi->L, -1), length, pi->ud);
+	pwrite(pi, &length, sizeof(size_t));
+	pwrite(pi, lua_tostring(pi->L, -1), length);
 }
 
 /* Top-level delegating persist function
@@ -630,29 +734,19 @@ static void persist(PersistInfo *pi)
 	if(!simple) {
 
 		/* perms reftbl ... obj */
-		lua_checkstack(pi->L, 2);
 		/* If the object has already been written, write a reference to it */
-		lua_pushvalue(pi->L, -1);
-		/* perms reftbl ... obj obj */
-		lua_rawget(pi->L, 2);
-		/* perms reftbl ... obj ref? */
-		if(!lua_isnil(pi->L, -1)) {
-			/* perms reftbl ... obj ref */
+		RefEntry *e = findref(pi, gcvalue(getobject(pi->L, -1)));
+		if(e->gc != NULL) {
 			int zero = 0;
-			int ref = (intptr_t)lua_touserdata(pi->L, -1);
-			pi->writer(pi->L, &zero, sizeof(int), pi->ud);
-			pi->writer(pi->L, &ref, sizeof(int), pi->ud);
-			lua_pop(pi->L, 1);
-			/* perms reftbl ... obj ref */
+			int ref = e->ref;
+			pwrite(pi, &zero, sizeof(int));
+			pwrite(pi, &ref, sizeof(int));
 #ifdef PLUTO_DEBUG
 			printindent(pi->level);
 			printf("0 %d\n", ref);
 #endif
 			return;
 		}
-		/* perms reftbl ... obj nil */
-		lua_pop(pi->L, 1);
-
 	}
 
 					/* perms reftbl ... obj */
@@ -660,9 +754,9 @@ static void persist(PersistInfo *pi)
 	if(lua_isnil(pi->L, -1)) {
 		int zero = 0;
 		/* firsttime */
-		pi->writer(pi->L, &zero, sizeof(int), pi->ud);
+		pwrite(pi, &zero, sizeof(int));
 		/* ref */
-		pi->writer(pi->L, &zero, sizeof(int), pi->ud);
+		pwrite(pi, &zero, sizeof(int));
 #ifdef PLUTO_DEBUG
 		printindent(pi->level);
 		printf("0 0\n");
@@ -672,21 +766,17 @@ static void persist(PersistInfo *pi)
 	{
 		/* indicate that it's the first time */
 		int one = 1;
-		pi->writer(pi->L, &one, sizeof(int), pi->ud);
+		pwrite(pi, &one, sizeof(int));
 	}
 
 	/* put the value in the reftable if necessary.
 	   Simple types don't need to be put in the reftable. */
 	if(!simple) {
-		lua_pushvalue(pi->L, -1);
-		/* perms reftbl ... obj obj */
-		lua_pushlightuserdata(pi->L, (void*)((intptr_t) pi->counter));
-		/* perms reftbl ... obj obj ref */
-		lua_rawset(pi->L, 2);
-		/* perms reftbl ... obj */
+		addref(pi, getobject(pi->L, -1), pi->counter);
 	}
 
-	pi->writer(pi->L, &pi->counter, sizeof(int), pi->ud);
+	pwrite(pi, &pi->counter, sizeof(int));
+	pi->maxref = pi->counter;
 
 
 	/* At this point, we'll give the permanents table a chance to play. */
@@ -703,7 +793,7 @@ static void persist(PersistInfo *pi)
 			printf("1 %d PERM\n", pi->counter);
 			pi->level++;
 #endif
-			pi->writer(pi->L, &type, sizeof(int), pi->ud);
+			pwrite(pi, &type, sizeof(int));
 			persist(pi);
 			lua_pop(pi->L, 1);
 					/* perms reftbl ... obj */
@@ -720,7 +810,7 @@ static void persist(PersistInfo *pi)
 	}
 	{
 		int type = lua_type(pi->L, -1);
-		pi->writer(pi->L, &type, sizeof(int), pi->ud);
+		pwrite(pi, &type, sizeof(int));
 
 #ifdef PLUTO_DEBUG
 		printindent(pi->level);
@@ -768,14 +858,21 @@ static void persist(PersistInfo *pi)
 #endif
 }
 
-void pluto_persist(lua_State *L, lua_Chunkwriter writer, void *ud)
+/* Persist the root object, leaving perms rootobj refs on the stack.
+ * refs is a table of object -> ref if wantrefs is set, nil otherwise.
+ * Returns the highest ref that was written. */
+static int persistroot(lua_State *L, lua_Chunkwriter writer, void *ud, int wantrefs)
 {
 	PersistInfo pi;
+	int i;
 
 	pi.counter = 0;
+	pi.maxref = 0;
 	pi.L = L;
 	pi.writer = writer;
 	pi.ud = ud;
+	pi.refs = NULL;
+	pi.refcount = 0;
 #ifdef PLUTO_DEBUG
 	pi.level = 0;
 #endif
@@ -786,47 +883,84 @@ void pluto_persist(lua_State *L, lua_Chunkwriter writer, void *ud)
 					/* perms rootobj */
 	lua_assert(!lua_isnil(L, 2));
 					/* perms rootobj */
-	lua_newtable(L);
-					/* perms rootobj reftbl */
 
-	/* Now we're going to make the table weakly keyed. This prevents the
-	 * GC from visiting it and trying to mark things it doesn't want to
-	 * mark in tables, e.g. upvalues. All objects in the table are
-	 * a priori reachable, so it doesn't matter that we do this. */
+	/* The reftbl slot holds the anchor table. The reference hash and the
+	 * output buffer live in it, as does anything that has to be kept
+	 * alive while persisting. The hash is native memory, so the GC
+	 * never visits the objects in it, e.g. upvalues. All of them are
+	 * a priori reachable. */
 	lua_newtable(L);
-					/* perms rootobj reftbl mt */
-	lua_pushstring(L, "__mode");
-					/* perms rootobj reftbl mt "__mode" */
-	lua_pushstring(L, "k");
-					/* perms rootobj reftbl mt "__mode" "k" */
-	lua_settable(L, 4);
-					/* perms rootobj reftbl mt */
-	lua_setmetatable(L, 3);
 					/* perms rootobj reftbl */
 	lua_insert(L, 2);
 					/* perms reftbl rootobj */
+	allocrefs(&pi, PLUTO_MINREFS);
+	pi.buf = (char *)lua_newuserdata(L, PLUTO_WRITEBUFFER);
+	pi.buflen = 0;
+					/* perms reftbl rootobj buf */
+	lua_rawseti(L, 2, 2);
+	pi.anchors = 2;
+					/* perms reftbl rootobj */
 	persist(&pi);
+	pflush(&pi);
 					/* perms reftbl rootobj */
+	if(wantrefs) {
+		lua_createtable(L, 0, pi.refcount);
+					/* perms reftbl rootobj refs */
+		for(i = 0; i <= pi.refmask; i++) {
+			TValue o;
+			/* Protos and upvalues aren't values to Lua code */
+			if(pi.refs[i].gc == NULL || pi.refs[i].tt > LUA_TTHREAD)
+				continue;
+			o.value.gc = pi.refs[i].gc;
+			o.tt = pi.refs[i].tt;
+			LIF(A,pushobject)(L, &o);
+			lua_pushinteger(L, pi.refs[i].ref);
+			lua_rawset(L, -3);
+		}
+	} else {
+		lua_pushnil(L);
+	}
+					/* perms reftbl rootobj refs */
 	lua_remove(L, 2);
+					/* perms rootobj refs */
+	return pi.maxref;
+}
+
+/* Like pluto_persist, but leaves a table of the objects that were written
+ * (obj -> ref) above the root object, so the caller can tell which ref each
+ * object was written as. Returns the highest ref that was written. */
+int pluto_persistrefs(lua_State *L, lua_Chunkwriter writer, void *ud)
+{
+	return persistroot(L, writer, ud, 1);
+}
+
+void pluto_persist(lua_State *L, lua_Chunkwriter writer, void *ud)
+{
+	persistroot(L, writer, ud, 0);
+					/* perms rootobj nil */
+	lua_pop(L, 1);
 					/* perms rootobj */
 }
 
 typedef struct WriterInfo_t {
 	char* buf;
 	size_t buflen;
+	size_t bufsize;
 } WriterInfo;
 
 static int bufwriter (lua_State *L, const void* p, size_t sz, void* ud) {
-	const char* cp = (const char*)p;
 	WriterInfo *wi = (WriterInfo *)ud;
 
-	LIF(M,reallocvector)(L, wi->buf, wi->buflen, wi->buflen+sz, char);
-	while(sz)
-	{
-		/* how dearly I love ugly C pointer twiddling */
-		wi->buf[wi->buflen++] = *cp++;
-		sz--;
+	/* Grow by doubling, the persister hands over whole chunks */
+	if(wi->buflen + sz > wi->bufsize) {
+		size_t newsize = wi->bufsize ? wi->bufsize * 2 : PLUTO_WRITEBUFFER;
+		while(newsize < wi->buflen + sz)
+			newsize *= 2;
+		LIF(M,reallocvector)(L, wi->buf, wi->bufsize, newsize, char);
+		wi->bufsize = newsize;
 	}
+	memcpy(wi->buf + wi->buflen, p, sz);
+	wi->buflen += sz;
 	return 0;
 }
 
@@ -837,6 +971,7 @@ int persist_l(lua_State *L)
 
 	wi.buf = NULL;
 	wi.buflen = 0;
+	wi.bufsize = 0;
 
 	lua_settop(L, 2);
 					/* perms? rootobj? */
@@ -851,13 +986,20 @@ int persist_l(lua_State *L)
 					/* (empty) */
 	lua_pushlstring(L, wi.buf, wi.buflen);
 					/* str */
-	pdep_freearray(L, wi.buf, wi.buflen, char);
+	pdep_freearray(L, wi.buf, wi.bufsize, char);
 	return 1;
 }
 
 typedef struct UnpersistInfo_t {
 	lua_State *L;
 	ZIO zio;
+	int maxref;
+	/* ref -> slot in the reftbl array. Back references use up refs too,
+	 * so the refs are too sparse to index the table with directly. The
+	 * map is a userdata in reftbl[1], the objects start at slot 2. */
+	int *slots;
+	int slotsize;
+	int nslots;
 #ifdef PLUTO_DEBUG
 	int level;
 #endif
@@ -872,14 +1014,41 @@ static void registerobject(int ref, UnpersistInfo *upi)
 {
 					/* perms reftbl ... obj */
 	lua_checkstack(upi->L, 2);
-	lua_pushlightuserdata(upi->L, (void*)(intptr_t)ref);
-					/* perms reftbl ... obj ref */
-	lua_pushvalue(upi->L, -2);
-					/* perms reftbl ... obj ref obj */
-	lua_settable(upi->L, 2);
+	if(ref >= upi->slotsize) {
+		int size = upi->slotsize * 2;
+		int *slots;
+		while(ref >= size)
+			size *= 2;
+		slots = (int *)lua_newuserdata(upi->L, size * sizeof(int));
+		memcpy(slots, upi->slots, upi->slotsize * sizeof(int));
+		memset(slots + upi->slotsize, 0, (size - upi->slotsize) * sizeof(int));
+					/* perms reftbl ... obj slots */
+		lua_rawseti(upi->L, 2, 1);
+					/* perms reftbl ... obj */
+		upi->slots = slots;
+		upi->slotsize = size;
+	}
+	/* Objects that can be in a cycle are registered once before they
+	 * are filled in, and again after */
+	if(upi->slots[ref] == 0)
+		upi->slots[ref] = ++upi->nslots;
+	lua_pushvalue(upi->L, -1);
+					/* perms reftbl ... obj obj */
+	lua_rawseti(upi->L, 2, upi->slots[ref]);
 					/* perms reftbl ... obj */
 }
 
+/* Push the object registered as ref, nil if there isn't one */
+static void pushref(UnpersistInfo *upi, int ref)
+{
+					/* perms reftbl ... */
+	if(ref < upi->slotsize && upi->slots[ref] != 0)
+		lua_rawgeti(upi->L, 2, upi->slots[ref]);
+	else
+		lua_pushnil(upi->L);
+					/* perms reftbl ... obj? */
+}
+
 static void unpersistboolean(UnpersistInfo *upi)
 {
 					/* perms reftbl ... */
@@ -1499,17 +1668,15 @@ static void unpersistpermanent(int ref, UnpersistInfo *upi)
 }
 
 /* For debugging only; not called when lua_assert is empty */
-int inreftable(lua_State *L, int ref)
+int inreftable(UnpersistInfo *upi, int ref)
 {
 	int res;
-	lua_checkstack(L, 1);
+	lua_checkstack(upi->L, 1);
 					/* perms reftbl ... */
-	lua_pushlightuserdata(L, (void*)(intptr_t)ref);
-					/* perms reftbl ... ref */
-	lua_gettable(L, 2);
+	pushref(upi, ref);
 					/* perms reftbl ... obj? */
-	res = !lua_isnil(L, -1);
-	lua_pop(L, 1);
+	res = !lua_isnil(upi->L, -1);
+	lua_pop(upi->L, 1);
 					/* perms reftbl ... */
 	return res;
 }
@@ -1525,7 +1692,9 @@ static void unpersist(UnpersistInfo *upi)
 		int ref;
 		int type;
 		LIF(Z,read)(&upi->zio, &ref, sizeof(int));
-		lua_assert(!inreftable(upi->L, ref));
+		lua_assert(!inreftable(upi, ref));
+		if(ref > upi->maxref)
+			upi->maxref = ref;
 		LIF(Z,read)(&upi->zio, &type, sizeof(int));
 #ifdef PLUTO_DEBUG
 		printindent(upi->level);
@@ -1592,9 +1761,7 @@ static void unpersist(UnpersistInfo *upi)
 			lua_pushnil(upi->L);
 					/* perms reftbl ... nil */
 		} else {
-			lua_pushlightuserdata(upi->L, (void*)(intptr_t)ref);
-					/* perms reftbl ... ref */
-			lua_gettable(upi->L, 2);
+			pushref(upi, ref);
 					/* perms reftbl ... obj? */
 			lua_assert(!lua_isnil(upi->L, -1));
 		}
@@ -1604,7 +1771,10 @@ static void unpersist(UnpersistInfo *upi)
 	lua_assert(lua_gettop(upi->L) == stacksize + 1);
 }
 
-void pluto_unpersist(lua_State *L, lua_Chunkreader reader, void *ud)
+/* Unpersist the root object, leaving perms rootobj refs on the stack.
+ * refs is a table of ref -> object if wantrefs is set, nil otherwise.
+ * Returns the highest ref that was read. */
+static int unpersistroot(lua_State *L, lua_Chunkreader reader, void *ud, int wantrefs)
 {
 	/* We use the graciously provided ZIO (what the heck does the Z stand
 	 * for?) library so that we don't have to deal with the reader directly.
@@ -1612,23 +1782,66 @@ void pluto_unpersist(lua_State *L, lua_Chunkreader reader, void *ud)
 	 * very unpleasant.
 	 */
 	UnpersistInfo upi;
+	int i;
 	upi.L = L;
+	upi.maxref = 0;
+	upi.slotsize = PLUTO_MINREFS;
+	upi.nslots = 1;
 #ifdef PLUTO_DEBUG
 	upi.level = 0;
 #endif
 
-	lua_checkstack(L, 3);
+	lua_checkstack(L, 4);
 	LIF(Z,init)(L, &upi.zio, reader, ud);
 
 					/* perms */
 	lua_newtable(L);
 					/* perms reftbl */
+	upi.slots = (int *)lua_newuserdata(L, upi.slotsize * sizeof(int));
+	memset(upi.slots, 0, upi.slotsize * sizeof(int));
+					/* perms reftbl slots */
+	lua_rawseti(L, 2, 1);
+					/* perms reftbl */
 	lua_gc(L, LUA_GCSTOP, 0);
 	unpersist(&upi);
 	lua_gc(L, LUA_GCRESTART, 0);
 					/* perms reftbl rootobj */
-	lua_replace(L, 2);
-					/* perms rootobj  */
+	if(wantrefs) {
+		lua_createtable(L, 0, upi.nslots);
+					/* perms reftbl rootobj refs */
+		for(i = 1; i < upi.slotsize; i++) {
+			if(upi.slots[i] == 0)
+				continue;
+			lua_rawgeti(L, 2, upi.slots[i]);
+			/* Protos aren't values to Lua code */
+			if(lua_type(L, -1) > LUA_TTHREAD) {
+				lua_pop(L, 1);
+				continue;
+			}
+			lua_rawseti(L, -2, i);
+		}
+	} else {
+		lua_pushnil(L);
+	}
+					/* perms reftbl rootobj refs */
+	lua_remove(L, 2);
+					/* perms rootobj refs */
+	return upi.maxref;
+}
+
+/* Like pluto_unpersist, but leaves a table of the objects that were read
+ * (ref -> obj) above the root object. */
+int pluto_unpersistrefs(lua_State *L, lua_Chunkreader reader, void *ud)
+{
+	return unpersistroot(L, reader, ud, 1);
+}
+
+void pluto_unpersist(lua_State *L, lua_Chunkreader reader, void *ud)
+{
+	unpersistroot(L, reader, ud, 0);
+					/* perms rootobj nil */
+	lua_pop(L, 1);
+					/* perms rootobj */
 }
 
 typedef struct LoadInfo_t {
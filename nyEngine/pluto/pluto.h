@@ -22,4 +22,10 @@ void pluto_persist(lua_State *L, lua_Chunkwriter writer, void *ud);
 
 void pluto_unpersist(lua_State *L, lua_Chunkreader reader, void *ud);
 
+/* As above, but the reference table is left on top of the stack and the
+ * highest reference written is returned, both sides return the same one */
+int pluto_persistrefs(lua_State *L, lua_Chunkwriter writer, void *ud);
+
+int pluto_unpersistrefs(lua_State *L, lua_Chunkreader reader, void *ud);
+
 LUALIB_API int luaopen_pluto(lua_State *L);
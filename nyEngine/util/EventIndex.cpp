@@ -0,0 +1,217 @@
+#include "..\include.h"
+#include "EventIndex.h"
+
+#define EVENT_INDEX_MIN_BUCKETS 64
+
+CEventIndex::CEventIndex()
+{
+	buckets.resize(EVENT_INDEX_MIN_BUCKETS, NULL);
+	eventBuckets.resize(EVENT_INDEX_MIN_BUCKETS, NULL);
+	queueCount = 0;
+}
+
+CEventIndex::~CEventIndex()
+{
+	Clear();
+}
+
+void CEventIndex::Clear()
+{
+	uint i, j;
+	EVENT_QUEUE * queue, * next;
+	EVENT_LINK * link, * nextLink;
+
+	for(i = 0;i < buckets.size();i++)
+	{
+		for(queue = buckets[i];queue;queue = next)
+		{
+			next = queue->hashNext;
+
+			// Unlink everything so the links don't point back into the queue
+			for(j = 0;j < EVENT_LIST_COUNT;j++)
+			{
+				for(link = queue->lists[j].next;link != &queue->lists[j];link = nextLink)
+				{
+					nextLink = link->next;
+					link->next = link->prev = NULL;
+					link->queue = NULL;
+				}
+			}
+
+			delete queue;
+		}
+
+		buckets[i] = NULL;
+		eventBuckets[i] = NULL;
+	}
+
+	queueCount = 0;
+}
+
+uint CEventIndex::hashKey(void * entity, uint event) const
+{
+	uint hash = (event * 2246822519) ^ ((uint)(size_t)entity * 2654435761);
+	return (hash ^ (hash >> 16)) & (buckets.size() - 1);
+}
+
+uint CEventIndex::hashEvent(uint event) const
+{
+	uint hash = event * 2246822519;
+	return (hash ^ (hash >> 16)) & (eventBuckets.size() - 1);
+}
+
+void CEventIndex::linkEvent(EVENT_QUEUE * queue)
+{
+	EVENT_QUEUE ** head = &eventBuckets[hashEvent(queue->event)];
+
+	queue->eventNext = *head;
+	queue->eventPrev = head;
+	if(*head)
+		(*head)->eventPrev = &queue->eventNext;
+	*head = queue;
+}
+
+void CEventIndex::grow()
+{
+	std::vector<EVENT_QUEUE *> old;
+	EVENT_QUEUE * queue, * next;
+	uint i, slot;
+
+	old.swap(buckets);
+	buckets.resize(old.size() * 2, NULL);
+	eventBuckets.assign(buckets.size(), NULL);
+
+	for(i = 0;i < old.size();i++)
+	{
+		for(queue = old[i];queue;queue = next)
+		{
+			next = queue->hashNext;
+			slot = hashKey(queue->entity, queue->event);
+			queue->hashNext = buckets[slot];
+			buckets[slot] = queue;
+			linkEvent(queue);
+		}
+	}
+}
+
+EVENT_QUEUE * CEventIndex::Find(void * entity, uint event)
+{
+	EVENT_QUEUE * queue;
+
+	for(queue = buckets[hashKey(entity, event)];queue;queue = queue->hashNext)
+	{
+		if(queue->entity == entity && queue->event == event)
+			return queue;
+	}
+
+	return NULL;
+}
+
+void CEventIndex::FindAll(uint event, std::vector<EVENT_QUEUE *>& queues)
+{
+	EVENT_QUEUE * queue;
+
+	// Only the event chain this event hashes to, other events sharing it are skipped
+	for(queue = eventBuckets[hashEvent(event)];queue;queue = queue->eventNext)
+	{
+		if(queue->event == event)
+			queues.push_back(queue);
+	}
+}
+
+void CEventIndex::GetAll(int list, std::vector<void *>& owners)
+{
+	EVENT_QUEUE * queue;
+	EVENT_LINK * link;
+	uint i;
+
+	for(i = 0;i < buckets.size();i++)
+	{
+		for(queue = buckets[i];queue;queue = queue->hashNext)
+		{
+			for(link = queue->lists[list].next;link != &queue->lists[list];link = link->next)
+				owners.push_back(link->owner);
+		}
+	}
+}
+
+void CEventIndex::Link(EVENT_LINK * link, int list, void * entity, uint event)
+{
+	EVENT_QUEUE * queue;
+	EVENT_LINK * head;
+	uint slot, i;
+
+	if(IsLinked(link))
+		Unlink(link);
+
+	queue = Find(entity, event);
+	if(queue == NULL)
+	{
+		if(queueCount >= buckets.size())
+			grow();
+
+		queue = new EVENT_QUEUE;
+		queue->entity = entity;
+		queue->event = event;
+		queue->refCount = 0;
+		for(i = 0;i < EVENT_LIST_COUNT;i++)
+			queue->lists[i].next = queue->lists[i].prev = &queue->lists[i];
+
+		slot = hashKey(entity, event);
+		queue->hashNext = buckets[slot];
+		buckets[slot] = queue;
+		linkEvent(queue);
+		queueCount++;
+	}
+
+	// Add to the tail so registrations keep their order
+	head = &queue->lists[list];
+	link->next = head;
+	link->prev = head->prev;
+	head->prev->next = link;
+	head->prev = link;
+	link->queue = queue;
+	queue->refCount++;
+}
+
+void CEventIndex::Unlink(EVENT_LINK * link)
+{
+	EVENT_QUEUE * queue = link->queue;
+
+	if(queue == NULL)
+		return;
+
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	link->next = link->prev = NULL;
+	link->queue = NULL;
+
+	Unpin(queue);
+}
+
+void CEventIndex::Unpin(EVENT_QUEUE * queue)
+{
+	if(--queue->refCount == 0)
+		freeQueue(queue);
+}
+
+void CEventIndex::freeQueue(EVENT_QUEUE * queue)
+{
+	EVENT_QUEUE ** prev;
+
+	for(prev = &buckets[hashKey(queue->entity, queue->event)];*prev;prev = &(*prev)->hashNext)
+	{
+		if(*prev == queue)
+		{
+			*prev = queue->hashNext;
+			break;
+		}
+	}
+
+	*queue->eventPrev = queue->eventNext;
+	if(queue->eventNext)
+		queue->eventNext->eventPrev = queue->eventPrev;
+
+	delete queue;
+	queueCount--;
+}
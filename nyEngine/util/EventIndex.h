@@ -0,0 +1,80 @@
+#ifndef _EVENTINDEX_H
+#define _EVENTINDEX_H
+
+#include <vector>
+
+// The lists every event queue keeps
+#define EVENT_LIST_WAIT 0 // threads in waittill
+#define EVENT_LIST_ENDON 1 // threads that end on the event
+#define EVENT_LIST_NOTIFY 2 // onnotify callbacks
+#define EVENT_LIST_COUNT 3
+
+// A registration on an event queue, this lives inside the object being registered
+typedef struct _EVENT_LINK
+{
+	struct _EVENT_LINK * next, * prev;
+	// The queue this link is registered on, NULL if it isn't registered
+	struct _EVENT_QUEUE * queue;
+	// The object that owns this link
+	void * owner;
+} EVENT_LINK;
+
+// Everything registered on a single (entity, event) pair
+typedef struct _EVENT_QUEUE
+{
+	// Next queue in the same hash bucket
+	struct _EVENT_QUEUE * hashNext;
+	// The chain of queues whose event lands in the same event bucket, whatever their entity
+	struct _EVENT_QUEUE * eventNext, ** eventPrev;
+	void * entity;
+	// The event atom
+	uint event;
+	// Registered links plus pins, the queue is freed once this drops to 0
+	uint refCount;
+	// Circular lists, these nodes are the list heads
+	EVENT_LINK lists[EVENT_LIST_COUNT];
+} EVENT_QUEUE;
+
+// Hash of (entity, event atom) to the queue of everything registered on it
+class CEventIndex
+{
+public:
+	CEventIndex();
+	~CEventIndex();
+
+	// Free every queue, registered links are left unlinked
+	void Clear();
+
+	// Register a link on the queue for (entity, event), appending it to 'list'
+	void Link(EVENT_LINK * link, int list, void * entity, uint event);
+	// Take a link off its queue, does nothing if the link is not registered
+	void Unlink(EVENT_LINK * link);
+	static bool IsLinked(const EVENT_LINK * link) { return link->queue != NULL; }
+
+	// Find the queue for (entity, event), NULL if nothing is registered on it
+	EVENT_QUEUE * Find(void * entity, uint event);
+	// Append every queue for 'event' to 'queues', whatever the entity
+	void FindAll(uint event, std::vector<EVENT_QUEUE *>& queues);
+	// Append the owner of every link on 'list' of every queue to 'owners'
+	void GetAll(int list, std::vector<void *>& owners);
+
+	// Keep a queue alive while its lists are being walked
+	void Pin(EVENT_QUEUE * queue) { queue->refCount++; }
+	void Unpin(EVENT_QUEUE * queue);
+
+	static bool IsEmpty(const EVENT_QUEUE * queue, int list) { return queue->lists[list].next == &queue->lists[list]; }
+
+private:
+	uint hashKey(void * entity, uint event) const;
+	uint hashEvent(uint event) const;
+	void linkEvent(EVENT_QUEUE * queue);
+	void grow();
+	void freeQueue(EVENT_QUEUE * queue);
+
+	std::vector<EVENT_QUEUE *> buckets;
+	// The same queues hashed by event alone, so FindAll only walks queues of one event
+	std::vector<EVENT_QUEUE *> eventBuckets;
+	uint queueCount;
+};
+
+#endif
@@ -0,0 +1,102 @@
+#include "..\include.h"
+#include "IdAllocator.h"
+
+CIdAllocator::CIdAllocator()
+{
+	Reset();
+}
+
+void CIdAllocator::Reset()
+{
+	generations.clear();
+	freeSlots.clear();
+}
+
+uint64 CIdAllocator::Alloc()
+{
+	uint slot;
+
+	// Reusing the slot freed longest ago keeps any one slot's generation from climbing fast
+	if(freeSlots.size() > ID_MIN_FREE_SLOTS)
+	{
+		slot = freeSlots.front();
+		freeSlots.pop_front();
+	}
+	else
+	{
+		slot = generations.size();
+		if(slot > ID_SLOT_MASK)
+			dbgError("CIdAllocator::Alloc - out of id slots");
+		generations.push_back(0);
+	}
+
+	// Bump to an odd generation, this also keeps the id from ever being 0
+	generations[slot] = (generations[slot] + 1) & ID_GENERATION_MASK;
+
+	return ((uint64)generations[slot] << ID_SLOT_BITS) | slot;
+}
+
+void CIdAllocator::Free(uint64 id)
+{
+	uint slot = (uint)id & ID_SLOT_MASK;
+
+	if(!IsValid(id))
+		dbgError("CIdAllocator::Free - id %08x%08x is not allocated", (uint)(id >> 32), (uint)id);
+
+	// Back to an even generation, the slot can't be mistaken for its old owner once reused
+	generations[slot] = (generations[slot] + 1) & ID_GENERATION_MASK;
+
+	// The generation wrapped, reusing the slot could hand out ids seen before, so retire it
+	if(generations[slot] == 0)
+		return;
+
+	freeSlots.push_back(slot);
+}
+
+bool CIdAllocator::IsValid(uint64 id) const
+{
+	uint slot = (uint)id & ID_SLOT_MASK;
+	uint64 generation = id >> ID_SLOT_BITS;
+
+	return slot < generations.size() && (generation & 1) && generations[slot] == generation;
+}
+
+void CIdAllocator::save(file& f)
+{
+	uint i;
+
+	f.write((uint)generations.size());
+	for(i = 0;i < generations.size();i++)
+	{
+		f.write((uint)generations[i]);
+		f.write((uint)(generations[i] >> 32));
+	}
+
+	f.write((uint)freeSlots.size());
+	for(i = 0;i < freeSlots.size();i++)
+		f.write(freeSlots[i]);
+}
+
+void CIdAllocator::load(file& f)
+{
+	uint i, count;
+
+	Reset();
+
+	count = f.readuint32();
+	generations.resize(count);
+	for(i = 0;i < count;i++)
+	{
+		generations[i] = f.readuint32();
+		generations[i] |= (uint64)f.readuint32() << 32;
+	}
+
+	count = f.readuint32();
+	freeSlots.resize(count);
+	for(i = 0;i < count;i++)
+	{
+		freeSlots[i] = f.readuint32();
+		if(freeSlots[i] >= generations.size())
+			dbgError("CIdAllocator::load - free slot %u is out of range", freeSlots[i]);
+	}
+}
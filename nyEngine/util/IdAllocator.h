@@ -0,0 +1,42 @@
+#ifndef _IDALLOCATOR_H
+#define _IDALLOCATOR_H
+
+#include <vector>
+#include <deque>
+
+// Ids are a slot index in the low 20 bits and the slot's generation above that
+// Generations are kept to 33 bits so an id fits exactly in a lua_Number
+#define ID_SLOT_BITS 20
+#define ID_SLOT_MASK 0xFFFFF
+#define ID_GENERATION_MASK 0x1FFFFFFFFULL
+#define ID_INVALID 0
+// Freed slots wait until this many others are free before they are reused
+#define ID_MIN_FREE_SLOTS 1024
+
+// Hands out unique ids in constant time
+// Freeing an id bumps the generation of its slot, so a stale id never matches the slot's next owner
+// Slots are reused oldest first, and a slot whose generation runs out is retired instead of wrapping
+class CIdAllocator
+{
+public:
+	CIdAllocator();
+
+	// Forget every id
+	void Reset();
+
+	uint64 Alloc();
+	void Free(uint64 id);
+	// If the id is currently allocated
+	bool IsValid(uint64 id) const;
+
+	// Save/Load the allocator state, so ids stay unique across a savegame
+	void save(file& f);
+	void load(file& f);
+
+private:
+	// Generation of each slot, odd while the slot is in use
+	std::vector<uint64> generations;
+	std::deque<uint> freeSlots;
+};
+
+#endif
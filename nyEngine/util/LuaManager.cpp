@@ -1,14 +1,17 @@
 #include "..\include.h"
 #include "LuaManager.h"
+#include "luaStore.h"
 #include "..\game\game.h"
 #include "..\Gorilla\GorillaLua.h"
 extern "C" {
 #include "..\pluto\pluto.h"
 }
+#include <time.h>
 
 #define LUA_ERROR(L) dbgError("script error: %s", lua_tostring(L, -1))
 
-// The lua program that prepares namespaces and loads functions into them
+// The lua program that sets up the anti-persist table and the script utilities
+// Scripts are loaded into their namespaces by LoadScript
 const char luaNamespacePrepFunction[] =
 "-- utility function to throw an object onto the anti-persist stack\n" \
 "-- because of how the scripts work, this will always be called\n" \
@@ -43,36 +46,6 @@ const char luaNamespacePrepFunction[] =
 "    \n" \
 "    return tab\n" \
 "end\n" \
-"-- run 'func' under the context of table 'namespace'\n" \
-"function loadFuncIntoNamespace (namespace, func)\n" \
-"    -- Split the name\n" \
-"    local names = splitString(namespace, \"/\")\n" \
-"\n" \
-"    -- Create the namespaces\n" \
-"    local table = _G\n" \
-"\n" \
-"    print(\"walking table\")\n" \
-"    for index, value in ipairs(names) do\n" \
-"        print(\"creating table: \" .. value)\n" \
-"        if table[value] == nil then\n" \
-"            table[value] = { }\n" \
-"        end\n" \
-"        table = table[value]\n" \
-"    end\n" \
-"\n" \
-"    -- set the metatable of the file namespace\n" \
-"    setmetatable(table, { __index = _G })\n" \
-"\n" \
-"    -- change the file's environment to the namespace\n" \
-"    setfenv(func, table)\n" \
-"    func()\n" \
-"    -- now create a thread for the init() function, there are no arguments for init\n" \
-"    -- the init function has no owner\n" \
-"    if(table.init ~= nil) then\n" \
-"        createThread(nil, table.init)\n" \
-"    return table\n" \
-"    end\n" \
-"end\n" \
 "function deepcopy(orig)\n" \
 "    local orig_type = type(orig)\n" \
 "    local copy\n" \
@@ -89,15 +62,94 @@ const char luaNamespacePrepFunction[] =
 "end\n" \
 "-- ensure these functions aren't persisted\n" \
 "antipersist(deepcopy)\n" \
-"antipersist(loadFuncIntoNamespace)\n" \
 "antipersist(splitString)\n" \
 "antipersist(antipersist)\n" \
 "-- ensure that the tables aren't persisted either\n" \
 "antipersist(AntiPersist)\n" \
-"antipersist(PersistRestore)\n";
+"antipersist(PersistRestore)\n" \
+"antipersist(Resources)\n" \
+"antipersist(Events)\n" \
+"antipersist(Namespaces)\n" \
+"-- references to _G come back as the live _G\n" \
+"antipersist(_G)\n";
 
 CLuaManager * CLuaManager::singleton;
 
+// How many milliseconds of script execution a tick may use, 0 for no limit
+CVar * g_scriptbudget;
+// How many instructions a thread runs between checks of the budget
+CVar * g_scriptslice;
+// Turns the script profiler on, the samples are written out when it is turned off again
+CVar * g_scriptprofile;
+// How many instructions a thread runs between profiler samples
+CVar * g_scriptprofilerate;
+// Where the profiler writes its samples
+CVar * g_scriptprofilefile;
+// How many shards to run scripts on besides the main state, 0 runs everything on the main state
+CVar * g_scriptshards;
+// ';' separated namespaces that don't touch any other namespace, these are spread over the shards
+CVar * g_scriptshardnamespaces;
+// The least the collector steps each frame (KB), keeps the heap in check when there is no spare time
+CVar * g_scriptgcminstep;
+// How many workers inflate script items while a map loads, 0 loads them on the main thread
+CVar * g_scriptloadworkers;
+// Leaves the functions inside compiled scripts unloaded until they are first used
+// Loads faster, but the whole compiled script is kept until every function in it has run, so the heap grows
+CVar * g_scriptlazyload;
+// How many times its size after the last collector cycle the heap can grow before the collector runs on its own
+// A backstop for loads, frames that don't collect, or allocations that outpace the frame steps
+CVar * g_scriptgclimit;
+
+// The backstop never kicks in below this (KB)
+#define SCRIPT_GC_MIN_LIMIT 4096
+
+// A shard and the worker thread that ticks it
+typedef struct _SCRIPT_SHARD
+{
+	CLuaManager * manager;
+	thread worker;
+	semaphore start, done;
+	// What the worker should tick
+	double delta;
+	uint event;
+	// Run the collector instead of a tick
+	bool collect;
+	double gcBudget;
+	bool quit;
+} SCRIPT_SHARD;
+
+// The most workers that inflate script items while a map's scripts load
+#define SCRIPT_LOAD_MAX_WORKERS 16
+
+// Script items of a map and its patch, in the order they are loaded into the state
+// The workers take the next item to inflate from here, the main thread takes them in order
+typedef struct _SCRIPT_LOAD
+{
+	std::vector<map_t *> maps;
+	std::vector<uint> indices;
+	// The inflated items, NULL until a worker has finished with them
+	std::vector<sectionitem_t *> items;
+	lock state;
+	uint nextItem;
+	// Posted each time an item is ready
+	semaphore ready;
+} SCRIPT_LOAD;
+
+// A save that is being written in the background
+typedef struct _SAVE_JOB
+{
+	string path;
+	// The sections, uncompressed, in memory files
+	file vars, snapshot, script, threads;
+	// Each shard's sections, shards have no vars of their own
+	std::vector<struct _SAVE_JOB *> shards;
+	thread worker;
+	lock state;
+	bool finished;
+	// Set along with finished if the file couldn't be written
+	bool failed;
+} SAVE_JOB;
+
 int luaFileWriter(lua_State * L, const void * p, size_t sz, void * ud)
 {
 	file& out = *(file*)ud;
@@ -126,19 +178,39 @@ void CLuaManager::Compile(file& in, file& out, const char * filename)
 	free(buf);
 }
 
-CLuaManager::CLuaManager()
+CLuaManager::CLuaManager(int shardIndex)
 {
-	singleton = this;
+	if(shardIndex < 0)
+		singleton = this;
+	this->shardIndex = shardIndex;
+	ticking = false;
 	didInit = false;
+	scriptTicks = 0;
+	tickDeadline = 0;
+	sliceInstructions = 0;
+	sampleInstructions = 0;
+	budgetYields = 0;
+	gcCycles = 0;
+	gcRate = 10000;
+	gcLiveBytes = 0;
+	saveJob = NULL;
+	snapshotIds = snapshotThreads = snapshotObjects = snapshotClosures = LUA_NOREF;
+	snapshotChain = snapshotSerial = 0;
+	snapshotNextId = 1;
+	threadAnchors = LUA_NOREF;
+	anchorCount = 0;
 }
 
 CLuaManager::~CLuaManager()
 {
 	if(didInit)
 	{
-		luaThreads.clear();
-		queueThreads.clear();
-		tempQueue.clear();
+		if(profiler.IsRunning())
+			stopProfiler();
+
+		waitSave();
+		deleteShards();
+		deleteThreads();
 
 		if(L)
 			lua_close(L);
@@ -152,19 +224,195 @@ void CLuaManager::Init()
 
 	didInit = true;
 
+	// The shards share the main manager's vars
+	if(shardIndex < 0)
+	{
+		g_scriptbudget = CVar::Create("g_scriptbudget", 5.0, VAR_NOSYNC, 0.0, 1000.0);
+		g_scriptslice = CVar::Create("g_scriptslice", 1000, VAR_NOSYNC, 1, 1000000);
+		g_scriptprofile = CVar::Create("g_scriptprofile", false, VAR_NOSYNC | VAR_NOLOAD);
+		g_scriptprofilerate = CVar::Create("g_scriptprofilerate", 1000, VAR_NOSYNC, 1, 1000000);
+		g_scriptprofilefile = CVar::Create("g_scriptprofilefile", "scriptprofile.txt", VAR_NOSYNC);
+		g_scriptshards = CVar::Create("g_scriptshards", 0, VAR_NOSYNC, 0, SCRIPT_MAX_SHARDS);
+		g_scriptshardnamespaces = CVar::Create("g_scriptshardnamespaces", "", VAR_NOSYNC);
+		g_scriptgcminstep = CVar::Create("g_scriptgcminstep", 1, VAR_NOSYNC, 0, 1000000);
+		g_scriptloadworkers = CVar::Create("g_scriptloadworkers", 4, VAR_NOSYNC, 0, SCRIPT_LOAD_MAX_WORKERS);
+		g_scriptlazyload = CVar::Create("g_scriptlazyload", false, VAR_NOSYNC);
+		g_scriptgclimit = CVar::Create("g_scriptgclimit", 4.0, VAR_NOSYNC, 1.5, 100.0);
+	}
+
 	L = NULL;
 	ResetState();
 }
 
-void CLuaManager::Tick(double delta, const char * Event)
+void CLuaManager::Tick(double delta, uint Event)
+{
+	uint j;
+	bool saved = false, failed = false;
+
+	// Let the scripts know once a background save is on disk, or that it couldn't be written
+	if(saveJob)
+	{
+		saveJob->state.enter();
+		saved = saveJob->finished;
+		failed = saveJob->failed;
+		saveJob->state.leave();
+	}
+
+	if(saved)
+	{
+		if(failed)
+			dbgOut("unable to write save game '%s'", saveJob->path.c_str());
+		waitSave();
+		Notify(ENTITY_LEVEL, failed ? "savefailed" : "savecomplete");
+	}
+
+	// Start the shards, they tick on their workers alongside the main state
+	for(j = 0;j < shards.size();j++)
+	{
+		shards[j]->delta = delta;
+		shards[j]->event = Event;
+		shards[j]->start.post();
+	}
+
+	ticking = true;
+	tickLocal(delta, Event);
+	ticking = false;
+
+	if(shards.size())
+	{
+		for(j = 0;j < shards.size();j++)
+			shards[j]->done.wait();
+
+		routeMessages();
+	}
+}
+
+double CLuaManager::CollectGarbage(double budget)
+{
+	double start = platformTime();
+	uint j;
+
+	if(budget < 0)
+		budget = 0;
+
+	// The shards collect on their workers at the same time
+	for(j = 0;j < shards.size();j++)
+	{
+		shards[j]->collect = true;
+		shards[j]->gcBudget = budget;
+		shards[j]->start.post();
+	}
+
+	collectLocal(budget);
+
+	for(j = 0;j < shards.size();j++)
+	{
+		shards[j]->done.wait();
+		shards[j]->collect = false;
+		gcCycles += shards[j]->manager->gcCycles;
+		shards[j]->manager->gcCycles = 0;
+	}
+
+	return platformTime() - start;
+}
+
+double CLuaManager::collectLocal(double budget)
+{
+	double start, elapsed;
+	int kb;
+	bool finished;
+
+	// Work out how big a step fits in the budget from how fast the last steps went
+	kb = (int)(budget * gcRate);
+	if(kb < g_scriptgcminstep->GetInt())
+		kb = g_scriptgcminstep->GetInt();
+
+	start = platformTime();
+	finished = lua_gc(L, LUA_GCSTEP, kb) != 0;
+	elapsed = platformTime() - start;
+
+	if(finished)
+	{
+		gcCycles++;
+		gcLiveBytes = allocator.Stats().bytes;
+	}
+	// A step that finished a cycle stops short, so it says nothing about the rate
+	else if(kb > 0 && elapsed > 0)
+		gcRate = gcRate * 0.75 + (kb / elapsed) * 0.25;
+
+	// Stepping sets a new threshold, which would let allocations start the collector again
+	limitHeap();
+
+	return elapsed;
+}
+
+void CLuaManager::limitHeap()
+{
+	size_t limit = (size_t)(gcLiveBytes * g_scriptgclimit->GetDouble()) >> 10;
+
+	if(limit < SCRIPT_GC_MIN_LIMIT)
+		limit = SCRIPT_GC_MIN_LIMIT;
+
+	// The collector is left to CollectGarbage, unless the heap gets this big before the next step
+	// Past the limit it runs on its own like a normal state, until the next step stops it again
+	lua_gc(L, LUA_GCLIMIT, (int)limit);
+}
+
+void CLuaManager::tickLocal(double delta, uint Event)
 {
-	std::vector<LUA_THREAD>::iterator i;
+	std::vector<LUA_THREAD *>::iterator i;
+	uint j;
+
+	// Every thread resumed in this tick shares the budget
+	if(g_scriptbudget->GetDouble() > 0)
+		tickDeadline = platformTime() + g_scriptbudget->GetDouble() / 1000.0;
+	else
+		tickDeadline = 0;
+	sliceInstructions = g_scriptslice->GetInt();
+	budgetYields = 0;
+
+	// Start or stop the profiler when the var changes
+	if(g_scriptprofile->GetBool() && !profiler.IsRunning())
+		profiler.Start();
+	else if(!g_scriptprofile->GetBool() && profiler.IsRunning())
+		stopProfiler();
+	sampleInstructions = profiler.IsRunning() ? g_scriptprofilerate->GetInt() : 0;
+
+	if(Event == ATOM_NONE)
+	{
+		// Advance the script clock and wake any threads whose sleep has elapsed
+		scriptTicks += delta * TICKS_PER_SECOND;
+		sleepWheel.Advance((uint64)(scriptTicks + 0.001), wokenThreads);
+		for(j = 0;j < wokenThreads.size();j++)
+		{
+			LUA_THREAD * thr = (LUA_THREAD *)wokenThreads[j];
+			thr->waittime = 0;
+			luaThreads.push_back(thr);
+		}
+		wokenThreads.clear();
+
+		// Tick each thread
+		for(i = luaThreads.begin();i != luaThreads.end();)
+			i = tickThread(i, &luaThreads);
+	}
+	else
+	{
+		// Only run the threads waiting on this event, whatever entity they are waiting on
+		events.FindAll(Event, eventQueues);
+		for(j = 0;j < eventQueues.size();j++)
+			wakeWaiters(eventQueues[j], tempQueue);
+		eventQueues.clear();
+
+		for(i = tempQueue.begin();i != tempQueue.end();)
+			i = tickThread(i, &tempQueue);
 
-	// Tick each thread
-	for(i = luaThreads.begin();i != luaThreads.end();)
-		i = tickThread(i, &luaThreads, delta, Event);
+		for(i = tempQueue.begin();i != tempQueue.end();i++)
+			luaThreads.push_back(*i);
+		tempQueue.clear();
+	}
 
 	// Run any queued thread once, allowing for threads to start waiting immediately
+	// Threads queued during an event tick wait for the next regular tick
 	while(queueThreads.size())
 	{
 		// Clone the thread queue
@@ -173,8 +421,11 @@ void CLuaManager::Tick(double delta, const char * Event)
 		queueThreads.clear();
 
 		// Tick the threads
-		for(i = tempQueue.begin();i != tempQueue.end();)
-			i = tickThread(i, &tempQueue, delta, Event);
+		if(Event == ATOM_NONE)
+		{
+			for(i = tempQueue.begin();i != tempQueue.end();)
+				i = tickThread(i, &tempQueue);
+		}
 
 		// Merge the queue into the main list
 		for(i = tempQueue.begin();i != tempQueue.end();i++)
@@ -186,260 +437,1749 @@ void CLuaManager::Tick(double delta, const char * Event)
 void CLuaManager::LoadScript(sectionitem_t * item)
 {
 	char nspace[0x200];
-	char * c;
+	const char * name, * end, * c;
+	lua_State * TL;
+	double count;
 
 	// Load the script
 	if(luaL_loadbuffer(L, (const char *)item->data, item->size, item->name) != 0)
 		LUA_ERROR(L);
 
-	// Now process the script into the appropriate namespace
+	// The namespace is the file name without its extension
 	c = strrchr(item->name, '.');
 	memset(nspace, 0, sizeof(nspace));
-	strncpy(nspace, item->name, c - item->name);
-	
-	lua_getglobal(L, "loadFuncIntoNamespace"); // the function we are calling
-	lua_pushstring(L, nspace); // the namespace
-	lua_pushvalue(L, -3); // the function that we just loaded
-	if(lua_pcall(L, 2, 1, 0) != 0)
+	strncpy(nspace, item->name, c ? c - item->name : sizeof(nspace) - 1);
+
+	// Each part of 'a/b/c' is a table in the one before it, starting from _G
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	end = nspace + strlen(nspace);
+	for(name = nspace;name < end;name = c + 1)
+	{
+		c = strchr(name, '/');
+		if(c == NULL)
+			c = end;
+		if(c == name)
+			continue;
+
+		lua_pushlstring(L, name, c - name);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, -3);
+		if(lua_isnil(L, -1))
+		{
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -2);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, -5);
+		}
+		else if(!lua_istable(L, -1))
+			dbgError("script namespace '%s' is a %s", nspace, luaL_typename(L, -1));
+
+		// Namespaces['a/b'] = table, the table itself is anti persisted and its contents are saved with the scripts
+		lua_getglobal(L, "Namespaces");
+		lua_pushlstring(L, nspace, c - nspace);
+		lua_rawget(L, -2);
+		if(lua_isnil(L, -1))
+		{
+			lua_getglobal(L, "antipersist");
+			lua_pushvalue(L, -4);
+			if(lua_pcall(L, 1, 0, 0) != 0)
+				LUA_ERROR(L);
+
+			lua_pushlstring(L, nspace, c - nspace);
+			lua_pushvalue(L, -4);
+			lua_rawset(L, -4);
+		}
+		lua_pop(L, 2);
+
+		// Leave only the new table in place of its parent
+		lua_replace(L, -3);
+		lua_pop(L, 1);
+	}
+
+	// Globals are reached through the namespace
+	lua_createtable(L, 0, 1);
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+
+	// Run the script with the namespace as its environment
+	lua_insert(L, -2);
+	lua_pushvalue(L, -2);
+	lua_setfenv(L, -2);
+	if(lua_pcall(L, 0, 0, 0) != 0)
 		LUA_ERROR(L);
 
-	// loadFuncIntoNamespace returns the table the functions were loaded into
-	// Walk that table, adding all functions to the anti-persist table
+	// Name it for the profiler, the table is the environment of everything in the script
+	profiler.AddNamespace(lua_topointer(L, -1), nspace);
+
+	// init() runs on a thread of its own, it has no owner and no arguments
+	lua_pushliteral(L, "init");
+	lua_rawget(L, -2);
+	if(!lua_isnil(L, -1))
+	{
+		TL = CreateThread(1);
+		lua_xmove(L, TL, 1);
+		lua_pushnil(TL);
+	}
+	else
+		lua_pop(L, 1);
+
+	// Everything in the namespace is part of the scripts, so it goes on the anti-persist table
+	// AntiPersist[value] = AntiPersistCount, PersistRestore[AntiPersistCount] = value
+	lua_getglobal(L, "AntiPersist");
+	lua_getglobal(L, "PersistRestore");
+	lua_getglobal(L, "AntiPersistCount");
+	count = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+
 	lua_pushnil(L);
-	while(lua_next(L, -2) != 0)
+	while(lua_next(L, -4) != 0)
 	{
-		// -2 = key, -1 = value
-		// Key is not important, value must be persisted
-		lua_getglobal(L, "antipersist");
-		lua_pushvalue(L, -2);
-		if(lua_pcall(L, 1, 0, 0) != 0)
-			LUA_ERROR(L);
+		lua_pushvalue(L, -1);
+		lua_pushnumber(L, count);
+		lua_rawset(L, -6);
 
-		// remove value
-		lua_pop(L, 1);
+		lua_pushnumber(L, count);
+		lua_insert(L, -2);
+		lua_rawset(L, -4);
+
+		count++;
+	}
+
+	lua_pushnumber(L, count);
+	lua_setglobal(L, "AntiPersistCount");
+	lua_pop(L, 3);
+}
+
+void CLuaManager::LoadResourceIds(map_t * map)
+{
+	uint i, j;
+	string symbol;
+
+	// Resources.SYMBOL = id, matching the RES_SYMBOL defines written by mapCompile
+	lua_getglobal(L, "Resources");
+	for(i = 0;i < MSectionCount;i++)
+	{
+		for(j = 0;j < map->sections[i].itemCount;j++)
+		{
+			mapResourceSymbol(map->sections[i].items[j].name, symbol);
+			lua_pushnumber(L, map->sections[i].items[j].id);
+			lua_setfield(L, -2, symbol.c_str());
+		}
 	}
+	lua_pop(L, 1);
+}
+
+static void scriptLoadWorker(void * param)
+{
+	SCRIPT_LOAD * load = (SCRIPT_LOAD *)param;
+	sectionitem_t * item;
+	uint i;
+
+	for(;;)
+	{
+		load->state.enter();
+		i = load->nextItem++;
+		load->state.leave();
+
+		if(i >= load->items.size())
+			break;
+
+		item = mapLoadItem(*load->maps[i], MSectionScript, load->indices[i]);
 
-	// All done!
+		load->state.enter();
+		load->items[i] = item;
+		load->state.leave();
+		load->ready.post();
+	}
 }
 
 void CLuaManager::LoadScripts(map_t * map, map_t * patch)
 {
+	SCRIPT_LOAD load;
+	thread workers[SCRIPT_LOAD_MAX_WORKERS];
+	sectionitem_t * item;
+	uint i, j, workerCount;
+
+	LoadResourceIds(map);
+	for(j = 0;j < shards.size();j++)
+		shards[j]->manager->LoadResourceIds(map);
+
 	if(patch)
 	{
-		for(uint i = 0;i < patch->sections[MSectionScript].itemCount;i++)
+		LoadResourceIds(patch);
+		for(j = 0;j < shards.size();j++)
+			shards[j]->manager->LoadResourceIds(patch);
+
+		for(i = 0;i < patch->sections[MSectionScript].itemCount;i++)
 		{
-			sectionitem_t * item = mapLoadItem(*patch, MSectionScript, i);
-			LoadScript(item);
-			mapUnloadItem(item);
+			load.maps.push_back(patch);
+			load.indices.push_back(i);
 		}
 	}
 
-	for(uint i = 0;i < map->sections[MSectionScript].itemCount;i++)
+	for(i = 0;i < map->sections[MSectionScript].itemCount;i++)
 	{
 		// If this script is present in the patch, ignore and move on
 		if(patch && mapLookupItem(*patch, MSectionScript, map->sections[MSectionScript].items[i].name, false))
 			continue;
 
-		sectionitem_t * item = mapLoadItem(*map, MSectionScript, i);
-		LoadScript(item);
+		load.maps.push_back(map);
+		load.indices.push_back(i);
+	}
+
+	// Every item is inflated on the workers up front, only loading them into the state is left for here
+	load.items.assign(load.maps.size(), NULL);
+	load.nextItem = 0;
+
+	workerCount = g_scriptloadworkers->GetInt();
+	if(workerCount > load.items.size())
+		workerCount = load.items.size();
+	for(i = 0;i < workerCount;i++)
+		workers[i].start(scriptLoadWorker, &load);
+
+	for(i = 0;i < load.items.size();i++)
+	{
+		if(workerCount)
+		{
+			// Each post is one more item done, though not necessarily this one
+			for(;;)
+			{
+				load.state.enter();
+				item = load.items[i];
+				load.state.leave();
+
+				if(item)
+					break;
+				load.ready.wait();
+			}
+		}
+		else
+			item = mapLoadItem(*load.maps[i], MSectionScript, load.indices[i]);
+
+		shardFor(item->name)->LoadScript(item);
 		mapUnloadItem(item);
 	}
+
+	for(i = 0;i < workerCount;i++)
+		workers[i].join();
 }
 
 lua_State * CLuaManager::CreateThread(int nargs)
 {
-	LUA_THREAD thr = {0};
-	thr.L = lua_newthread(L);
-	thr.firstRun = true;
-	thr.nargs = nargs;
-	thr.id = getNewThreadId();
+	LUA_THREAD * thr;
+	lua_State * TL;
+	int anchor;
+
+	if(threadPool.size())
+	{
+		// Reuse a finished thread, it is still anchored
+		thr = threadPool.back();
+		threadPool.pop_back();
+
+		TL = thr->L;
+		anchor = thr->anchor;
+		*thr = LUA_THREAD();
+		thr->L = TL;
+		thr->anchor = anchor;
+	}
+	else
+	{
+		lua_newthread(L);
+		thr = adoptThread();
+	}
+
+	lua_extraspace(thr->L) = thr;
+	thr->owner = this;
+	thr->firstRun = true;
+	thr->saveDirty = true;
+	thr->nargs = nargs;
+	thr->id = threadIds.Alloc();
+	thr->timer.owner = thr;
+	thr->waitLink.owner = thr;
+	for(int i = 0;i < ENDON_EVENT_COUNT;i++)
+		thr->endonLinks[i].owner = thr;
+
+	queueThreads.push_back(thr);
+	return thr->L;
+}
+
+LUA_THREAD * CLuaManager::adoptThread()
+{
+	// Give the thread on top of the stack a record, and pop it
+	LUA_THREAD * thr = new LUA_THREAD();
+
+	thr->L = lua_tothread(L, -1);
+	thr->owner = this;
+
+	if(freeAnchors.size())
+	{
+		thr->anchor = freeAnchors.back();
+		freeAnchors.pop_back();
+	}
+	else
+		thr->anchor = ++anchorCount;
+
+	// Make sure that the thread can't get garbage collected
+	// Registry[threadAnchors][anchor] = L
+	lua_rawgeti(L, LUA_REGISTRYINDEX, threadAnchors);
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, thr->anchor);
+	lua_pop(L, 2);
+
+	lua_extraspace(thr->L) = thr;
+	thr->timer.owner = thr;
+	thr->waitLink.owner = thr;
+	for(int i = 0;i < ENDON_EVENT_COUNT;i++)
+		thr->endonLinks[i].owner = thr;
+
+	return thr;
+}
+
+LUA_THREAD * CLuaManager::FindThread(lua_State * L)
+{
+	// Script threads carry their record in the extra space of the lua_State
+	return (LUA_THREAD *)lua_extraspace(L);
+}
+
+CLuaManager * CLuaManager::FromState(lua_State * L)
+{
+	LUA_THREAD * thr = (LUA_THREAD *)lua_extraspace(L);
+	CLuaManager * l;
+
+	if(thr)
+		return thr->owner;
+
+	// Not a script thread (the main state while scripts load), the manager is kept in the registry
+	lua_getfield(L, LUA_REGISTRYINDEX, "CLuaManager");
+	l = (CLuaManager *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	return l;
+}
+
+void CLuaManager::WaitTill(LUA_THREAD * thr, void * Entity, uint Event)
+{
+	// The thread is parked on the event once it yields
+	events.Link(&thr->waitLink, EVENT_LIST_WAIT, Entity, Event);
+}
+
+void CLuaManager::EndOn(LUA_THREAD * thr, void * Entity, uint Event)
+{
+	// Find an open event
+	for(int i = 0;i < ENDON_EVENT_COUNT;i++)
+	{
+		if(CEventIndex::IsLinked(&thr->endonLinks[i]))
+			continue;
+
+		events.Link(&thr->endonLinks[i], EVENT_LIST_ENDON, Entity, Event);
+		break;
+	}
+}
+
+void CLuaManager::OnNotify(void * Entity, uint Event, int funcReference)
+{
+	EVENT_NOTIFY * callback = new EVENT_NOTIFY();
+
+	callback->link.owner = callback;
+	callback->funcReference = funcReference;
+	events.Link(&callback->link, EVENT_LIST_NOTIFY, Entity, Event);
+	notifyCallbacks.push_back(callback);
+}
+
+void CLuaManager::wakeThread(LUA_THREAD * thr, std::vector<LUA_THREAD *>& list)
+{
+	// Pull a parked thread back into 'list', threads that aren't parked are already in a list
+	if(CTimerWheel::IsParked(&thr->timer))
+	{
+		sleepWheel.Remove(&thr->timer);
+		thr->waittime = 0;
+		list.push_back(thr);
+	}
+	else if(CEventIndex::IsLinked(&thr->waitLink))
+	{
+		events.Unlink(&thr->waitLink);
+		list.push_back(thr);
+	}
+}
+
+void CLuaManager::wakeWaiters(EVENT_QUEUE * queue, std::vector<LUA_THREAD *>& list)
+{
+	// Unlinking the last waiter would free the queue
+	events.Pin(queue);
+
+	while(!CEventIndex::IsEmpty(queue, EVENT_LIST_WAIT))
+	{
+		LUA_THREAD * thr = (LUA_THREAD *)queue->lists[EVENT_LIST_WAIT].next->owner;
+		events.Unlink(&thr->waitLink);
+		list.push_back(thr);
+	}
+
+	events.Unpin(queue);
+}
+
+void CLuaManager::Notify(void * Entity, uint Event, void * Argument)
+{
+	SCRIPT_MESSAGE msg;
+
+	notifyLocal(Entity, Event, Argument);
+
+	// Shards are running (or this is one), the others hear about it once the tick is over
+	if(shardIndex >= 0 || (ticking && shards.size()))
+	{
+		msg.entity = Entity;
+		msg.event = Event;
+		msg.argument = Argument;
+		outbox.push_back(msg);
+	}
+	else
+	{
+		for(uint j = 0;j < shards.size();j++)
+			shards[j]->manager->notifyLocal(Entity, Event, Argument);
+	}
+}
+
+void CLuaManager::notifyLocal(void * Entity, uint Event, void * Argument)
+{
+	EVENT_QUEUE * queue = events.Find(Entity, Event);
+	EVENT_LINK * link;
+
+	// Nothing is registered on this event
+	if(queue == NULL)
+		return;
+
+	events.Pin(queue);
+
+	// Pull the waiting threads out of the waiting state, they run with the queued threads
+	wakeWaiters(queue, queueThreads);
+
+	// Terminate the threads that end on this event, parked threads are queued so that they get cleaned up
+	for(link = queue->lists[EVENT_LIST_ENDON].next;link != &queue->lists[EVENT_LIST_ENDON];link = link->next)
+	{
+		LUA_THREAD * thr = (LUA_THREAD *)link->owner;
+
+		if(thr->terminate)
+			continue;
+
+		thr->terminate = true;
+		wakeThread(thr, queueThreads);
+	}
+
+	// Now we want to run callbacks
+	for(link = queue->lists[EVENT_LIST_NOTIFY].next;link != &queue->lists[EVENT_LIST_NOTIFY];link = link->next)
+	{
+		// callback(argument)
+		lua_State * L = CreateThread(1);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, ((EVENT_NOTIFY *)link->owner)->funcReference);
+		lua_pushlightuserdata(L, Argument);
+	}
+
+	events.Unpin(queue);
+}
+
+void CLuaManager::deleteThread(LUA_THREAD * thr)
+{
+	events.Unlink(&thr->waitLink);
+	for(int i = 0;i < ENDON_EVENT_COUNT;i++)
+		events.Unlink(&thr->endonLinks[i]);
+	sleepWheel.Remove(&thr->timer);
+	threadIds.Free(thr->id);
+
+	// Threads that finished (or never started) can be resumed with a new function, keep them for reuse
+	// Threads that errored or were terminated while suspended can't be reset
+	if(lua_status(thr->L) == 0 && threadPool.size() < THREAD_POOL_SIZE)
+	{
+		lua_settop(thr->L, 0);
+
+		// setfenv(0, ...) sticks to the thread, give it back the globals before it is reused
+		lua_pushthread(thr->L);
+		lua_pushvalue(L, LUA_GLOBALSINDEX);
+		lua_xmove(L, thr->L, 1);
+		lua_setfenv(thr->L, -2);
+		lua_pop(thr->L, 1);
+
+		threadPool.push_back(thr);
+		return;
+	}
+
+	// Let the thread be collected
+	// Registry[threadAnchors][anchor] = nil
+	lua_rawgeti(L, LUA_REGISTRYINDEX, threadAnchors);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, thr->anchor);
+	lua_pop(L, 1);
+	freeAnchors.push_back(thr->anchor);
+
+	// The lua_State lives on until it is collected
+	lua_extraspace(thr->L) = NULL;
+	delete thr;
+}
+
+void CLuaManager::deleteThreads()
+{
+	uint i;
+
+	// Grab every thread before the queues and wheel let go of them
+	getAllThreads(wokenThreads);
+	events.Clear();
+	sleepWheel.Reset(0);
+	scriptTicks = 0;
+
+	for(i = 0;i < wokenThreads.size();i++)
+		delete (LUA_THREAD *)wokenThreads[i];
+	wokenThreads.clear();
+	luaThreads.clear();
+	queueThreads.clear();
+	tempQueue.clear();
+
+	for(i = 0;i < notifyCallbacks.size();i++)
+		delete notifyCallbacks[i];
+	notifyCallbacks.clear();
+
+	for(i = 0;i < threadPool.size();i++)
+		delete threadPool[i];
+	threadPool.clear();
+	freeAnchors.clear();
+	anchorCount = 0;
+	threadIds.Reset();
+}
+
+void CLuaManager::clearThreads()
+{
+	uint i;
+
+	// Scripts could still hold on to a thread, so detach the records first
+	getAllThreads(wokenThreads);
+	wokenThreads.insert(wokenThreads.end(), threadPool.begin(), threadPool.end());
+	for(i = 0;i < wokenThreads.size();i++)
+		lua_extraspace(((LUA_THREAD *)wokenThreads[i])->L) = NULL;
+	wokenThreads.clear();
+
+	for(i = 0;i < notifyCallbacks.size();i++)
+		luaL_unref(L, LUA_REGISTRYINDEX, notifyCallbacks[i]->funcReference);
+
+	deleteThreads();
+
+	// A new anchor array lets go of the old threads
+	lua_createtable(L, THREAD_ANCHOR_COUNT, 0);
+	lua_rawseti(L, LUA_REGISTRYINDEX, threadAnchors);
+}
+
+// Events.name interns the event name and caches the interned spelling in the table
+// Atoms differ from one process to the next, so scripts only ever hold the names, which save as they are
+static int l_eventsIndex(lua_State * L)
+{
+	uint atom = atomIntern(luaL_checkstring(L, 2));
+
+	lua_pushvalue(L, 2);
+	lua_pushstring(L, atomName(atom));
+	lua_rawset(L, 1);
+
+	lua_pushstring(L, atomName(atom));
+	return 1;
+}
+
+static int l_panic(lua_State * L)
+{
+	dbgError("unprotected script error: %s", lua_tostring(L, -1));
+	return 0;
+}
+
+void CLuaManager::ResetState()
+{
+	waitSave();
+	deleteShards();
+	deleteThreads();
+	profiler.ClearNamespaces();
+	functionBindings.clear();
+	functionNames.clear();
+	
+	if(L)
+		lua_close(L);
+
+	// Nothing is left in the pools once the old state is closed
+	allocator.Reset();
+
+	// Initialize the main lua state
+	L = lua_newstate(CScriptAllocator::alloc, &allocator);
+	if(L == NULL)
+		dbgError("unable to create the script state");
+	lua_atpanic(L, l_panic);
+	lua_setlazyundump(L, g_scriptlazyload->GetBool());
+
+	// The collector only runs when CollectGarbage steps it (or the heap hits the backstop)
+	gcLiveBytes = allocator.Stats().bytes;
+	limitHeap();
+	
+	// Setup some globals
+
+	// Globals table
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	lua_setglobal(L, "_G");
+
+	// Thread anchor array, threads are kept alive by a slot in here
+	lua_createtable(L, THREAD_ANCHOR_COUNT, 0);
+	threadAnchors = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	// Resource id table
+	lua_newtable(L);
+	lua_setglobal(L, "Resources");
+
+	// Namespace tables by path
+	lua_newtable(L);
+	lua_setglobal(L, "Namespaces");
+
+	// Event atom table
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushcfunction(L, l_eventsIndex);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	lua_setglobal(L, "Events");
+
+	// Function persist vars
+	lua_newtable(L);
+	lua_setglobal(L, "AntiPersist");
+	lua_newtable(L);
+	lua_setglobal(L, "PersistRestore");
+	lua_pushnumber(L, 0);
+	lua_setglobal(L, "AntiPersistCount");
+
+	// The snapshot refs belonged to the old state
+	snapshotIds = snapshotThreads = snapshotObjects = snapshotClosures = LUA_NOREF;
+	snapshotChain = snapshotSerial = 0;
+	resetSnapshot();
+
+	// The 'level' object is a special value that means the level 'entity'
+	// Should we add this to the anti persistence table?
+	// It is a static value, and fucking with it might screw with the scripts
+	lua_pushlightuserdata(L, ENTITY_LEVEL);
+	lua_setglobal(L, "level");
+
+	// Import the namespace program
+	if(luaL_loadbuffer(L, luaNamespacePrepFunction, strlen(luaNamespacePrepFunction), "internal") != 0)
+		LUA_ERROR(L);
+	if(lua_pcall(L, 0, LUA_MULTRET, 0) != 0)
+		LUA_ERROR(L);
+
+	// Setup the c function bindings
+	setupLuaFunctions();
+
+	// Scripts find their manager through this when they aren't running on a script thread
+	lua_pushlightuserdata(L, this);
+	lua_setfield(L, LUA_REGISTRYINDEX, "CLuaManager");
+
+	outbox.clear();
+	varWrites.clear();
+	if(shardIndex < 0)
+		createShards();
+}
+
+void CLuaManager::createShards()
+{
+	int count = g_scriptshards->GetInt();
+
+	for(int i = 0;i < count;i++)
+	{
+		SCRIPT_SHARD * shard = new SCRIPT_SHARD;
+
+		shard->manager = new CLuaManager(i);
+		shard->manager->Init();
+		shard->quit = false;
+		shard->collect = false;
+		shard->worker.start(shardWorker, shard);
+		shards.push_back(shard);
+	}
+}
+
+void CLuaManager::deleteShards()
+{
+	for(uint i = 0;i < shards.size();i++)
+	{
+		shards[i]->quit = true;
+		shards[i]->start.post();
+		shards[i]->worker.join();
+
+		delete shards[i]->manager;
+		delete shards[i];
+	}
+
+	shards.clear();
+}
+
+void CLuaManager::shardWorker(void * param)
+{
+	SCRIPT_SHARD * shard = (SCRIPT_SHARD *)param;
+
+	for(;;)
+	{
+		shard->start.wait();
+		if(shard->quit)
+			break;
+
+		if(shard->collect)
+			shard->manager->collectLocal(shard->gcBudget);
+		else
+		{
+			shard->manager->ticking = true;
+			shard->manager->tickLocal(shard->delta, shard->event);
+			shard->manager->ticking = false;
+		}
+		shard->done.post();
+	}
+}
+
+static void applyVarWrite(const SCRIPT_VAR_WRITE& write)
+{
+	switch(write.kind)
+	{
+	case VAR_WRITE_STRING:
+		write.var->Set(write.text.c_str());
+		break;
+	case VAR_WRITE_DOUBLE:
+		write.var->Set(write.number);
+		break;
+	case VAR_WRITE_INT:
+		write.var->Set((int)write.number);
+		break;
+	case VAR_WRITE_RESET:
+		write.var->Reset();
+		break;
+	}
+}
+
+void CLuaManager::WriteVar(const SCRIPT_VAR_WRITE& write)
+{
+	// Shards are running (or this is one), other threads may be reading vars
+	if(ticking && (shardIndex >= 0 || shards.size()))
+		varWrites.push_back(write);
+	else
+		applyVarWrite(write);
+}
+
+void CLuaManager::routeMessages()
+{
+	std::vector<CLuaManager *> managers;
+	uint i, j, k;
+
+	managers.push_back(this);
+	for(i = 0;i < shards.size();i++)
+		managers.push_back(shards[i]->manager);
+
+	// Go through the outboxes in a fixed order, so the result doesn't depend on which worker finished first
+	for(i = 0;i < managers.size();i++)
+	{
+		std::vector<SCRIPT_MESSAGE>& messages = managers[i]->outbox;
+
+		for(j = 0;j < messages.size();j++)
+		{
+			for(k = 0;k < managers.size();k++)
+			{
+				if(k != i)
+					managers[k]->notifyLocal(messages[j].entity, messages[j].event, messages[j].argument);
+			}
+		}
+
+		messages.clear();
+	}
+
+	// Every worker is idle again, apply the var changes in the same order
+	for(i = 0;i < managers.size();i++)
+	{
+		for(j = 0;j < managers[i]->varWrites.size();j++)
+			applyVarWrite(managers[i]->varWrites[j]);
+
+		managers[i]->varWrites.clear();
+	}
+}
+
+CLuaManager * CLuaManager::shardFor(const char * name)
+{
+	const char * list, * end;
+	uint length, index = 0;
+
+	if(shards.size() == 0)
+		return this;
+
+	// Each namespace in the list goes to the next shard, in turn
+	for(list = g_scriptshardnamespaces->GetString();*list;list = *end ? end + 1 : end, index++)
+	{
+		end = strchr(list, ';');
+		if(end == NULL)
+			end = list + strlen(list);
+		length = end - list;
+
+		// Match whole path components, 'sp/ai' holds 'sp/ai/soldier.lua' but not 'sp/aim.lua'
+		if(length && _strnicmp(name, list, length) == 0 && name[length] == '/')
+			return shards[index % shards.size()]->manager;
+	}
+
+	return this;
+}
+
+void CLuaManager::stopProfiler()
+{
+	char path[0x200];
+
+	// Every shard writes its own file
+	if(shardIndex < 0)
+		strncpy(path, g_scriptprofilefile->GetString(), sizeof(path));
+	else
+		_snprintf(path, sizeof(path), "%s.shard%i", g_scriptprofilefile->GetString(), shardIndex);
+	path[sizeof(path) - 1] = 0;
+
+	profiler.Stop(path);
+}
+
+// How a saved thread was parked
+#define THREAD_SAVE_RUNNING 0
+#define THREAD_SAVE_QUEUED 1
+#define THREAD_SAVE_SLEEPING 2
+#define THREAD_SAVE_WAITING 3
+
+// Entities are light userdata, they are saved by value like pluto does
+// Event atoms are only good for this run, so they are saved by name
+static void saveEventKey(file& f, EVENT_QUEUE * queue)
+{
+	uint64 entity = (uint64)(size_t)queue->entity;
+
+	f.write((uint)entity);
+	f.write((uint)(entity >> 32));
+	string(atomName(queue->event)).save(f);
+}
+
+static void loadEventKey(file& f, void *& entity, uint& event)
+{
+	uint64 x;
+	string name;
+
+	x = f.readuint32();
+	x |= (uint64)f.readuint32() << 32;
+	entity = (void *)(size_t)x;
+
+	name.load(f);
+	event = atomIntern(name.c_str());
+}
+
+void CLuaManager::pushSaveRoot(std::vector<void *>& threads)
+{
+	uint i;
+
+	// Flush the lua state to the file
+	// We do not persist any of the C function bindings
+	// For security reasons, we do not persist any functions either
+	// This is mostly made possible by not allowing functions to be in any scope except the file
+	lua_settop(L, 0);
+
+	// The root is { globals = { everything in _G }, namespaces = { path = { ... } }, threads = { thread, ... }, callbacks = { function, ... } }
+	// _G itself is anti persisted, so whatever refers to it gets the live _G back on load
+	// The snapshot ids are the permanents, they fall back on AntiPersist
+	lua_rawgeti(L, LUA_REGISTRYINDEX, snapshotIds);
+	lua_createtable(L, 0, 4);
+
+	lua_newtable(L);
+	lua_pushnil(L);
+	while(lua_next(L, LUA_GLOBALSINDEX))
+	{
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_setfield(L, -2, "globals");
+
+	// The namespace tables are anti persisted, namespaces = { path = { everything in the namespace } }
+	lua_newtable(L);
+	lua_getglobal(L, "Namespaces");
+	lua_pushnil(L);
+	while(lua_next(L, -2))
+	{
+		lua_newtable(L);
+		lua_pushnil(L);
+		while(lua_next(L, -3))
+		{
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, -4);
+		}
+
+		lua_remove(L, -2);
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, -5);
+	}
+	lua_pop(L, 1);
+	lua_setfield(L, -2, "namespaces");
+
+	// The thread section has the records, in the same order
+	lua_rawgeti(L, LUA_REGISTRYINDEX, threadAnchors);
+	lua_createtable(L, threads.size(), 0);
+	for(i = 0;i < threads.size();i++)
+	{
+		lua_rawgeti(L, -2, ((LUA_THREAD *)threads[i])->anchor);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -3, "threads");
+	lua_pop(L, 1);
+
+	lua_createtable(L, notifyCallbacks.size(), 0);
+	for(i = 0;i < notifyCallbacks.size();i++)
+	{
+		lua_rawgeti(L, LUA_REGISTRYINDEX, notifyCallbacks[i]->funcReference);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "callbacks");
+}
+
+// A table with weak 'mode' that falls back on the table at 'index', 0 for none
+static void pushWeakTable(lua_State * L, const char * mode, int index)
+{
+	if(index < 0)
+		index = lua_gettop(L) + index + 1;
+
+	lua_newtable(L);
+	lua_createtable(L, 0, 2);
+	lua_pushstring(L, mode);
+	lua_setfield(L, -2, "__mode");
+	if(index)
+	{
+		lua_pushvalue(L, index);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+}
+
+void CLuaManager::resetSnapshot()
+{
+	luaL_unref(L, LUA_REGISTRYINDEX, snapshotIds);
+	luaL_unref(L, LUA_REGISTRYINDEX, snapshotThreads);
+	luaL_unref(L, LUA_REGISTRYINDEX, snapshotObjects);
+	luaL_unref(L, LUA_REGISTRYINDEX, snapshotClosures);
+
+	// Lookups go ids -> threads -> AntiPersist, so the ids are the whole permanents table
+	lua_getglobal(L, "AntiPersist");
+	pushWeakTable(L, "k", -1);
+	pushWeakTable(L, "k", -1);
+	snapshotIds = luaL_ref(L, LUA_REGISTRYINDEX);
+	snapshotThreads = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pop(L, 1);
+
+	lua_getglobal(L, "PersistRestore");
+	pushWeakTable(L, "v", -1);
+	snapshotObjects = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pop(L, 1);
+
+	pushWeakTable(L, "k", 0);
+	snapshotClosures = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	snapshotNextId = 1;
+
+	// Everything written until now goes into the full save
+	lua_takedirty(L);
+	lua_pop(L, 1);
+}
+
+void CLuaManager::beginSnapshot(file& f, bool delta)
+{
+	// A delta needs an earlier save to refer to
+	if(!delta || snapshotChain == 0)
+	{
+		resetSnapshot();
+		snapshotChain = ((uint)time(NULL) ^ (uint)(platformTime() * 1000000.0)) | 1;
+		snapshotSerial = 0;
+	}
+	else
+		snapshotSerial++;
+
+	f.write(snapshotChain);
+	f.write(snapshotSerial);
+}
+
+void CLuaManager::pushSnapshotDelta()
+{
+	LUA_THREAD * thr;
+	int i, j, count;
+
+	// The stack is the permanents and the root, the root gets
+	//   contents = { [key] = { t = copy of the table, mt = metatable }, ... } for the tables that were written
+	//   closures = { [key] = { fenv, upvalue 1, upvalue 2, ... }, ... } for every closure with upvalues
+
+	// Threads that ran have to be written again, as do threads closures have open upvalues on
+	// Coroutines without a record can't be told apart, so they always are
+	lua_rawgeti(L, LUA_REGISTRYINDEX, snapshotThreads);
+	lua_pushnil(L);
+	while(lua_next(L, -2))
+	{
+		lua_pop(L, 1);
+		thr = FindThread(lua_tothread(L, -1));
+		if(thr == NULL || thr->saveDirty || !lua_upvaluesclosed(L, -1))
+		{
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, -4);
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, snapshotIds);
+	lua_newtable(L);
+	count = lua_takedirty(L);
+	for(i = 1;i <= count;i++)
+	{
+		// Only tables from the earlier saves, new ones are written in full anyway
+		lua_rawgeti(L, -1, i);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, -5);
+		if(lua_isnil(L, -1))
+		{
+			lua_pop(L, 2);
+			continue;
+		}
+
+		lua_createtable(L, 0, 2);
+		lua_newtable(L);
+		lua_pushnil(L);
+		while(lua_next(L, -5))
+		{
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, -4);
+		}
+		lua_setfield(L, -2, "t");
+		if(lua_getmetatable(L, -3))
+			lua_setfield(L, -2, "mt");
+
+		lua_rawset(L, -5);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	lua_setfield(L, 2, "contents");
+	lua_pop(L, 1);
+
+	// Writes to upvalues aren't tracked, so their values are always written
+	lua_newtable(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, snapshotClosures);
+	lua_pushnil(L);
+	while(lua_next(L, -2))
+	{
+		lua_pushvalue(L, -1);
+		lua_newtable(L);
+		lua_getfenv(L, -4);
+		lua_rawseti(L, -2, 1);
+		for(j = 1;lua_getupvalue(L, -4, j);j++)
+			lua_rawseti(L, -2, j + 1);
+
+		lua_rawset(L, -6);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	lua_setfield(L, 2, "closures");
+}
+
+void CLuaManager::indexSnapshot(int refs, int count, bool saving)
+{
+	int ids, threads, objects, closures, type;
+	double key;
+
+	// Give every new table, thread and closure that was written a key
+	// Both sides count the refs the same way, so a saved object and the loaded one get the same key
+	lua_rawgeti(L, LUA_REGISTRYINDEX, snapshotIds);
+	ids = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, snapshotThreads);
+	threads = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, snapshotObjects);
+	objects = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, snapshotClosures);
+	closures = lua_gettop(L);
+
+	lua_pushnil(L);
+	while(lua_next(L, refs))
+	{
+		// Persisting maps object -> ref, unpersisting maps ref -> object
+		if(saving)
+		{
+			lua_pushvalue(L, -1);
+			lua_pushvalue(L, -3);
+		}
+		else
+		{
+			lua_pushvalue(L, -2);
+			lua_pushvalue(L, -2);
+		}
+
+		// Closures with open upvalues share them with a thread, they are written again each time
+		type = lua_type(L, -1);
+		if(type != LUA_TTABLE && type != LUA_TTHREAD && (type != LUA_TFUNCTION || !lua_upvaluesclosed(L, -1)))
+		{
+			lua_pop(L, 3);
+			continue;
+		}
+
+		// Permanents, and objects from the earlier saves
+		lua_pushvalue(L, -1);
+		lua_gettable(L, ids);
+		if(!lua_isnil(L, -1))
+		{
+			lua_pop(L, 4);
+			continue;
+		}
+		lua_pop(L, 1);
+
+		key = -(snapshotNextId + lua_tonumber(L, -2));
+
+		lua_pushvalue(L, -1);
+		lua_pushnumber(L, key);
+		lua_rawset(L, type == LUA_TTHREAD ? threads : ids);
+
+		lua_pushnumber(L, key);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, objects);
+
+		if(type == LUA_TFUNCTION && lua_getupvalue(L, -1, 1))
+		{
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushnumber(L, key);
+			lua_rawset(L, closures);
+		}
+		else if(type == LUA_TTABLE)
+			lua_setclean(L, -1);
+
+		lua_pop(L, 3);
+	}
+
+	lua_pop(L, 4);
+	snapshotNextId += count + 1;
+}
+
+void CLuaManager::endSnapshot(int count, std::vector<void *>& threads)
+{
+	uint i;
+
+	// The stack is the permanents, the root and pluto's reference table
+	indexSnapshot(3, count, true);
+	lua_settop(L, 0);
+
+	for(i = 0;i < threads.size();i++)
+		((LUA_THREAD *)threads[i])->saveDirty = false;
+}
+
+void CLuaManager::applySnapshotDelta()
+{
+	int j;
+
+	// The root is at 1, put what was written to the objects from the earlier saves back into them
+	lua_rawgeti(L, LUA_REGISTRYINDEX, snapshotObjects);
+
+	lua_getfield(L, 1, "contents");
+	lua_pushnil(L);
+	while(lua_next(L, 3))
+	{
+		// The loaded game could have collected it already, nothing can reach it then
+		lua_pushvalue(L, -2);
+		lua_rawget(L, 2);
+		if(!lua_istable(L, -1))
+		{
+			lua_pop(L, 2);
+			continue;
+		}
+
+		// Empty the table, then fill it with the saved contents
+		lua_pushnil(L);
+		while(lua_next(L, -2))
+		{
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, -4);
+		}
+
+		lua_getfield(L, -2, "t");
+		lua_pushnil(L);
+		while(lua_next(L, -2))
+		{
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, -5);
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, -2, "mt");
+		lua_setmetatable(L, -2);
+
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "closures");
+	lua_pushnil(L);
+	while(lua_next(L, 3))
+	{
+		lua_pushvalue(L, -2);
+		lua_rawget(L, 2);
+		if(!lua_isfunction(L, -1))
+		{
+			lua_pop(L, 2);
+			continue;
+		}
+
+		lua_rawgeti(L, -2, 1);
+		lua_setfenv(L, -2);
+		for(j = 1;;j++)
+		{
+			lua_rawgeti(L, -2, j + 1);
+			if(lua_setupvalue(L, -2, j) == NULL)
+			{
+				lua_pop(L, 1);
+				break;
+			}
+		}
+
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 2);
+}
+
+void CLuaManager::save(file& f, bool delta)
+{
+	CSaveWriter w(f);
+	std::vector<void *> threads;
+	int count;
+	uint i;
+
+	// The shards share the main state's vars
+	if(shardIndex < 0)
+	{
+		w.beginSection(SAVE_SECTION_VARS, false);
+		CVar::SaveAllVars(f);
+		w.endSection();
+	}
+
+	w.beginSection(SAVE_SECTION_SNAPSHOT, false);
+	beginSnapshot(f, delta);
+	w.endSection();
+
+	getAllThreads(threads);
+	pushSaveRoot(threads);
+	if(snapshotSerial)
+		pushSnapshotDelta();
+
+	w.beginSection(SAVE_SECTION_SCRIPT, true);
+	count = pluto_persistrefs(L, CSaveWriter::luaWriter, &w); // pluto.persist(snapshot ids, root)
+	w.endSection();
+
+	endSnapshot(count, threads);
+
+	w.beginSection(SAVE_SECTION_THREADS, false);
+	saveThreads(f, threads);
+	w.endSection();
+
+	for(i = 0;i < shards.size();i++)
+	{
+		w.beginSection(SAVE_SECTION_SHARD, false);
+		f.write(i);
+		shards[i]->manager->save(f, delta);
+		w.endSection();
+	}
+
+	w.finish();
+}
+
+void CLuaManager::QuickSave(file& f)
+{
+	CSaveWriter w(f);
+	std::vector<void *> threads;
+	uint i;
+
+	if(shardIndex < 0)
+	{
+		w.beginSection(SAVE_SECTION_VARS, false);
+		CVar::SaveAllVars(f);
+		w.endSection();
+	}
+
+	// The root stays on the stack, the image has the main thread's stack in it
+	// Only the thread and callback lists are needed, the globals are in the image already
+	getAllThreads(threads);
+	pushSaveRoot(threads);
+	lua_remove(L, 1);
+
+	// The registry refs the manager holds go along with the image
+	// Uncompressed, compressing would take longer than writing the image
+	w.beginSection(SAVE_SECTION_HEAP, false);
+	f.write(threadAnchors);
+	f.write(snapshotIds);
+	f.write(snapshotThreads);
+	f.write(snapshotObjects);
+	f.write(snapshotClosures);
+	f.write(snapshotChain);
+	f.write(snapshotSerial);
+	f.write(snapshotNextId);
+	f.write((uint)notifyCallbacks.size());
+	for(i = 0;i < notifyCallbacks.size();i++)
+		f.write(notifyCallbacks[i]->funcReference);
+	luaStore_save(L, CSaveWriter::luaWriter, &w);
+	w.endSection();
+
+	lua_settop(L, 0);
+
+	w.beginSection(SAVE_SECTION_THREADS, false);
+	saveThreads(f, threads);
+	w.endSection();
+
+	for(i = 0;i < shards.size();i++)
+	{
+		w.beginSection(SAVE_SECTION_SHARD, false);
+		f.write(i);
+		shards[i]->manager->QuickSave(f);
+		w.endSection();
+	}
+
+	w.finish();
+}
+
+bool CLuaManager::SaveAsync(const char * path, bool delta)
+{
+	SAVE_JOB * job;
+	uint i;
+
+	if(saveJob)
+		return false;
+
+	job = new SAVE_JOB;
+	job->path = path;
+	job->finished = false;
+	job->failed = false;
+	if(!job->vars.openMemory())
+		dbgError("unable to allocate memory for the save game");
+
+	// Only the persisting has to happen while the state is stopped
+	CVar::SaveAllVars(job->vars);
+	persistJob(job, delta);
+	for(i = 0;i < shards.size();i++)
+	{
+		job->shards.push_back(new SAVE_JOB);
+		shards[i]->manager->persistJob(job->shards[i], delta);
+	}
+
+	saveJob = job;
+	job->worker.start(saveWorker, job);
+
+	return true;
+}
+
+void CLuaManager::persistJob(SAVE_JOB * job, bool delta)
+{
+	std::vector<void *> threads;
+	int count;
+
+	if(!job->snapshot.openMemory() || !job->script.openMemory() || !job->threads.openMemory())
+		dbgError("unable to allocate memory for the save game");
+
+	beginSnapshot(job->snapshot, delta);
+
+	getAllThreads(threads);
+	pushSaveRoot(threads);
+	if(snapshotSerial)
+		pushSnapshotDelta();
+	count = pluto_persistrefs(L, luaFileWriter, &job->script);
+	endSnapshot(count, threads);
+
+	saveThreads(job->threads, threads);
+}
+
+void CLuaManager::writeJob(file& f, SAVE_JOB * job)
+{
+	CSaveWriter w(f);
+	uint i;
+
+	// Only the main state's job has the vars
+	if(job->vars.memoryData())
+	{
+		w.beginSection(SAVE_SECTION_VARS, false);
+		w.write(job->vars.memoryData(), job->vars.size());
+		w.endSection();
+	}
+
+	w.beginSection(SAVE_SECTION_SNAPSHOT, false);
+	w.write(job->snapshot.memoryData(), job->snapshot.size());
+	w.endSection();
+
+	w.beginSection(SAVE_SECTION_SCRIPT, true);
+	w.write(job->script.memoryData(), job->script.size());
+	w.endSection();
 
-	// Make sure that the thread can't get garbage collected
-	// _G.ThreadList[L] = L
-	lua_getglobal(thr.L, "ThreadList");
-	lua_pushthread(thr.L);
-	lua_pushthread(thr.L);
-	lua_settable(thr.L, -3);
-
-	// Remember the ID
-	// _G.ThreadIDs[L] = thr.id
-	lua_getglobal(thr.L, "ThreadIDs");
-	lua_pushthread(thr.L);
-	lua_pushlightuserdata(thr.L, thr.id);
-	lua_settable(thr.L, -3);
+	w.beginSection(SAVE_SECTION_THREADS, false);
+	w.write(job->threads.memoryData(), job->threads.size());
+	w.endSection();
 
-	queueThreads.push_back(thr);
-	return thr.L;
+	for(i = 0;i < job->shards.size();i++)
+	{
+		w.beginSection(SAVE_SECTION_SHARD, false);
+		f.write(i);
+		writeJob(f, job->shards[i]);
+		w.endSection();
+	}
+
+	w.finish();
 }
 
-int CLuaManager::FindThread(lua_State * L, std::vector<LUA_THREAD> ** v)
+void CLuaManager::saveWorker(void * param)
 {
-	for(uint i = 0;i < luaThreads.size();i++)
+	SAVE_JOB * job = (SAVE_JOB *)param;
+	file out, f;
+	bool written;
+
+	// The save is put together in memory, so writing it out is one write that can fail without stopping the game
+	// Whether it did is left for Tick to report on the main thread
+	written = out.openMemory();
+	if(written)
 	{
-		if(luaThreads[i].L == L)
-		{
-			*v = &luaThreads;
-			return i;
-		}
+		writeJob(out, job);
+		written = f.openWrite(job->path.c_str()) && f.tryWrite(out.memoryData(), out.size());
+		written = f.close() && written;
 	}
 
-	for(uint i = 0;i < tempQueue.size();i++)
-	{
-		if(tempQueue[i].L == L)
-		{
-			*v = &tempQueue;
-			return i;
-		}
-	}
+	job->state.enter();
+	job->failed = !written;
+	job->finished = true;
+	job->state.leave();
+}
 
-	*v = NULL;
-	return -1;
+void CLuaManager::waitSave()
+{
+	if(saveJob == NULL)
+		return;
+
+	saveJob->worker.join();
+	for(uint i = 0;i < saveJob->shards.size();i++)
+		delete saveJob->shards[i];
+	delete saveJob;
+	saveJob = NULL;
 }
 
-void CLuaManager::Notify(void * Entity, const char * Event, void * Argument)
+void CLuaManager::saveThreads(file& f, std::vector<void *>& threads)
 {
-	int j;
-	std::vector<LUA_THREAD>::iterator i;
-	for(i = luaThreads.begin();i != luaThreads.end();i++)
+	uint i, j, count;
+
+	f.write(scriptTicks);
+	f.write((double)sleepWheel.Now());
+
+	// The id allocator comes first, so ids handed out after a load don't clash with saved ones
+	threadIds.save(f);
+
+	f.write((uint)threads.size());
+	for(i = 0;i < threads.size();i++)
 	{
-		if(i->waitEvent.entity == Entity && _stricmp(i->waitEvent.event, Event) == 0)
+		LUA_THREAD * thr = (LUA_THREAD *)threads[i];
+
+		f.write((uint)thr->id);
+		f.write((uint)(thr->id >> 32));
+		f.write(thr->nargs);
+		f.write((uint8)thr->firstRun);
+		f.write((uint8)thr->terminate);
+
+		// getAllThreads lists the run list first, then the queues, then the parked threads
+		if(CTimerWheel::IsParked(&thr->timer))
 		{
-			// We have a hit, pull the thread out of the waiting state
-			i->waitEvent.entity = NULL;
-			memset(i->waitEvent.event, 0, ENTITY_EVENT_NAME_LENGTH);
+			f.write((uint8)THREAD_SAVE_SLEEPING);
+			f.write((double)thr->timer.expire);
 		}
-
-		for(j = 0;j < ENDON_EVENT_COUNT;j++)
+		else if(CEventIndex::IsLinked(&thr->waitLink))
 		{
-			if(i->endonEvents[j].entity)
-			{
-				if(i->endonEvents[j].entity == Entity && _stricmp(i->endonEvents[j].event, Event) == 0)
-				{
-					i->terminate = true;
-					break;
-				}
-			}
-			else
-				break;
+			f.write((uint8)THREAD_SAVE_WAITING);
+			saveEventKey(f, thr->waitLink.queue);
 		}
-	}
+		else if(i < luaThreads.size())
+			f.write((uint8)THREAD_SAVE_RUNNING);
+		else
+			f.write((uint8)THREAD_SAVE_QUEUED);
 
-	for(i = queueThreads.begin();i != queueThreads.end();i++)
-	{
-		if(i->waitEvent.entity == Entity && _stricmp(i->waitEvent.event, Event) == 0)
+		for(count = 0, j = 0;j < ENDON_EVENT_COUNT;j++)
 		{
-			// We have a hit, pull the thread out of the waiting state
-			i->waitEvent.entity = NULL;
-			memset(i->waitEvent.event, 0, ENTITY_EVENT_NAME_LENGTH);
+			if(CEventIndex::IsLinked(&thr->endonLinks[j]))
+				count++;
 		}
 
+		f.write((uint8)count);
 		for(j = 0;j < ENDON_EVENT_COUNT;j++)
 		{
-			if(i->endonEvents[j].entity)
-			{
-				if(i->endonEvents[j].entity == Entity && _stricmp(i->endonEvents[j].event, Event) == 0)
-				{
-					i->terminate = true;
-					break;
-				}
-			}
-			else
-				break;
+			if(CEventIndex::IsLinked(&thr->endonLinks[j]))
+				saveEventKey(f, thr->endonLinks[j].queue);
 		}
 	}
 
-	// Now we want to run callbacks
-	for(j = 0;j < ONNOTIFY_EVENT_COUNT;j++)
+	f.write((uint)notifyCallbacks.size());
+	for(i = 0;i < notifyCallbacks.size();i++)
+		saveEventKey(f, notifyCallbacks[i]->link.queue);
+}
+
+void CLuaManager::load(file& f)
+{
+	CSaveReader r(f);
+	uint section, chain, serial, shard, shardCount = 0;
+	bool snapshot = false;
+	int count;
+
+	// The file could be the one that is still being written
+	waitSave();
+
+	if(!r.open())
+		dbgError("not a save game, or from a version that can't be loaded");
+
+	lua_settop(L, 0);
+
+	while((section = r.nextSection()) != SAVE_SECTION_END)
 	{
-		if(onnotify[j].evt.entity)
+		switch(section)
 		{
-			if(onnotify[j].evt.entity == Entity && _stricmp(onnotify[j].evt.event, Event) == 0)
+		case SAVE_SECTION_VARS:
+			CVar::LoadAllVars(f);
+			break;
+
+		case SAVE_SECTION_SNAPSHOT:
+			chain = f.readuint32();
+			serial = f.readuint32();
+			if(serial == 0)
 			{
-				// callback(argument)
-				lua_State * L = CreateThread(1);
-				lua_rawgeti(L, LUA_REGISTRYINDEX, onnotify[j].funcReference);
-				lua_pushlightuserdata(L, Argument);
+				resetSnapshot();
+				snapshotChain = chain;
 			}
-		}
-		else
+			else if(chain != snapshotChain || serial != snapshotSerial + 1)
+				dbgError("save game is a delta that doesn't follow the loaded game");
+			snapshotSerial = serial;
+			snapshot = true;
 			break;
-	}
-}
 
-void CLuaManager::ResetState()
-{
-	luaThreads.clear();
-	queueThreads.clear();
-	tempQueue.clear();
-	functionBindings.clear();
-	functionNames.clear();
-	
-	if(L)
-		lua_close(L);
+		case SAVE_SECTION_SCRIPT:
+			// Saves from before snapshots are full saves
+			if(!snapshot)
+			{
+				resetSnapshot();
+				snapshotChain = snapshotSerial = 0;
+			}
 
-	memset(onnotify, 0, sizeof(onnotify));
+			// The save has its own threads
+			clearThreads();
 
-	// Initialize the main lua state
-	L = luaL_newstate();
-	
-	// Setup some globals
+			// The root object is unpersisted as the section is inflated
+			// Objects from the earlier saves in the chain come from the snapshot, its __index is PersistRestore
+			lua_settop(L, 0);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, snapshotObjects);
+			count = pluto_unpersistrefs(L, CSaveReader::luaReader, &r); // pluto.unpersist(snapshot objects, data)
 
-	// Globals table
-	lua_pushvalue(L, LUA_GLOBALSINDEX);
-	lua_setglobal(L, "_G");
+			// pluto restarts the collector, it should only run from CollectGarbage
+			limitHeap();
 
-	// Thread list table
-	lua_newtable(L);
-	lua_setglobal(L, "ThreadList");
+			indexSnapshot(3, count, false);
+			lua_pop(L, 1);
+			lua_remove(L, 1);
 
-	// Thread id table
-	lua_newtable(L);
-	lua_setglobal(L, "ThreadIDs");
+			if(snapshotSerial)
+				applySnapshotDelta();
 
-	// Function persist vars
-	lua_newtable(L);
-	lua_setglobal(L, "AntiPersist");
-	lua_newtable(L);
-	lua_setglobal(L, "PersistRestore");
-	lua_pushnumber(L, 0);
-	lua_setglobal(L, "AntiPersistCount");
+			// Merge the saved globals into _G, the namespace tables in it are the live ones
+			lua_getfield(L, 1, "globals");
+			lua_pushnil(L);
+			while(lua_next(L, -2))
+			{
+				lua_pushvalue(L, -2);
+				lua_insert(L, -2);
+				lua_rawset(L, LUA_GLOBALSINDEX);
+			}
+			lua_pop(L, 1);
 
-	// The 'level' object is a special value that means the level 'entity'
-	// Should we add this to the anti persistence table?
-	// It is a static value, and fucking with it might screw with the scripts
-	lua_pushlightuserdata(L, ENTITY_LEVEL);
-	lua_setglobal(L, "level");
+			// Copy the saved namespaces into the live tables, the script functions still have them as their environments
+			lua_getfield(L, 1, "namespaces");
+			if(lua_istable(L, -1))
+			{
+				lua_getglobal(L, "Namespaces");
+				lua_pushnil(L);
+				while(lua_next(L, -3))
+				{
+					lua_pushvalue(L, -2);
+					lua_rawget(L, -4);
+					if(!lua_istable(L, -1))
+					{
+						lua_pop(L, 2);
+						continue;
+					}
+
+					// Empty the table, then fill it with the saved contents
+					lua_pushnil(L);
+					while(lua_next(L, -2))
+					{
+						lua_pop(L, 1);
+						lua_pushvalue(L, -1);
+						lua_pushnil(L);
+						lua_rawset(L, -4);
+					}
+
+					lua_pushnil(L);
+					while(lua_next(L, -3))
+					{
+						lua_pushvalue(L, -2);
+						lua_insert(L, -2);
+						lua_rawset(L, -4);
+					}
+
+					lua_pop(L, 2);
+				}
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
 
-	// Import the namespace program
-	if(luaL_loadbuffer(L, luaNamespacePrepFunction, strlen(luaNamespacePrepFunction), "internal") != 0)
-		LUA_ERROR(L);
-	if(lua_pcall(L, 0, LUA_MULTRET, 0) != 0)
-		LUA_ERROR(L);
+			// Loading wrote to the tables, they match the save again
+			lua_takedirty(L);
+			lua_pop(L, 1);
+			break;
 
-	// Setup the c function bindings
-	setupLuaFunctions();
-}
+		case SAVE_SECTION_HEAP:
+			loadHeap(f, r);
+			break;
 
-void CLuaManager::save(file& f)
-{
-	// Save the entire script state to disk
-	// Consider having some sort of field on the thread objects so we know what thread is what
+		case SAVE_SECTION_THREADS:
+			if(lua_gettop(L) != 1)
+				dbgError("save game has threads but no scripts");
+			loadThreads(f);
+			break;
+
+		case SAVE_SECTION_SHARD:
+			shard = f.readuint32();
+			if(shard >= shards.size())
+				dbgError("save game has shard %u, the state only has %u", shard, (uint)shards.size());
+			shards[shard]->manager->load(f);
+			shardCount++;
+			break;
+
+		default:
+			// Sections from later versions are skipped
+			break;
+		}
+	}
+
+	if(shardCount != shards.size())
+		dbgError("save game has %u shards, the state has %u", shardCount, (uint)shards.size());
 
-	// Flush the lua state to the file
-	// We do not persist any of the C function bindings
-	// For security reasons, we do not persist any functions either
-	// This is mostly made possible by not allowing functions to be in any scope except the file
 	lua_settop(L, 0);
+}
 
-	lua_getglobal(L, "AntiPersist");
-	lua_pushvalue(L, LUA_GLOBALSINDEX);
+void CLuaManager::loadHeap(file& f, CSaveReader& r)
+{
+	std::vector<int> callbacks;
+	uint i;
+
+	threadAnchors = f.readint32();
+	snapshotIds = f.readint32();
+	snapshotThreads = f.readint32();
+	snapshotObjects = f.readint32();
+	snapshotClosures = f.readint32();
+	snapshotChain = f.readuint32();
+	snapshotSerial = f.readuint32();
+	snapshotNextId = f.readdouble();
+	callbacks.resize(f.readuint32());
+	for(i = 0;i < callbacks.size();i++)
+		callbacks[i] = f.readint32();
+
+	// The image is the whole state, the old one goes along with the records of its threads
+	deleteThreads();
+	lua_close(L);
+	allocator.Reset();
+
+	L = luaStore_load(CSaveReader::luaReader, &r, CScriptAllocator::alloc, &allocator);
+	lua_atpanic(L, l_panic);
+	gcLiveBytes = allocator.Stats().bytes;
+	limitHeap();
+	lua_setlazyundump(L, g_scriptlazyload->GetBool());
+
+	lua_pushlightuserdata(L, this);
+	lua_setfield(L, LUA_REGISTRYINDEX, "CLuaManager");
+
+	// The thread section gives the threads and callbacks new records, anchors and refs
+	lua_createtable(L, THREAD_ANCHOR_COUNT, 0);
+	lua_rawseti(L, LUA_REGISTRYINDEX, threadAnchors);
+	for(i = 0;i < callbacks.size();i++)
+		luaL_unref(L, LUA_REGISTRYINDEX, callbacks[i]);
+
+	// The namespace tables moved with the state, name them for the profiler again
+	profiler.ClearNamespaces();
+	lua_getglobal(L, "Namespaces");
+	lua_pushnil(L);
+	while(lua_next(L, -2))
+	{
+		profiler.AddNamespace(lua_topointer(L, -1), lua_tostring(L, -2));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
 
-	pluto_persist(L, luaFileWriter, &f); // pluto.persist(t, _G)
+	// The root was on the stack when the image was taken
+	if(lua_gettop(L) != 1 || !lua_istable(L, 1))
+		dbgError("quick save has no root");
 }
 
-void CLuaManager::load(file& f)
+void CLuaManager::loadThreads(file& f)
 {
+	LUA_THREAD * thr;
+	void * entity;
+	uint i, j, count, endons, event;
+
+	scriptTicks = f.readdouble();
+	sleepWheel.Reset((uint64)f.readdouble());
+	threadIds.load(f);
+
+	// The threads are in the root's thread list, in the same order as their records
+	lua_getfield(L, 1, "threads");
+	count = f.readuint32();
+	for(i = 0;i < count;i++)
+	{
+		lua_rawgeti(L, -1, i + 1);
+		if(!lua_isthread(L, -1))
+			dbgError("save game is missing thread %u", i);
+
+		thr = adoptThread();
+		thr->id = f.readuint32();
+		thr->id |= (uint64)f.readuint32() << 32;
+		thr->nargs = f.readint32();
+		thr->firstRun = f.readuint8() != 0;
+		thr->terminate = f.readuint8() != 0;
+
+		switch(f.readuint8())
+		{
+		case THREAD_SAVE_RUNNING:
+			luaThreads.push_back(thr);
+			break;
+		case THREAD_SAVE_QUEUED:
+			queueThreads.push_back(thr);
+			break;
+		case THREAD_SAVE_SLEEPING:
+			sleepWheel.Insert(&thr->timer, (uint64)f.readdouble());
+			break;
+		case THREAD_SAVE_WAITING:
+			loadEventKey(f, entity, event);
+			WaitTill(thr, entity, event);
+			break;
+		default:
+			dbgError("save game has a bad thread state");
+		}
+
+		endons = f.readuint8();
+		for(j = 0;j < endons;j++)
+		{
+			loadEventKey(f, entity, event);
+			EndOn(thr, entity, event);
+		}
+	}
+	lua_pop(L, 1);
 
+	lua_getfield(L, 1, "callbacks");
+	count = f.readuint32();
+	for(i = 0;i < count;i++)
+	{
+		lua_rawgeti(L, -1, i + 1);
+		loadEventKey(f, entity, event);
+		OnNotify(entity, event, luaL_ref(L, LUA_REGISTRYINDEX));
+	}
+	lua_pop(L, 1);
 }
 
 void CLuaManager::addLuaFunction(lua_CFunction func, const char * name)
@@ -779,7 +2519,7 @@ static int l_createThread(lua_State * L)
 {
 	int i, nargs;
 	lua_State * thread;
-	CLuaManager * l = CLuaManager::singleton;
+	CLuaManager * l = CLuaManager::FromState(L);
 	if(lua_gettop(L) < 2)
 		dbgError("createThread called with %i arguments, expected at least 2");
 	
@@ -803,20 +2543,25 @@ static int l_createThread(lua_State * L)
 	return 0;
 }
 
+// Get the record of the running script thread
+static LUA_THREAD * checkThread(lua_State * L, const char * func)
+{
+	LUA_THREAD * thr = CLuaManager::FromState(L)->FindThread(L);
+
+	if(thr == NULL)
+		dbgError("%s can only be called from a script thread", func);
+
+	return thr;
+}
+
 // Delay the current thread
 // wait (seconds)
 static int l_wait(lua_State * L)
 {
-	CLuaManager * l = CLuaManager::singleton;
-	std::vector<LUA_THREAD>::iterator i;
-	std::vector<LUA_THREAD> * v;
-	int index;
-
 	if(lua_gettop(L) != 1)
 		dbgError("wait called with %i arguments, expected 0", lua_gettop(L));
 
-	index = l->FindThread(L, &v);
-	v->at(index).waittime = luaL_checknumber(L, 1);
+	checkThread(L, "wait")->waittime = luaL_checknumber(L, 1);
 
 	// Wait causes the coroutine to yield
 	return lua_yield(L, 0);
@@ -829,100 +2574,61 @@ static int l_yield(lua_State * L)
 	return lua_yield(L, 0);
 }
 
+// Event arguments are event names, the atom is looked up here
+// Numbers are names like any other, waittill(ent, 3) waits on the event "3"
+static uint checkEvent(lua_State * L, int narg)
+{
+	return atomIntern(luaL_checkstring(L, narg));
+}
+
 // Delay the current thread until an event is triggered
-// waittill(entity, eventName)
+// waittill(entity, event)
 static int l_waittill(lua_State * L)
 {
-	CLuaManager * l = CLuaManager::singleton;
-	std::vector<LUA_THREAD> * v;
-	int i = l->FindThread(L, &v);
-	const char * c = luaL_checkstring(L, 2);
+	CLuaManager * l = CLuaManager::FromState(L);
 
 	// Set the wait event
-	v->at(i).waitEvent.entity = lua_touserdata(L, 1);
-	if(c)
-	{
-		if(strlen(c) >= ENTITY_EVENT_NAME_LENGTH)
-			dbgError("event name '%s' is too long, max length is %i characters", c, ENTITY_EVENT_NAME_LENGTH - 1);
-		else
-			strcpy(v->at(i).waitEvent.event, c);
-	}
+	l->WaitTill(checkThread(L, "waittill"), lua_touserdata(L, 1), checkEvent(L, 2));
 
 	// This waits, so yield
 	return lua_yield(L, 0);
 }
 
 // Mark this function to end on this event
-// endon(entity, eventName)
+// endon(entity, event)
 static int l_endon(lua_State * L)
 {
-	CLuaManager * l = CLuaManager::singleton;
-	std::vector<LUA_THREAD> * v;
-	bool foundEvent = false;
-	int i = l->FindThread(L, &v), j;
-	const char * c = luaL_checkstring(L, 2);
-
-	// Find an open event
-	for(j = 0;j < ENDON_EVENT_COUNT;j++)
-	{
-		if(v->at(i).endonEvents[j].entity)
-			continue;
-
-		foundEvent = true;
-		v->at(i).endonEvents[j].entity = lua_touserdata(L, 1);
-		if(c)
-		{
-			if(strlen(c) >= ENTITY_EVENT_NAME_LENGTH)
-				dbgError("event name '%s' is too long, max length is %i characters", c, ENTITY_EVENT_NAME_LENGTH - 1);
-			else
-				strcpy(v->at(i).endonEvents[j].event, c);
-		}
+	CLuaManager * l = CLuaManager::FromState(L);
 
-		break;
-	}
+	l->EndOn(checkThread(L, "endon"), lua_touserdata(L, 1), checkEvent(L, 2));
 
 	return 0;
 }
 
 // Create a callback
-// onnotify(entity, eventName, callbackFunction)
+// onnotify(entity, event, callbackFunction)
 static int l_onnotify(lua_State * L)
 {
-	CLuaManager * l = CLuaManager::singleton;
+	CLuaManager * l = CLuaManager::FromState(L);
 	void * entity = lua_touserdata(L, 1);
-	const char * eventName = luaL_checkstring(L, 2);
-	int callbackFunction, i;
+	uint event = checkEvent(L, 2);
+	int callbackFunction;
 
 	lua_pushvalue(L, 3);
 	callbackFunction = luaL_ref(L, LUA_REGISTRYINDEX);
 
-	// Find an empty slot
-	for(i = 0;i < ONNOTIFY_EVENT_COUNT;i++)
-	{
-		if(l->onnotify[i].evt.entity)
-			continue;
-
-		l->onnotify[i].evt.entity = entity;
-		l->onnotify[i].funcReference = callbackFunction;
-
-		if(strlen(eventName) >= ENTITY_EVENT_NAME_LENGTH)
-			dbgError("event name '%s' is too long, max length is %i characters", eventName, ENTITY_EVENT_NAME_LENGTH - 1);
-		else
-			strcpy(l->onnotify[i].evt.event, eventName);
-
-		break;
-	}
+	l->OnNotify(entity, event, callbackFunction);
 
 	return 0;
 }
 
 // Trigger an event
-// notify(entity, eventName)
+// notify(entity, event)
 static int l_notify(lua_State * L)
 {
-	CLuaManager * l = CLuaManager::singleton;
+	CLuaManager * l = CLuaManager::FromState(L);
 	void * waitEntity = lua_touserdata(L, 1);
-	const char * waitEvent = luaL_checkstring(L, 2);
+	uint waitEvent = checkEvent(L, 2);
 	void * argument;
 	
 	// optional argument
@@ -938,11 +2644,35 @@ static int l_notify(lua_State * L)
 
 // Var stuff
 
+// Var changes go through the manager, see CLuaManager::WriteVar
+static void queueVarWrite(lua_State * L, CVar * var, int kind, const char * text, double number)
+{
+	SCRIPT_VAR_WRITE write;
+
+	write.var = var;
+	write.kind = kind;
+	// Always set, an empty string can't be copied into the list
+	write.text = text ? text : "";
+	write.number = number;
+
+	CLuaManager::FromState(L)->WriteVar(write);
+}
+
+static void writeVar(lua_State * L, int kind, const char * text, double number)
+{
+	CVar * var = CVar::Find(luaL_checkstring(L, 1));
+
+	// Errors before the write is built, it has a string that a longjmp would leak
+	if(var == NULL)
+		luaL_error(L, "unknown var %s", lua_tostring(L, 1));
+
+	queueVarWrite(L, var, kind, text, number);
+}
+
 // varSetString(varName, varValue)
 static int l_varSetString(lua_State * L)
 {
-	CVar * var = CVar::Find(luaL_checkstring(L, 1));
-	var->Set(luaL_checkstring(L, 2));
+	writeVar(L, VAR_WRITE_STRING, luaL_checkstring(L, 2), 0);
 
 	return 0;
 }
@@ -950,8 +2680,7 @@ static int l_varSetString(lua_State * L)
 // varSetDouble(varName, varValue)
 static int l_varSetDouble(lua_State * L)
 {
-	CVar * var = CVar::Find(luaL_checkstring(L, 1));
-	var->Set(luaL_checknumber(L, 2));
+	writeVar(L, VAR_WRITE_DOUBLE, NULL, luaL_checknumber(L, 2));
 	
 	return 0;
 }
@@ -959,8 +2688,7 @@ static int l_varSetDouble(lua_State * L)
 // varSetInt(varName, varValue)
 static int l_varSetInt(lua_State * L)
 {
-	CVar * var = CVar::Find(luaL_checkstring(L, 1));
-	var->Set((int)luaL_checknumber(L, 2));
+	writeVar(L, VAR_WRITE_INT, NULL, luaL_checknumber(L, 2));
 
 	return 0;
 }
@@ -970,8 +2698,7 @@ static int l_varSetBool(lua_State * L)
 {
 	luaL_checkany(L, 2);
 
-	CVar * var = CVar::Find(luaL_checkstring(L, 1));
-	var->Set(lua_toboolean(L, 2) ? "true" : "false");
+	writeVar(L, VAR_WRITE_STRING, lua_toboolean(L, 2) ? "true" : "false", 0);
 
 	return 0;
 }
@@ -996,8 +2723,7 @@ static int l_varSet(lua_State * L)
 // varReset(varName)
 static int l_varReset(lua_State * L)
 {
-	CVar * var = CVar::Find(luaL_checkstring(L, 1));
-	var->Reset();
+	writeVar(L, VAR_WRITE_RESET, NULL, 0);
 
 	return 0;
 }
@@ -1055,13 +2781,23 @@ static int l_varGetBool(lua_State * L)
 }
 
 // Testing
-// test(modelName, x, y, z)
+// test(modelName or resource id, x, y, z)
 static int l_test(lua_State * L)
 {
 	const char * modelName;
+	sectionitem_t * item;
 	double x, y, z;
 
-	modelName = luaL_checkstring(L, 1);
+	if(lua_type(L, 1) == LUA_TNUMBER)
+	{
+		item = GameApplication::singleton->maploader.FindItem((uint)lua_tonumber(L, 1));
+		if(item == NULL)
+			return luaL_error(L, "unknown resource id");
+
+		modelName = item->name;
+	}
+	else
+		modelName = luaL_checkstring(L, 1);
 	x = luaL_checknumber(L, 2);
 	y = luaL_checknumber(L, 3);
 	z = luaL_checknumber(L, 4);
@@ -1205,136 +2941,133 @@ void CLuaManager::setupLuaFunctions()
 	addLuaFunction(l_next, "next");
 	addLuaFunction(l_scripttotable, "scripttotable");
 
-	// Gorilla
-	RegisterGorilla(_addLuaFunction, L);
+	// Gorilla, the GUI belongs to the main thread so shards don't get it
+	if(shardIndex < 0)
+		RegisterGorilla(_addLuaFunction, L);
 }
 
-void * CLuaManager::getNewThreadId()
+void CLuaManager::getAllThreads(std::vector<void *>& threads)
 {
-	int id = 1;
-	void * vid;
-	uint i;
+	threads.insert(threads.end(), luaThreads.begin(), luaThreads.end());
+	threads.insert(threads.end(), queueThreads.begin(), queueThreads.end());
+	threads.insert(threads.end(), tempQueue.begin(), tempQueue.end());
 
-	for(;;)
-	{
-		if(id == -1)
-			dbgError("no unique thread ids left");
+	// Parked threads are only reachable through the wheel and the event queues
+	sleepWheel.GetAll(threads);
+	events.GetAll(EVENT_LIST_WAIT, threads);
+}
 
-		vid = (void *)id;
+// Count hook for script threads
+// Takes profiler samples, and yields a thread that is still running past the tick's budget
+static void scriptHook(lua_State * L, lua_Debug * ar)
+{
+	LUA_THREAD * thr = (LUA_THREAD *)lua_extraspace(L);
+	double now;
 
-		for(i = 0;i < luaThreads.size();i++)
-		{
-			if(luaThreads[i].id == vid)
-			{
-				id++;
-				continue;
-			}
-		}
+	if(thr == NULL)
+		return;
 
-		for(i = 0;i < queueThreads.size();i++)
-		{
-			if(queueThreads[i].id == vid)
-			{
-				id++;
-				continue;
-			}
-		}
+	now = platformTime();
+	if(thr->owner->profiler.IsRunning())
+	{
+		thr->owner->profiler.Sample(L, now - thr->sampleTime);
+		thr->sampleTime = now;
+	}
 
-		for(i = 0;i < tempQueue.size();i++)
-		{
-			if(tempQueue[i].id == vid)
-			{
-				id++;
-				continue;
-			}
-		}
+	if(thr->deadline == 0 || now < thr->deadline)
+		return;
 
-		break;
-	}
+	// Yielding from inside a C call (pcall, a metamethod) would raise an error, try again on the next count
+	if(!lua_isyieldable(L))
+		return;
 
-	return vid;
+	thr->sliced = true;
+	lua_yield(L, 0);
 }
 
-std::vector<LUA_THREAD>::iterator CLuaManager::tickThread(std::vector<LUA_THREAD>::iterator i, std::vector<LUA_THREAD> * v, double delta, const char * Event)
+std::vector<LUA_THREAD *>::iterator CLuaManager::tickThread(std::vector<LUA_THREAD *>::iterator i, std::vector<LUA_THREAD *> * v)
 {
-	if(Event)
+	LUA_THREAD * thr = *i;
+
+	// Resume the coroutine
+	int r = 0;
+	if(!thr->terminate && (thr->firstRun || (lua_status(thr->L) == LUA_YIELD)))
 	{
-		// Only run coroutines that are waiting on this event
-		if(i->waitEvent.entity && _stricmp(i->waitEvent.event, Event) == 0)
+		thr->deadline = tickDeadline;
+		if(sampleInstructions)
 		{
-			i->waitEvent.entity = NULL;
+			thr->sampleTime = platformTime();
+			lua_sethook(thr->L, scriptHook, LUA_MASKCOUNT, tickDeadline && sliceInstructions < sampleInstructions ? sliceInstructions : sampleInstructions);
 		}
+		else if(tickDeadline)
+			lua_sethook(thr->L, scriptHook, LUA_MASKCOUNT, sliceInstructions);
 		else
-		{
-			// Skip
-			i++;
-			return i;
-		}
-	}
+			lua_sethook(thr->L, NULL, 0, 0);
 
-	// Allow coroutines to sleep
-	if(i->waittime > 0)
+		r = lua_resume(thr->L, thr->firstRun ? thr->nargs : 0);
+		thr->firstRun = false;
+		thr->saveDirty = true;
+	}
+	
+	// Check to see if execution has halted
+	if(r == LUA_YIELD)
 	{
-		i->waittime -= delta;
-			
-		// If the time has not elapsed yet, skip over this coroutine
-		if(i->waittime > 0)
+		if(thr->terminate)
 		{
+			// It ended itself while running, leave it to be cleaned up on the next tick
+			events.Unlink(&thr->waitLink);
 			i++;
-			return i;
 		}
-	}
+		else if(thr->sliced)
+		{
+			// Went over the budget, it carries on where it left off next tick
+			thr->sliced = false;
+			budgetYields++;
 
-	// Allow coroutines to wait on an event
-	if(i->waitEvent.entity)
-	{
-		i++;
-		return i;
-	}
+			if(!thr->overBudget)
+			{
+				lua_Debug ar;
 
-	// Resume the coroutine
-	int r = 0;
-	if(!i->terminate && (i->firstRun || (lua_status(i->L) == LUA_YIELD)))
-	{
-		r = lua_resume(i->L, i->firstRun ? i->nargs : 0);
-		i->firstRun = false;
+				thr->overBudget = true;
+				if(lua_getstack(thr->L, 0, &ar) && lua_getinfo(thr->L, "Sl", &ar))
+					dbgOut("script thread %u went over the %gms tick budget at %s:%i", (uint)thr->id, g_scriptbudget->GetDouble(), ar.short_src, ar.currentline);
+				else
+					dbgOut("script thread %u went over the %gms tick budget", (uint)thr->id, g_scriptbudget->GetDouble());
+			}
+
+			i++;
+		}
+		else if(CEventIndex::IsLinked(&thr->waitLink))
+		{
+			// Park the thread on its event until it is notified
+			i = v->erase(i);
+		}
+		else if(thr->waittime > 0)
+		{
+			// Park the thread in the sleep wheel until its time is up, always at least one tick
+			uint64 ticks = (uint64)(thr->waittime * TICKS_PER_SECOND + 0.999);
+			sleepWheel.Insert(&thr->timer, sleepWheel.Now() + (ticks ? ticks : 1));
+			i = v->erase(i);
+		}
+		else
+			i++;
 	}
-	
-	// Check to see if execution has halted
-	if(r == LUA_YIELD)
-		i++;
 	else if(r == 0)
 	{
-		// _G.ThreadList[L] = nil
-		lua_getglobal(i->L, "ThreadList");
-		lua_pushthread(i->L);
-		lua_pushnil(i->L);
-		lua_settable(i->L, -3);
-
-		// _G.ThreadIDs[L] = nil
-		lua_getglobal(i->L, "ThreadIDs");
-		lua_pushthread(i->L);
-		lua_pushnil(i->L);
-		lua_settable(i->L, -3);
-
 		i = v->erase(i);
+		deleteThread(thr);
 	}
 	else
 	{
 		// Uh oh, error!
 
 		// Only complain if the coroutine wasn't just scheduled for termination
-		if(!i->terminate)
-			LUA_ERROR(i->L);
-
-		// _G.ThreadList[L] = nil
-		lua_getglobal(i->L, "ThreadList");
-		lua_pushthread(i->L);
-		lua_pushnil(i->L);
-		lua_settable(i->L, -3);
-		
+		if(!thr->terminate)
+			LUA_ERROR(thr->L);
+
 		i = v->erase(i);
+		deleteThread(thr);
 	}
 
 	return i;
-}
\ No newline at end of file
+}
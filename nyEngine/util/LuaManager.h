@@ -3,23 +3,28 @@
 
 #include "..\lua\lua.hpp"
 #include <vector>
+#include "TimerWheel.h"
+#include "EventIndex.h"
+#include "IdAllocator.h"
+#include "ScriptProfiler.h"
+#include "ScriptAlloc.h"
+#include "SaveGame.h"
 
 // A special entity value, this represents the level object
 #define ENTITY_LEVEL ((void*)(-1))
 
-#define ONNOTIFY_EVENT_COUNT 16
 #define ENDON_EVENT_COUNT 16
-#define ENTITY_EVENT_NAME_LENGTH 32
-
-typedef struct _ENTITY_EVENT
-{
-	char event[ENTITY_EVENT_NAME_LENGTH];
-	void * entity;
-} ENTITY_EVENT;
+// Registry slots that are preallocated for anchoring threads
+#define THREAD_ANCHOR_COUNT 256
+// How many finished threads are kept around to be reused
+#define THREAD_POOL_SIZE 64
+// The most script shards that can run alongside the main script state
+#define SCRIPT_MAX_SHARDS 16
 
 typedef struct _EVENT_NOTIFY
 {
-	ENTITY_EVENT evt;
+	// Registers the callback on the queue for its event
+	EVENT_LINK link;
 	int funcReference;
 } EVENT_NOTIFY;
 
@@ -28,6 +33,8 @@ typedef struct _LUA_THREAD
 {
 	// The lua thread
 	lua_State *L;
+	// The manager (main state or shard) the thread runs in
+	class CLuaManager * owner;
 	// The argument count upon entry to the thread
 	int nargs;
 	// If this is the first run of the thread
@@ -35,19 +42,58 @@ typedef struct _LUA_THREAD
 	// If this thread should be terminated before it has a chance to run again
 	bool terminate;
 	// The unique ID of this thread
-	void * id;
+	uint64 id;
+	// The slot in the registry anchor array that keeps the thread from being collected
+	int anchor;
 	// How long the thread is sleeping for in seconds
 	double waittime;
-	// The event we are waiting for
-	ENTITY_EVENT waitEvent;
-	// The endon event list
-	ENTITY_EVENT endonEvents[ENDON_EVENT_COUNT];
+	// Parks the thread in the sleep wheel while it is sleeping
+	TIMER_NODE timer;
+	// When the thread has to yield by, 0 if it has no budget
+	double deadline;
+	// If the budget hook yielded the thread
+	bool sliced;
+	// If the thread has been reported for going over budget
+	bool overBudget;
+	// When the profiler last sampled the thread
+	double sampleTime;
+	// If the thread has run since the last save, a delta save has to persist it again
+	bool saveDirty;
+	// Registers the thread on the queue of the event it is waiting for
+	// Waiting threads are parked here instead of the run list
+	EVENT_LINK waitLink;
+	// The endon event list, each is registered on the queue for its event
+	EVENT_LINK endonLinks[ENDON_EVENT_COUNT];
 } LUA_THREAD;
 
+// A notify that has to reach the other shards
+typedef struct _SCRIPT_MESSAGE
+{
+	void * entity;
+	uint event;
+	void * argument;
+} SCRIPT_MESSAGE;
+
+#define VAR_WRITE_STRING 0
+#define VAR_WRITE_DOUBLE 1
+#define VAR_WRITE_INT 2
+#define VAR_WRITE_RESET 3
+
+// A var change from a script, held back while the shards tick (see WriteVar)
+typedef struct _SCRIPT_VAR_WRITE
+{
+	CVar * var;
+	// One of VAR_WRITE_*
+	int kind;
+	string text;
+	double number;
+} SCRIPT_VAR_WRITE;
+
 class CLuaManager
 {
 public:
-	CLuaManager();
+	// Shards are only created by the main manager
+	CLuaManager(int shardIndex = -1);
 	~CLuaManager();
 
 	// Compile a script
@@ -57,44 +103,172 @@ public:
 	void Init();
 
 	// Perform a single script tick
-	void Tick(double delta, const char * Event = NULL);
+	// With an event atom, only the threads waiting on that event run
+	void Tick(double delta, uint Event = ATOM_NONE);
+
+	// The collector only runs from here, call it with the spare time of each frame (in seconds)
+	// If the heap outgrows the last cycle by g_scriptgclimit first, it runs on its own until the next call
+	// Returns how long the collector ran for
+	double CollectGarbage(double budget);
 
 	// Load script(s)
+	void LoadResourceIds(map_t * map);
 	void LoadScript(sectionitem_t * item);
 	void LoadScripts(map_t * map, map_t * patch);
 
 	// Create a thread
 	lua_State * CreateThread(int nargs);
-	int FindThread(lua_State * L, std::vector<LUA_THREAD> ** v);
+	LUA_THREAD * FindThread(lua_State * L);
+	// Get the manager (main state or shard) a lua_State belongs to
+	static CLuaManager * FromState(lua_State * L);
+
+	// Register a thread or callback on an event
+	void WaitTill(LUA_THREAD * thr, void * Entity, uint Event);
+	void EndOn(LUA_THREAD * thr, void * Entity, uint Event);
+	void OnNotify(void * Entity, uint Event, int funcReference);
 
 	// Notify threads of an event
 	// The argument should be either ENTITY_LEVEL or an entity ID
-	void Notify(void * Entity, const char * Event, void * Argument = NULL);
+	void Notify(void * Entity, uint Event, void * Argument = NULL);
+	// Nothing can be registered on a name that was never interned, so that is a no-op
+	void Notify(void * Entity, const char * Event, void * Argument = NULL) { uint atom = atomFind(Event); if(atom != ATOM_NONE) Notify(Entity, atom, Argument); }
+
+	// Change a var from a script
+	// Vars aren't thread safe, so while the shards tick they are only read, the changes every state made are
+	//   applied on the main thread once the tick is over (varGet still sees the old value until then)
+	void WriteVar(const SCRIPT_VAR_WRITE& write);
 
 	// Reset the script state
 	void ResetState();
 
-	// Save/Load the script state from a file
-	void save(file& f);
+	// Save/Load the vars and script state as a save game (see SaveGame.h)
+	// Load goes into a state that has loaded the same scripts as the one that saved, the threads it is running are dropped
+	// A delta save only has what changed since the last save, tables and threads that didn't change are
+	//   written as references to the earlier saves
+	// Deltas are loaded on top of the save they follow: load the base, then each delta in order, without ticking in between
+	// Each shard is saved as a save game of its own inside the main one, the state loading it needs as many shards
+	void save(file& f, bool delta = false);
 	void load(file& f);
 
+	// A quick save is a heap image of the whole state (see luaStore.h), it is much faster to write and
+	//   load than save() but only the build that wrote it can load it, load() takes both kinds
+	// Loading a quick save replaces the state instead of loading into it
+	void QuickSave(file& f);
+
+	// Save in the background, the state is persisted into memory here and a worker compresses and writes it
+	// Scripts are notified with 'savecomplete' on the level once it is on disk, or 'savefailed' if it couldn't be written
+	// Returns false if another save is still being written
+	bool SaveAsync(const char * path, bool delta = false);
+
 	static CLuaManager * singleton;
 
-	std::vector<LUA_THREAD> queueThreads, tempQueue;
-	std::vector<LUA_THREAD> luaThreads;
-	EVENT_NOTIFY onnotify[ONNOTIFY_EVENT_COUNT];
+	// Threads that are waiting to run, sleeping and waiting threads are parked in sleepWheel and events instead
+	std::vector<LUA_THREAD *> queueThreads, tempQueue;
+	std::vector<LUA_THREAD *> luaThreads;
 
 	void addLuaFunction(lua_CFunction func, const char * name);
 
+	// How many times threads were yielded for going over the tick budget during the last tick
+	uint budgetYields;
+
+	// Sampling profiler, toggled by g_scriptprofile
+	CScriptProfiler profiler;
+	// Every allocation of the state goes through this, Stats() has the heap counters
+	CScriptAllocator allocator;
+
+	// Collector cycles finished, shards included
+	uint gcCycles;
+
 private:
 	std::vector<void *> functionBindings;
 	std::vector<std::string> functionNames;
-	std::vector<LUA_THREAD>::iterator tickThread(std::vector<LUA_THREAD>::iterator i, std::vector<LUA_THREAD> * v, double delta, const char * Event);
+	std::vector<LUA_THREAD *>::iterator tickThread(std::vector<LUA_THREAD *>::iterator i, std::vector<LUA_THREAD *> * v);
 	void setupLuaFunctions();
-	void * getNewThreadId();
+	void getAllThreads(std::vector<void *>& threads);
+	void deleteThread(LUA_THREAD * thr);
+	void deleteThreads();
+	void clearThreads();
+	LUA_THREAD * adoptThread();
+	void saveThreads(file& f, std::vector<void *>& threads);
+	void loadThreads(file& f);
+	void loadHeap(file& f, CSaveReader& r);
+	void pushSaveRoot(std::vector<void *>& threads);
+	void persistJob(struct _SAVE_JOB * job, bool delta);
+	void waitSave();
+	static void writeJob(file& f, struct _SAVE_JOB * job);
+	static void saveWorker(void * param);
+
+	// Snapshots, every object a save has written is given a key that later deltas refer to it by
+	// The registry refs are weak tables of object -> key (threads are kept apart), key -> object,
+	//   and closure -> key for the closures that have upvalues
+	int snapshotIds, snapshotThreads, snapshotObjects, snapshotClosures;
+	// The chain is picked by each full save, the serial counts the deltas on top of it
+	uint snapshotChain, snapshotSerial;
+	double snapshotNextId;
+	void resetSnapshot();
+	void beginSnapshot(file& f, bool delta);
+	void pushSnapshotDelta();
+	void indexSnapshot(int refs, int count, bool saving);
+	void endSnapshot(int count, std::vector<void *>& threads);
+	void applySnapshotDelta();
+
+	// The background save that is being written, NULL if there isn't one
+	struct _SAVE_JOB * saveJob;
+	void wakeThread(LUA_THREAD * thr, std::vector<LUA_THREAD *>& list);
+	void wakeWaiters(EVENT_QUEUE * queue, std::vector<LUA_THREAD *>& list);
+	void tickLocal(double delta, uint Event);
+	void notifyLocal(void * Entity, uint Event, void * Argument);
+	void stopProfiler();
+	double collectLocal(double budget);
 
 	bool didInit;
 
+	// Sharding, the main manager owns the shards and runs each one on its own worker thread
+	// Independent namespaces (g_scriptshardnamespaces) are loaded into a shard instead of the main state
+	// Notifies reach the other shards through the outboxes once every shard has finished the tick
+	// Var changes made during the tick are applied at the same point
+	int shardIndex;
+	std::vector<struct _SCRIPT_SHARD *> shards;
+	std::vector<SCRIPT_MESSAGE> outbox;
+	std::vector<SCRIPT_VAR_WRITE> varWrites;
+	bool ticking;
+	void createShards();
+	void deleteShards();
+	void routeMessages();
+	CLuaManager * shardFor(const char * nspace);
+	static void shardWorker(void * param);
+
+	// Sleeping threads, keyed by the script tick they wake on
+	CTimerWheel sleepWheel;
+	// Script time in ticks, the wheel runs on the whole part of this
+	double scriptTicks;
+	// When the running tick's budget is used up, 0 if there is no budget
+	double tickDeadline;
+	int sliceInstructions;
+	// Instructions between profiler samples, 0 if the profiler is off
+	int sampleInstructions;
+	std::vector<void *> wokenThreads;
+
+	// How much the collector gets through in a second (KB), measured as it steps
+	double gcRate;
+	// The heap when the collector last finished a cycle, the backstop limit is a multiple of this
+	size_t gcLiveBytes;
+	void limitHeap();
+
+	// waittill, endon and onnotify registrations, keyed by (entity, event)
+	CEventIndex events;
+	std::vector<EVENT_NOTIFY *> notifyCallbacks;
+	std::vector<EVENT_QUEUE *> eventQueues;
+
+	// Registry reference to the thread anchor array
+	int threadAnchors;
+	int anchorCount;
+	std::vector<int> freeAnchors;
+	// Finished threads that can be reset and reused, these stay anchored
+	std::vector<LUA_THREAD *> threadPool;
+
+	CIdAllocator threadIds;
+
 	lua_State *L;
 };
 
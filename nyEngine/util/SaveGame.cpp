@@ -0,0 +1,262 @@
+#include "..\include.h"
+#include "..\lua\lua.hpp"
+#include "SaveGame.h"
+#include <../zlib.h>
+
+CSaveWriter::CSaveWriter(file& f)
+	: f(f)
+{
+	stream = NULL;
+	sectionStart = 0;
+	sectionSize = 0;
+
+	f.write((uint)SAVE_MAGIC);
+	f.write((uint)SAVE_VERSION);
+	string(dbgVersionNumber()).save(f);
+}
+
+CSaveWriter::~CSaveWriter()
+{
+	if(stream)
+	{
+		deflateEnd(stream);
+		delete stream;
+	}
+}
+
+void CSaveWriter::beginSection(uint id, bool compress)
+{
+	if(sectionStart)
+		dbgError("CSaveWriter::beginSection - the last section wasn't ended");
+
+	f.write(id);
+	f.write((uint)(compress ? SAVE_DEFLATE : 0));
+
+	// The sizes are filled in by endSection
+	sectionStart = f.offset();
+	f.write((uint)0);
+	f.write((uint)0);
+	sectionSize = 0;
+
+	if(compress)
+	{
+		stream = new z_stream;
+		memset(stream, 0, sizeof(z_stream));
+		if(deflateInit(stream, 6) < Z_OK)
+			dbgError("deflateInit failed");
+	}
+}
+
+void CSaveWriter::deflateOut(int flush)
+{
+	uint length;
+
+	do
+	{
+		stream->next_out = (Bytef*)buffer;
+		stream->avail_out = sizeof(buffer);
+
+		if(deflate(stream, flush) == Z_STREAM_ERROR)
+			dbgError("failed to deflate");
+
+		length = sizeof(buffer) - stream->avail_out;
+		if(length)
+			f.write(buffer, length);
+	} while(stream->avail_out == 0);
+}
+
+void CSaveWriter::write(const void * data, uint length)
+{
+	if(stream == NULL)
+	{
+		f.write(data, length);
+		return;
+	}
+
+	stream->next_in = (Bytef*)data;
+	stream->avail_in = length;
+	sectionSize += length;
+
+	deflateOut(Z_NO_FLUSH);
+}
+
+void CSaveWriter::endSection()
+{
+	uint end, storedSize;
+	bool compressed = stream != NULL;
+
+	if(compressed)
+	{
+		stream->next_in = NULL;
+		stream->avail_in = 0;
+		deflateOut(Z_FINISH);
+
+		deflateEnd(stream);
+		delete stream;
+		stream = NULL;
+	}
+
+	end = f.offset();
+	storedSize = end - sectionStart - 8;
+
+	f.seek(sectionStart);
+	// Stored sections are written to the file directly, so only the compressed ones count their size
+	f.write(compressed ? sectionSize : storedSize);
+	f.write(storedSize);
+	f.seek(end);
+
+	sectionStart = 0;
+}
+
+void CSaveWriter::finish()
+{
+	f.write((uint)SAVE_SECTION_END);
+}
+
+int CSaveWriter::luaWriter(lua_State * L, const void * p, size_t size, void * ud)
+{
+	((CSaveWriter *)ud)->write(p, (uint)size);
+	return 0;
+}
+
+CSaveReader::CSaveReader(file& f)
+	: f(f)
+{
+	stream = NULL;
+	sectionEnd = 0;
+	storedLeft = 0;
+	streamEnd = false;
+}
+
+CSaveReader::~CSaveReader()
+{
+	endSection();
+}
+
+bool CSaveReader::open()
+{
+	string version;
+
+	if(f.size() < 8 || f.readuint32() != SAVE_MAGIC)
+		return false;
+
+	if(f.readuint32() != SAVE_VERSION)
+		return false;
+
+	version.load(f);
+	if(version != dbgVersionNumber())
+		dbgOut("save game is from version '%s'", version.c_str());
+
+	return true;
+}
+
+void CSaveReader::endSection()
+{
+	if(stream)
+	{
+		inflateEnd(stream);
+		delete stream;
+		stream = NULL;
+	}
+
+	if(sectionEnd)
+	{
+		f.seek(sectionEnd);
+		sectionEnd = 0;
+	}
+}
+
+uint CSaveReader::nextSection()
+{
+	uint id, flags, storedSize;
+
+	endSection();
+
+	id = f.readuint32();
+	if(id == SAVE_SECTION_END)
+		return id;
+
+	flags = f.readuint32();
+	f.readuint32(); // uncompressed size
+	storedSize = f.readuint32();
+
+	sectionEnd = f.offset() + storedSize;
+	if(sectionEnd > f.size())
+		dbgError("save game is truncated");
+
+	if(flags & SAVE_DEFLATE)
+	{
+		stream = new z_stream;
+		memset(stream, 0, sizeof(z_stream));
+		if(inflateInit(stream) < Z_OK)
+			dbgError("inflateInit failed");
+
+		storedLeft = storedSize;
+		streamEnd = false;
+	}
+
+	return id;
+}
+
+uint CSaveReader::inflateInto(void * data, uint length)
+{
+	uint size;
+	int err;
+
+	stream->next_out = (Bytef*)data;
+	stream->avail_out = length;
+
+	while(stream->avail_out && !streamEnd)
+	{
+		// Only as much of the section is read as is needed
+		if(stream->avail_in == 0)
+		{
+			if(storedLeft == 0)
+				dbgError("save game section is truncated");
+
+			size = storedLeft < sizeof(input) ? storedLeft : sizeof(input);
+			f.read(input, size);
+			storedLeft -= size;
+
+			stream->next_in = (Bytef*)input;
+			stream->avail_in = size;
+		}
+
+		err = inflate(stream, Z_NO_FLUSH);
+		if(err == Z_STREAM_END)
+			streamEnd = true;
+		else if(err < Z_OK)
+			dbgError("inflate failed");
+	}
+
+	return length - stream->avail_out;
+}
+
+void CSaveReader::read(void * data, uint length)
+{
+	if(stream == NULL)
+	{
+		f.read(data, length);
+		return;
+	}
+
+	if(inflateInto(data, length) != length)
+		dbgError("save game section is truncated");
+}
+
+const char * CSaveReader::luaReader(lua_State * L, void * ud, size_t * size)
+{
+	CSaveReader * r = (CSaveReader *)ud;
+
+	if(r->stream == NULL)
+	{
+		*size = r->sectionEnd - r->f.offset();
+		if(*size > sizeof(r->output))
+			*size = sizeof(r->output);
+		r->f.read(r->output, *size);
+		return *size ? r->output : NULL;
+	}
+
+	*size = r->inflateInto(r->output, sizeof(r->output));
+	return *size ? r->output : NULL;
+}
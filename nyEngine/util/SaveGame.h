@@ -0,0 +1,89 @@
+#ifndef _SAVEGAME_H
+#define _SAVEGAME_H
+
+// Save game container
+// A header (magic, version, engine version string) followed by sections, each section is
+//   uint id, uint flags, uint size (uncompressed), uint stored size, then the stored data
+// A section id of 0 ends the file
+#define SAVE_MAGIC 0x5653594E // 'NYSV'
+#define SAVE_VERSION 2
+
+#define SAVE_SECTION(a, b, c, d) ((uint)(a) | ((uint)(b) << 8) | ((uint)(c) << 16) | ((uint)(d) << 24))
+#define SAVE_SECTION_END 0
+#define SAVE_SECTION_VARS SAVE_SECTION('V', 'A', 'R', 'S')
+#define SAVE_SECTION_SCRIPT SAVE_SECTION('S', 'C', 'R', 'P')
+#define SAVE_SECTION_THREADS SAVE_SECTION('T', 'H', 'R', 'D')
+#define SAVE_SECTION_SNAPSHOT SAVE_SECTION('S', 'N', 'A', 'P')
+#define SAVE_SECTION_HEAP SAVE_SECTION('H', 'E', 'A', 'P')
+// uint shard index, then a whole save game of that shard
+#define SAVE_SECTION_SHARD SAVE_SECTION('S', 'H', 'R', 'D')
+
+// Section flags
+#define SAVE_DEFLATE 1 // the section is a zlib stream
+
+// How much is compressed or decompressed at once
+#define SAVE_BUFFER_SIZE 0x4000
+
+struct z_stream_s;
+
+// Writes a save game
+// Compressed sections are written through write() (or luaWriter), the others go straight to the file
+class CSaveWriter
+{
+public:
+	CSaveWriter(file& f);
+	~CSaveWriter();
+
+	void beginSection(uint id, bool compress);
+	void write(const void * data, uint length);
+	void endSection();
+
+	// Write the end marker
+	void finish();
+
+	// lua_Chunkwriter, ud is the writer
+	static int luaWriter(lua_State * L, const void * p, size_t size, void * ud);
+
+private:
+	void deflateOut(int flush);
+
+	file& f;
+	struct z_stream_s * stream;
+	uint sectionStart, sectionSize;
+	char buffer[SAVE_BUFFER_SIZE];
+};
+
+// Reads a save game
+// Compressed sections are read through read() (or luaReader), a section is inflated as it is read
+// The others can be read from the file, or through read() and luaReader as well
+class CSaveReader
+{
+public:
+	CSaveReader(file& f);
+	~CSaveReader();
+
+	// Check the header, returns false if this isn't a save game this version can read
+	bool open();
+
+	// Move to the next section, whatever is left of the last one is skipped
+	// Returns the section id, SAVE_SECTION_END at the end of the file
+	uint nextSection();
+
+	void read(void * data, uint length);
+
+	// lua_Reader, ud is the reader
+	static const char * luaReader(lua_State * L, void * ud, size_t * size);
+
+private:
+	void endSection();
+	uint inflateInto(void * data, uint length);
+
+	file& f;
+	struct z_stream_s * stream;
+	// Where the current section ends, and how much of its stored data hasn't been read yet
+	uint sectionEnd, storedLeft;
+	bool streamEnd;
+	char input[SAVE_BUFFER_SIZE], output[SAVE_BUFFER_SIZE];
+};
+
+#endif
@@ -0,0 +1,155 @@
+#include "..\include.h"
+#include "ScriptAlloc.h"
+
+CScriptAllocator::CScriptAllocator()
+{
+	pageTop = pageEnd = NULL;
+	memset(freeLists, 0, sizeof(freeLists));
+	memset(&stats, 0, sizeof(stats));
+}
+
+CScriptAllocator::~CScriptAllocator()
+{
+	Reset();
+}
+
+void CScriptAllocator::Reset()
+{
+	for(uint i = 0;i < pages.size();i++)
+		free(pages[i]);
+
+	pages.clear();
+	pageTop = pageEnd = NULL;
+	memset(freeLists, 0, sizeof(freeLists));
+	memset(&stats, 0, sizeof(stats));
+}
+
+void * CScriptAllocator::newPoolBlock(uint sizeClass)
+{
+	size_t size = (sizeClass + 1) * SCRIPT_ALLOC_GRANULE;
+	void * block;
+
+	// Start a new page once this one runs out, the tail of the old one is lost
+	if(pageTop == NULL || (size_t)(pageEnd - pageTop) < size)
+	{
+		pageTop = (char *)malloc(SCRIPT_ALLOC_PAGE_SIZE);
+		if(pageTop == NULL)
+		{
+			pageEnd = NULL;
+			return NULL;
+		}
+
+		pageEnd = pageTop + SCRIPT_ALLOC_PAGE_SIZE;
+		pages.push_back(pageTop);
+		stats.pageBytes += SCRIPT_ALLOC_PAGE_SIZE;
+	}
+
+	block = pageTop;
+	pageTop += size;
+
+	return block;
+}
+
+void * CScriptAllocator::allocBlock(size_t size)
+{
+	void * block;
+	uint c;
+
+	if(size > SCRIPT_ALLOC_MAX_POOLED)
+	{
+		block = malloc(size);
+		if(block == NULL)
+			return NULL;
+	}
+	else
+	{
+		c = sizeClass(size);
+		block = freeLists[c];
+		if(block)
+			freeLists[c] = *(void **)block;
+		else
+		{
+			block = newPoolBlock(c);
+			if(block == NULL)
+				return NULL;
+		}
+
+		stats.pooledBlocks++;
+		stats.pooledAllocations++;
+	}
+
+	stats.allocations++;
+	stats.blocks++;
+	stats.bytes += size;
+	if(stats.bytes > stats.peakBytes)
+		stats.peakBytes = stats.bytes;
+
+	return block;
+}
+
+void CScriptAllocator::freeBlock(void * ptr, size_t size)
+{
+	uint c;
+
+	if(size > SCRIPT_ALLOC_MAX_POOLED)
+		free(ptr);
+	else
+	{
+		c = sizeClass(size);
+		*(void **)ptr = freeLists[c];
+		freeLists[c] = ptr;
+		stats.pooledBlocks--;
+	}
+
+	stats.blocks--;
+	stats.bytes -= size;
+}
+
+void * CScriptAllocator::alloc(void * ud, void * ptr, size_t osize, size_t nsize)
+{
+	CScriptAllocator * a = (CScriptAllocator *)ud;
+	void * block;
+
+	if(nsize == 0)
+	{
+		if(ptr)
+			a->freeBlock(ptr, osize);
+		return NULL;
+	}
+
+	if(ptr == NULL)
+		return a->allocBlock(nsize);
+
+	// Growing or shrinking within a size class keeps the block
+	if(osize <= SCRIPT_ALLOC_MAX_POOLED && nsize <= SCRIPT_ALLOC_MAX_POOLED && sizeClass(osize) == sizeClass(nsize))
+	{
+		a->stats.bytes = a->stats.bytes - osize + nsize;
+		if(a->stats.bytes > a->stats.peakBytes)
+			a->stats.peakBytes = a->stats.bytes;
+		return ptr;
+	}
+
+	// Both on the system heap, let it move the block
+	if(osize > SCRIPT_ALLOC_MAX_POOLED && nsize > SCRIPT_ALLOC_MAX_POOLED)
+	{
+		block = realloc(ptr, nsize);
+		if(block == NULL)
+			return NULL;
+
+		a->stats.allocations++;
+		a->stats.bytes = a->stats.bytes - osize + nsize;
+		if(a->stats.bytes > a->stats.peakBytes)
+			a->stats.peakBytes = a->stats.bytes;
+		return block;
+	}
+
+	// Moving between a pool and the system heap
+	block = a->allocBlock(nsize);
+	if(block == NULL)
+		return NULL;
+
+	memcpy(block, ptr, osize < nsize ? osize : nsize);
+	a->freeBlock(ptr, osize);
+
+	return block;
+}
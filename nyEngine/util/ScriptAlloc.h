@@ -0,0 +1,65 @@
+#ifndef _SCRIPTALLOC_H
+#define _SCRIPTALLOC_H
+
+#include <vector>
+
+// Blocks up to 256 bytes come from the pools, in 8 byte steps
+#define SCRIPT_ALLOC_GRANULE 8
+#define SCRIPT_ALLOC_CLASSES 32
+#define SCRIPT_ALLOC_MAX_POOLED (SCRIPT_ALLOC_GRANULE * SCRIPT_ALLOC_CLASSES)
+// Pool blocks are carved out of pages this big
+#define SCRIPT_ALLOC_PAGE_SIZE 0x10000
+
+typedef struct _SCRIPT_ALLOC_STATS
+{
+	// What the state has asked for and not freed yet
+	size_t bytes;
+	size_t blocks;
+	// The most bytes in use at once since the last ResetPeak
+	size_t peakBytes;
+	// How many of the blocks came from the pools
+	size_t pooledBlocks;
+	// Bytes taken from the system for pool pages, the difference to the pooled bytes is slack
+	size_t pageBytes;
+	// Total allocations, pooled and not, since the last Reset
+	size_t allocations;
+	size_t pooledAllocations;
+} SCRIPT_ALLOC_STATS;
+
+// lua_Alloc for a single lua_State
+// Small blocks come from per size class free lists, everything else goes to the system heap
+// Lua tells the allocator the size of every block it frees, so pooled blocks carry no header
+// Pages are only given back to the system on Reset
+class CScriptAllocator
+{
+public:
+	CScriptAllocator();
+	~CScriptAllocator();
+
+	// Give every page back, only call this once the state using the allocator is closed
+	void Reset();
+
+	const SCRIPT_ALLOC_STATS& Stats() const { return stats; }
+	void ResetPeak() { stats.peakBytes = stats.bytes; }
+
+	// The lua_Alloc, ud is the allocator
+	static void * alloc(void * ud, void * ptr, size_t osize, size_t nsize);
+
+private:
+	void * allocBlock(size_t size);
+	void freeBlock(void * ptr, size_t size);
+	void * newPoolBlock(uint sizeClass);
+
+	static uint sizeClass(size_t size) { return (uint)((size - 1) / SCRIPT_ALLOC_GRANULE); }
+
+	// Free pool blocks of each size class, linked through their first word
+	void * freeLists[SCRIPT_ALLOC_CLASSES];
+
+	std::vector<void *> pages;
+	// The unused part of the newest page
+	char * pageTop, * pageEnd;
+
+	SCRIPT_ALLOC_STATS stats;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "..\include.h"
+#include "ScriptProfiler.h"
+
+// Deeper frames are cut off
+#define PROFILER_MAX_DEPTH 64
+
+CScriptProfiler::CScriptProfiler()
+{
+	running = false;
+}
+
+void CScriptProfiler::Start()
+{
+	stacks.clear();
+	namespaceTime.clear();
+	running = true;
+}
+
+void CScriptProfiler::Stop(const char * path)
+{
+	std::map<std::string, double>::iterator i;
+	char count[32];
+	double total = 0;
+	file f;
+
+	running = false;
+
+	if(!f.openWrite(path, false))
+	{
+		dbgOut("script profiler: unable to open '%s' for writing", path);
+		return;
+	}
+
+	for(i = stacks.begin();i != stacks.end();i++)
+	{
+		sprintf(count, " %u\n", (uint)(i->second * 1000000.0 + 0.5));
+		f.write(i->first.c_str(), i->first.length());
+		f.write(count, strlen(count));
+	}
+
+	f.close();
+
+	// Give a quick summary by namespace as well
+	for(i = namespaceTime.begin();i != namespaceTime.end();i++)
+		total += i->second;
+
+	dbgOut("script profiler: %u stacks, %.3fms sampled, written to '%s'", (uint)stacks.size(), total * 1000.0, path);
+	for(i = namespaceTime.begin();i != namespaceTime.end();i++)
+		dbgOut("script profiler:   %-32s %10.3fms %5.1f%%", i->first.c_str(), i->second * 1000.0, total > 0 ? i->second * 100.0 / total : 0.0);
+}
+
+void CScriptProfiler::AddNamespace(const void * env, const char * name)
+{
+	namespaces[env] = name;
+}
+
+void CScriptProfiler::ClearNamespaces()
+{
+	namespaces.clear();
+}
+
+const char * CScriptProfiler::namespaceName(lua_State * L, lua_Debug * ar)
+{
+	std::map<const void *, std::string>::iterator i;
+	const void * env;
+
+	// The function's environment is the namespace table it was loaded into
+	lua_getinfo(L, "f", ar);
+	lua_getfenv(L, -1);
+	env = lua_topointer(L, -1);
+	lua_pop(L, 2);
+
+	i = namespaces.find(env);
+	if(i == namespaces.end())
+		return "_G";
+
+	return i->second.c_str();
+}
+
+void CScriptProfiler::Sample(lua_State * L, double weight)
+{
+	lua_Debug frames[PROFILER_MAX_DEPTH];
+	const char * innerNamespace = NULL;
+	char label[0x100];
+	int depth, i;
+	char * c;
+
+	for(depth = 0;depth < PROFILER_MAX_DEPTH;depth++)
+	{
+		if(!lua_getstack(L, depth, &frames[depth]))
+			break;
+	}
+
+	// Build the stack root first
+	key.clear();
+	for(i = depth - 1;i >= 0;i--)
+	{
+		lua_getinfo(L, "Sn", &frames[i]);
+
+		if(frames[i].what[0] == 'C')
+			_snprintf(label, sizeof(label), "[C]:%s", frames[i].name ? frames[i].name : "?");
+		else
+		{
+			const char * nspace = namespaceName(L, &frames[i]);
+
+			_snprintf(label, sizeof(label), "%s:%s (%s:%i)", nspace, frames[i].name ? frames[i].name : "?",
+				frames[i].short_src, frames[i].linedefined);
+
+			if(i == 0)
+				innerNamespace = nspace;
+		}
+		label[sizeof(label) - 1] = 0;
+
+		// ';' separates frames in the output
+		for(c = label;*c;c++)
+		{
+			if(*c == ';')
+				*c = ',';
+		}
+
+		if(key.length())
+			key += ';';
+		key += label;
+	}
+
+	stacks[key] += weight;
+	namespaceTime[innerNamespace ? innerNamespace : "[C]"] += weight;
+}
@@ -0,0 +1,41 @@
+#ifndef _SCRIPTPROFILER_H
+#define _SCRIPTPROFILER_H
+
+#include "..\lua\lua.hpp"
+#include <map>
+#include <string>
+
+// Sampling profiler for script threads
+// Samples are taken from a count hook, each one is weighted by the time since the thread's last sample
+// Frames are labelled 'namespace:function', the namespace comes from the function's environment table
+class CScriptProfiler
+{
+public:
+	CScriptProfiler();
+
+	void Start();
+	// Stop profiling and write the samples to 'path' as collapsed stacks
+	// ('frame;frame;frame microseconds' per line, root first), the format flamegraph.pl reads
+	void Stop(const char * path);
+	bool IsRunning() const { return running; }
+
+	// Name the namespace that uses 'env' as its environment
+	void AddNamespace(const void * env, const char * name);
+	void ClearNamespaces();
+
+	// Record the current stack of L, 'weight' is in seconds
+	void Sample(lua_State * L, double weight);
+
+private:
+	const char * namespaceName(lua_State * L, lua_Debug * ar);
+
+	bool running;
+	// Collapsed stack to time in seconds
+	std::map<std::string, double> stacks;
+	// Self time of the innermost frame, by namespace
+	std::map<std::string, double> namespaceTime;
+	std::map<const void *, std::string> namespaces;
+	std::string key;
+};
+
+#endif
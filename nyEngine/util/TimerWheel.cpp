@@ -0,0 +1,174 @@
+#include "..\include.h"
+#include "TimerWheel.h"
+
+CTimerWheel::CTimerWheel()
+{
+	uint i, j;
+
+	for(i = 0;i < TIMER_WHEEL_LEVELS;i++)
+	{
+		for(j = 0;j < TIMER_WHEEL_SIZE;j++)
+			slots[i][j].next = slots[i][j].prev = &slots[i][j];
+	}
+
+	overflow.next = overflow.prev = &overflow;
+	now = 0;
+	count = 0;
+}
+
+void CTimerWheel::Reset(uint64 tick)
+{
+	uint i, j;
+	TIMER_NODE * node, * next;
+
+	// Unlink everything so the nodes don't point back into the wheel
+	for(i = 0;i < TIMER_WHEEL_LEVELS;i++)
+	{
+		for(j = 0;j < TIMER_WHEEL_SIZE;j++)
+		{
+			for(node = slots[i][j].next;node != &slots[i][j];node = next)
+			{
+				next = node->next;
+				node->next = node->prev = NULL;
+			}
+
+			slots[i][j].next = slots[i][j].prev = &slots[i][j];
+		}
+	}
+
+	for(node = overflow.next;node != &overflow;node = next)
+	{
+		next = node->next;
+		node->next = node->prev = NULL;
+	}
+
+	overflow.next = overflow.prev = &overflow;
+	now = tick;
+	count = 0;
+}
+
+void CTimerWheel::link(TIMER_NODE * list, TIMER_NODE * node)
+{
+	// Add to the tail, so nodes expiring on the same tick keep their order
+	node->next = list;
+	node->prev = list->prev;
+	list->prev->next = node;
+	list->prev = node;
+}
+
+void CTimerWheel::place(TIMER_NODE * node)
+{
+	uint level;
+	uint64 delta = node->expire - now;
+
+	// Find the first level that can hold the node
+	for(level = 0;level < TIMER_WHEEL_LEVELS;level++)
+	{
+		if(delta < ((uint64)1 << (TIMER_WHEEL_BITS * (level + 1))))
+		{
+			link(&slots[level][(node->expire >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], node);
+			return;
+		}
+	}
+
+	link(&overflow, node);
+}
+
+void CTimerWheel::Insert(TIMER_NODE * node, uint64 expire)
+{
+	if(IsParked(node))
+		Remove(node);
+
+	// A node can not expire in the past, it would never be seen again
+	if(expire <= now)
+		expire = now + 1;
+
+	node->expire = expire;
+	place(node);
+	count++;
+}
+
+void CTimerWheel::Remove(TIMER_NODE * node)
+{
+	if(!IsParked(node))
+		return;
+
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->next = node->prev = NULL;
+	count--;
+}
+
+void CTimerWheel::cascade(TIMER_NODE * list)
+{
+	TIMER_NODE * node, * next;
+
+	if(list->next == list)
+		return;
+
+	// Detach the list first, the nodes may land back in the same slot
+	node = list->next;
+	list->prev->next = NULL;
+	list->next = list->prev = list;
+
+	for(;node;node = next)
+	{
+		next = node->next;
+		place(node);
+	}
+}
+
+void CTimerWheel::Advance(uint64 tick, std::vector<void *>& expired)
+{
+	uint level, index;
+	TIMER_NODE * list, * node, * next;
+
+	while(now < tick)
+	{
+		now++;
+
+		// When a level wraps, pull the next slot of the level above down into the wheel
+		for(level = 1;level < TIMER_WHEEL_LEVELS;level++)
+		{
+			if((now & (((uint64)1 << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+				break;
+
+			index = (now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+			cascade(&slots[level][index]);
+		}
+
+		if(level == TIMER_WHEEL_LEVELS)
+			cascade(&overflow);
+
+		// Everything in the current slot is due
+		list = &slots[0][now & TIMER_WHEEL_MASK];
+		for(node = list->next;node != list;node = next)
+		{
+			next = node->next;
+			node->next = node->prev = NULL;
+			count--;
+
+			expired.push_back(node->owner);
+		}
+
+		list->next = list->prev = list;
+	}
+}
+
+void CTimerWheel::GetAll(std::vector<void *>& owners)
+{
+	uint i, j;
+	TIMER_NODE * node;
+
+	for(i = 0;i < TIMER_WHEEL_LEVELS;i++)
+	{
+		for(j = 0;j < TIMER_WHEEL_SIZE;j++)
+		{
+			for(node = slots[i][j].next;node != &slots[i][j];node = node->next)
+				owners.push_back(node->owner);
+		}
+	}
+
+	for(node = overflow.next;node != &overflow;node = node->next)
+		owners.push_back(node->owner);
+}
@@ -0,0 +1,62 @@
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+
+#include <vector>
+
+// Each level of the wheel has 64 slots, each level covers 64 times the range of the last
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+// A node that can be parked in the wheel, this lives inside the object being parked
+typedef struct _TIMER_NODE
+{
+	struct _TIMER_NODE * next, * prev;
+	// The tick this node fires on
+	uint64 expire;
+	// The object that owns this node
+	void * owner;
+} TIMER_NODE;
+
+// Hierarchical timer wheel, keyed by tick
+// Inserting and removing are constant time, advancing only touches nodes that are due
+// (and, once per wrap of a level, the nodes of a single slot of the next level)
+class CTimerWheel
+{
+public:
+	CTimerWheel();
+
+	// Drop every node and restart the wheel at 'tick'
+	void Reset(uint64 tick = 0);
+
+	// Park a node until 'expire', which must be after the current tick
+	void Insert(TIMER_NODE * node, uint64 expire);
+	// Take a node out of the wheel, does nothing if the node is not parked
+	void Remove(TIMER_NODE * node);
+	static bool IsParked(const TIMER_NODE * node) { return node->next != NULL; }
+
+	// Move the wheel forward to 'tick', the owners of every node that expires are appended to 'expired'
+	void Advance(uint64 tick, std::vector<void *>& expired);
+
+	// Append the owners of every parked node to 'owners'
+	void GetAll(std::vector<void *>& owners);
+
+	uint64 Now() const { return now; }
+	uint Count() const { return count; }
+
+private:
+	void link(TIMER_NODE * list, TIMER_NODE * node);
+	void place(TIMER_NODE * node);
+	void cascade(TIMER_NODE * list);
+
+	// Circular lists, the slot nodes are the list heads
+	TIMER_NODE slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+	// Nodes that are further out than the wheel covers
+	TIMER_NODE overflow;
+
+	uint64 now;
+	uint count;
+};
+
+#endif
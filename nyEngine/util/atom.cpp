@@ -0,0 +1,115 @@
+#include "..\include.h"
+#include <vector>
+
+#define ATOM_TABLE_MIN_SIZE 256
+
+// names[atom] is the name of that atom, names[ATOM_NONE] is unused
+static std::vector<char *> names;
+// Open addressed hash of name to atom, 0 is an empty slot
+static uint * table = NULL;
+static uint tableMask = 0;
+// Scripts on worker threads intern atoms too
+static lock atomLock;
+
+static uint atomHash(const char * name)
+{
+	// FNV-1a over the lower-cased name
+	uint hash = 2166136261;
+
+	for(;*name;name++)
+		hash = (hash ^ (byte)tolower(*name)) * 16777619;
+
+	return hash;
+}
+
+static uint atomLookup(const char * name, uint hash)
+{
+	uint slot;
+
+	if(table == NULL)
+		return ATOM_NONE;
+
+	for(slot = hash & tableMask;table[slot];slot = (slot + 1) & tableMask)
+	{
+		if(_stricmp(names[table[slot]], name) == 0)
+			return table[slot];
+	}
+
+	return ATOM_NONE;
+}
+
+static void atomGrow()
+{
+	uint size = tableMask ? (tableMask + 1) * 2 : ATOM_TABLE_MIN_SIZE;
+	uint atom, slot;
+
+	free(table);
+	table = (uint *)calloc(size, sizeof(uint));
+	if(table == NULL)
+		dbgError("atomGrow - out of memory");
+	tableMask = size - 1;
+
+	for(atom = 1;atom < names.size();atom++)
+	{
+		for(slot = atomHash(names[atom]) & tableMask;table[slot];slot = (slot + 1) & tableMask);
+		table[slot] = atom;
+	}
+}
+
+uint atomIntern(const char * name)
+{
+	uint hash = atomHash(name);
+	uint atom, slot;
+	char * copy;
+
+	atomLock.enter();
+
+	atom = atomLookup(name, hash);
+	if(atom == ATOM_NONE)
+	{
+		if(names.size() == 0)
+			names.push_back(NULL);
+
+		// Keep the table at most half full
+		if(names.size() * 2 > tableMask)
+			atomGrow();
+
+		copy = (char *)malloc(strlen(name) + 1);
+		if(copy == NULL)
+			dbgError("atomIntern - out of memory");
+		strcpy(copy, name);
+
+		atom = names.size();
+		names.push_back(copy);
+
+		for(slot = hash & tableMask;table[slot];slot = (slot + 1) & tableMask);
+		table[slot] = atom;
+	}
+
+	atomLock.leave();
+
+	return atom;
+}
+
+uint atomFind(const char * name)
+{
+	uint atom;
+
+	atomLock.enter();
+	atom = atomLookup(name, atomHash(name));
+	atomLock.leave();
+
+	return atom;
+}
+
+const char * atomName(uint atom)
+{
+	const char * name = NULL;
+
+	atomLock.enter();
+	if(atom != ATOM_NONE && atom < names.size())
+		name = names[atom];
+	atomLock.leave();
+
+	return name;
+}
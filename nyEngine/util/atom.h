@@ -0,0 +1,15 @@
+#ifndef _ATOM_H
+#define _ATOM_H
+
+// Atoms are interned names, small integers that compare with a single ==
+// Names are case insensitive, the spelling that was interned first is kept
+#define ATOM_NONE 0
+
+// Get the atom for a name, interning it if it is new
+uint atomIntern(const char * name);
+// Get the atom for a name without interning it, ATOM_NONE if it was never interned
+uint atomFind(const char * name);
+// Get the name of an atom, NULL if the atom doesn't exist
+const char * atomName(uint atom);
+
+#endif
@@ -1,11 +1,20 @@
 #include "..\include.h"
 
+#ifdef _WIN32
+#include <Windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 file::file()
 {
 	checksum = 0;
 	checksumIndex = 0;
 	checksumBuffer = 0;
 	rawfile = NULL;
+	memory = NULL;
+	memorySize = memoryCapacity = memoryOffset = 0;
 }
 
 file::~file()
@@ -41,30 +50,61 @@ bool file::openWrite(const char * path, bool binary, bool append)
 	return rawfile != NULL;
 }
 
-void file::close()
+bool file::openMemory()
+{
+	memoryCapacity = 0x10000;
+	memory = (uint8 *)malloc(memoryCapacity);
+	memorySize = memoryOffset = 0;
+	return memory != NULL;
+}
+
+bool file::close()
 {
+	bool flushed = true;
+
+	if(memory)
+	{
+		free(memory);
+		memory = NULL;
+		memorySize = memoryCapacity = memoryOffset = 0;
+	}
+
 	if(rawfile)
 	{
-		fclose(rawfile);
+		flushed = fclose(rawfile) == 0;
 		checksum = 0;
 		checksumIndex = 0;
 		checksumBuffer = 0;
 		rawfile = NULL;
 	}
+
+	return flushed;
 }
 
 void file::seek(uint offset)
 {
+	if(memory)
+	{
+		memoryOffset = offset;
+		return;
+	}
+
 	fseek(rawfile, offset, SEEK_SET);
 }
 
 uint file::offset()
 {
+	if(memory)
+		return memoryOffset;
+
 	return ftell(rawfile); 
 }
 
 uint file::size()
 {
+	if(memory)
+		return memorySize;
+
 	uint end;
 	uint off = offset();
 	fseek(rawfile, 0, SEEK_END);
@@ -112,6 +152,26 @@ void file::write(const void * data, int length)
 {
 	int l;
 
+	if(memory)
+	{
+		// Double the buffer until the write fits
+		if(memoryOffset + length > memoryCapacity)
+		{
+			while(memoryOffset + length > memoryCapacity)
+				memoryCapacity *= 2;
+
+			memory = (uint8 *)realloc(memory, memoryCapacity);
+			if(memory == NULL)
+				dbgError("unable to grow memory file to %u bytes", memoryCapacity);
+		}
+
+		memcpy(memory + memoryOffset, data, length);
+		memoryOffset += length;
+		if(memoryOffset > memorySize)
+			memorySize = memoryOffset;
+		return;
+	}
+
 	if(rawfile == NULL)
 		dbgError("file handle invalid");
 
@@ -122,6 +182,21 @@ void file::write(const void * data, int length)
 		dbgError("unable to write to file");
 }
 
+bool file::tryWrite(const void * data, int length)
+{
+	if(memory)
+	{
+		write(data, length);
+		return true;
+	}
+
+	if(rawfile == NULL)
+		return false;
+
+	updateChecksum(data, length);
+	return length == 0 || fwrite(data, length, 1, rawfile) == 1;
+}
+
 double file::readdouble()
 {
 	double x;
@@ -192,6 +267,29 @@ void file::read(void * data, int length)
 		dbgError("unable to read from file");
 }
 
+void file::readAt(uint offset, void * data, int length)
+{
+	if(rawfile == NULL)
+		dbgError("file handle invalid");
+
+	if(length == 0)
+		return;
+
+#ifdef _WIN32
+	OVERLAPPED ov;
+	DWORD l = 0;
+
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = offset;
+
+	if(!ReadFile((HANDLE)_get_osfhandle(_fileno(rawfile)), data, length, &l, &ov) || l != (DWORD)length)
+		dbgError("unable to read from file");
+#else
+	if(pread(fileno(rawfile), data, length, offset) != length)
+		dbgError("unable to read from file");
+#endif
+}
+
 uint file::getChecksum()
 {
 	uint i;
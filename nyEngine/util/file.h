@@ -10,9 +10,15 @@ public:
 	// Open a file for reading or writing
 	bool openRead(const char * path, bool binary = true);
 	bool openWrite(const char * path, bool binary = true, bool append = false);
+	// Open a buffer in memory for writing, it grows as it is written to
+	// Memory files don't keep a checksum, that is left to whatever writes them out
+	bool openMemory();
 
-	// Close the file
-	void close();
+	// The contents of a memory file, size() bytes long
+	const void * memoryData() const { return memory; }
+
+	// Close the file, returns false if what was still buffered couldn't be written
+	bool close();
 
 	// Set the pointer (only up to 4 GB)
 	void seek(uint offset);
@@ -31,6 +37,8 @@ public:
 	void write(int16 x);
 	void write(int8 x);
 	void write(const void * data, int length);
+	// Write without stopping on an error, returns false if it didn't all get written
+	bool tryWrite(const void * data, int length);
 
 	// Read from the file
 	double readdouble();
@@ -42,6 +50,11 @@ public:
 	int8 readint8();
 	void read(void * data, int length);
 
+	// Read from an absolute offset, several threads can call this on the same file
+	// On Windows the handle is synchronous, so the reads are serialized and still move the file pointer
+	// Don't mix it with read() on the same file
+	void readAt(uint offset, void * data, int length);
+
 	// Get the current checksum value
 	uint getChecksum();
 
@@ -51,6 +64,9 @@ private:
 
 	uint checksum, checksumBuffer, checksumIndex;
 	FILE * rawfile;
+
+	uint8 * memory;
+	uint memorySize, memoryCapacity, memoryOffset;
 };
 
 #endif
\ No newline at end of file
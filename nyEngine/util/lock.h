@@ -12,6 +12,8 @@ public:
 	void leave();
 
 private:
+	friend class condition;
+
 	void * data; // platform specific lock data
 };
 
@@ -1,315 +1,947 @@
 #define LUA_CORE
 
-#if 0
 #include "..\include.h"
-#include "LuaManager.h"
+#include "..\lua\lua.hpp"
 
 extern "C"
 {
 #include "..\lua\lstate.h"
+#include "..\lua\lobject.h"
+#include "..\lua\ltable.h"
+#include "..\lua\lfunc.h"
+#include "..\lua\lstring.h"
+#include "..\lua\ldo.h"
+#include "..\lua\lzio.h"
 }
 
+#include <vector>
 #include "luaStore.h"
 
-// File format is pretty simple
-
-// A few implementation details:
-// Only light c functions are supported
-// Keep in mind this is designed for this engine's savegames
+// File format is pretty simple, every object is given an id (1 and up, 0 is NULL) and
+//   references between objects are written as ids
+// Objects are written twice, once with what is needed to allocate them and once with
+//   their contents, so loading can create every object before anything refers to them
+
+// Header:
+// uint Magic
+// byte PointerSize, NumberSize, InstructionSize
+// int64 CodeCheck - where lua_newstate is from luaStore_save, the image is from another build if this differs
+// uint StringCount
+// uint ObjectCount - strings included
+
+// Shells (ObjectCount):
+// Strings come first, they are the string table
+// String: uint Length, char Text[Length]
+// Other: byte Type, then
+//   Table: uint ArraySize, uint NodeCount (0 when it has no hash part)
+//   Lua/C closure: byte UpvalueCount
+//   Proto: uint CodeSize, ConstantCount, ProtoCount, LineCount, LocalCount, UpvalueCount
+//   Closed upvalue: nothing
+//   Open upvalue: uint Thread, uint StackIndex - open upvalues come after every thread
+//   Userdata: uint Length, byte Data[Length]
+//   Thread: byte MainThread, uint StackSize, uint CallInfoCount
+
+// Contents (ObjectCount - StringCount), in the same order:
+//   Table: byte DirtyState, uint Metatable, Value Array[ArraySize], uint KeyCount, (Value Key, Value Value)[KeyCount]
+//   Lua closure: uint Env, uint Proto, uint Upvalues[UpvalueCount]
+//   C closure: uint Env, int64 Function (offset from luaStore_save), Value Upvalues[UpvalueCount]
+//   Proto: the proto's fields, constants are values and protos, names and sources are ids
+//     a proto still waiting on a lazy undump keeps its chunk (an id) and offset and has no body
+//   Closed upvalue: Value
+//   Open upvalue: nothing
+//   Userdata: uint Metatable, uint Env
+//   Thread: the thread's fields, the live part of the stack and the active CallInfos,
+//     stack pointers are indices and saved pcs are (Proto, offset)
+
+// Value:
+// byte Type, then nothing for nil, byte for booleans, the pointer for light userdata,
+//   the lua_Number for numbers and the id for everything else
+
+// Globals:
+// Value Registry, uint Metatables[NUM_TAGS]
+
+#define LUASTORE_MAGIC 0x5254534C // 'LSTR'
+#define LUASTORE_BUFFER 0x10000
+
+// The object types that aren't lua types
+#define LUASTORE_LCLOSURE (LUA_TDEADKEY + 1)
+#define LUASTORE_CCLOSURE (LUA_TDEADKEY + 2)
+#define LUASTORE_OPENUPVAL (LUA_TDEADKEY + 3)
+
+typedef struct _STORE_WRITER
+{
+	lua_State * L;
+	lua_Writer writer;
+	void * ud;
+	// Every object in id order (id - 1)
+	std::vector<GCObject *> objects;
+	uint stringCount;
+	// Object -> id, open addressed
+	std::vector<GCObject *> keys;
+	std::vector<uint> ids;
+	uint mask;
+	size_t used;
+	char buffer[LUASTORE_BUFFER];
+} STORE_WRITER;
+
+typedef struct _STORE_READER
+{
+	lua_State * L;
+	ZIO z;
+	// id - 1 -> object
+	std::vector<GCObject *> objects;
+	uint stringCount;
+	std::vector<char> scratch;
+} STORE_READER;
+
+static void luaStore_flush(STORE_WRITER * w)
+{
+	if(w->used && w->writer(w->L, w->buffer, w->used, w->ud) != 0)
+		dbgError("luaStore - unable to write the heap image");
+	w->used = 0;
+}
 
-// Thread:
-// void * GCPointer
-// 
-// ThreadData data
+static void luaStore_write(STORE_WRITER * w, const void * data, size_t size)
+{
+	if(w->used + size > LUASTORE_BUFFER)
+	{
+		luaStore_flush(w);
 
-// Thread Data:
-// int StackCount
-// Object[] Stack
+		// Big blocks (long strings, code) go straight through
+		if(size > LUASTORE_BUFFER)
+		{
+			if(w->writer(w->L, data, size, w->ud) != 0)
+				dbgError("luaStore - unable to write the heap image");
+			return;
+		}
+	}
 
-// Object:
-// byte ObjectType
-// ObjectData data
+	memcpy(w->buffer + w->used, data, size);
+	w->used += size;
+}
 
-// Object Data:
-// varies depending on type
+static void luaStore_writeByte(STORE_WRITER * w, byte b)
+{
+	luaStore_write(w, &b, sizeof(b));
+}
 
-// GC Object:
-// void * GCPointer - used to match up objects when loading
-// byte ObjectType
-// GCData data
+static void luaStore_writeUint(STORE_WRITER * w, uint i)
+{
+	luaStore_write(w, &i, sizeof(i));
+}
 
-// GC Data:
-// varies depending on type
+static void luaStore_writeInt(STORE_WRITER * w, int i)
+{
+	luaStore_write(w, &i, sizeof(i));
+}
 
-// The string table is really just a table of string objects
-// String Table:
-// uint32 StringCount
-// String Strings;
+static uint luaStore_hash(GCObject * o, uint mask)
+{
+	uint hash = (uint)((size_t)o >> 3) * 2654435761;
+	return (hash ^ (hash >> 16)) & mask;
+}
 
-// String:
-// void * GCPointer
-// ushort Length
-// char Text
+static void luaStore_add(STORE_WRITER * w, GCObject * o)
+{
+	w->objects.push_back(o);
+}
 
-// File itself:
-// StringTable Strings
-// int GlobalGCCount
-// Object[] GlobalGCObjects
-// int ThreadCount
-// Thread[] Threads
+static void luaStore_index(STORE_WRITER * w)
+{
+	uint size, i, slot;
 
-void luaStore_writeTable(GCObject * obj, file& f, std::vector<void *>& functions);
-void luaStore_writeObject(GCObject * obj, file& f, std::vector<void *>& functions);
-void luaStore_writeValue(TValue * v, file& f, std::vector<void *>& functions);
-void luaStore_writeThread(lua_State * L, file& f, std::vector<void *>& functions);
+	for(size = 64;size < w->objects.size() * 2;size *= 2)
+		;
 
-void luaStore_writeTable(GCObject * obj, file& f, std::vector<void *>& functions)
-{
-	// Table format:
-	// int sizearray
-	// sizearray objects
-	f.write(obj->h.sizearray);
+	w->keys.assign(size, NULL);
+	w->ids.resize(size);
+	w->mask = size - 1;
 
-	int i;
-	for(i = 0;i < obj->h.sizearray;i++)
-		luaStore_writeValue(&obj->h.array[i], f, functions);
+	for(i = 0;i < w->objects.size();i++)
+	{
+		for(slot = luaStore_hash(w->objects[i], w->mask);w->keys[slot];slot = (slot + 1) & w->mask)
+			;
+		w->keys[slot] = w->objects[i];
+		w->ids[slot] = i + 1;
+	}
 }
 
-void luaStore_writeLongString(GCObject * obj, file& f)
+static uint luaStore_findId(STORE_WRITER * w, const void * p)
 {
-	// Long String format:
-	// ushort length
-	// length bytes
-	if(obj->ts.tsv.len > 0xFFFF)
-		dbgError("string too long");
-	f.write((ushort)obj->ts.tsv.len);
+	GCObject * o = (GCObject *)p;
+	uint slot;
+
+	if(o == NULL)
+		return 0;
+
+	for(slot = luaStore_hash(o, w->mask);w->keys[slot];slot = (slot + 1) & w->mask)
+	{
+		if(w->keys[slot] == o)
+			return w->ids[slot];
+	}
 
-	f.write(&obj->ts + 1, obj->ts.tsv.len);
+	dbgError("luaStore - object %p isn't in the heap", p);
+	return 0;
 }
 
-void luaStore_writeHeader(GCObject * obj, file& f)
+static void luaStore_writeId(STORE_WRITER * w, const void * p)
 {
-	f.write(&obj, sizeof(void*));
-	f.write(obj->gch.tt);
+	luaStore_writeUint(w, luaStore_findId(w, p));
 }
 
-void luaStore_writeObject(GCObject * obj, file& f, std::vector<void *>& functions)
+static void luaStore_writeValue(STORE_WRITER * w, const TValue * o)
 {
-	// write the data
-	switch(obj->gch.tt)
+	luaStore_writeByte(w, (byte)ttype(o));
+
+	switch(ttype(o))
 	{
-	case LUA_TSHRSTR:
-		dbgError("short string is not a valid object type");
+	case LUA_TNIL:
 		break;
-	case LUA_TLNGSTR:
-		luaStore_writeHeader(obj, f);
-		luaStore_writeLongString(obj, f);
+	case LUA_TBOOLEAN:
+		luaStore_writeByte(w, (byte)o->value.b);
 		break;
-	case LUA_TTABLE:
-		luaStore_writeHeader(obj, f);
-		luaStore_writeTable(obj, f, functions);
+	case LUA_TLIGHTUSERDATA:
+		luaStore_write(w, &o->value.p, sizeof(void *));
 		break;
-	case LUA_TLCL:
-		// Lua closure, serialize this
-		luaStore_writeHeader(obj, f);
+	case LUA_TNUMBER:
+		luaStore_write(w, &o->value.n, sizeof(lua_Number));
 		break;
-	case LUA_TTHREAD:
-		// Thread, serialize this
-		luaStore_writeHeader(obj, f);
-		luaStore_writeThread(&obj->th, f, functions);
+	default:
+		luaStore_writeId(w, o->value.gc);
+		break;
+	}
+}
+
+static void luaStore_writeStackIndex(STORE_WRITER * w, lua_State * T, StkId p)
+{
+	luaStore_writeUint(w, (uint)(p - T->stack));
+}
+
+// Saved pcs point into the code of the function they are running
+static void luaStore_writePc(STORE_WRITER * w, Proto * p, const Instruction * pc)
+{
+	if(p == NULL || pc < p->code || pc > p->code + p->sizecode)
+	{
+		luaStore_writeUint(w, 0);
+		luaStore_writeUint(w, 0);
+		return;
+	}
+
+	luaStore_writeId(w, p);
+	luaStore_writeUint(w, (uint)(pc - p->code));
+}
+
+static Proto * luaStore_ciProto(CallInfo * ci)
+{
+	return isLua(ci) ? ci_func(ci)->l.p : NULL;
+}
+
+static void luaStore_writeShell(STORE_WRITER * w, GCObject * o)
+{
+	switch(o->gch.tt)
+	{
+	case LUA_TTABLE:
+		luaStore_writeByte(w, LUA_TTABLE);
+		luaStore_writeUint(w, o->h.sizearray);
+		// A single node with no key is the shared dummy node, or never used
+		luaStore_writeUint(w, o->h.lsizenode == 0 && ttisnil(key2tval(o->h.node)) ? 0 : (uint)sizenode(&o->h));
+		break;
+	case LUA_TFUNCTION:
+		luaStore_writeByte(w, o->cl.c.isC ? LUASTORE_CCLOSURE : LUASTORE_LCLOSURE);
+		luaStore_writeByte(w, o->cl.c.nupvalues);
 		break;
 	case LUA_TPROTO:
-		// Prototype, serialize this
-		luaStore_writeHeader(obj, f);
+		luaStore_writeByte(w, LUA_TPROTO);
+		luaStore_writeInt(w, o->p.sizecode);
+		luaStore_writeInt(w, o->p.sizek);
+		luaStore_writeInt(w, o->p.sizep);
+		luaStore_writeInt(w, o->p.sizelineinfo);
+		luaStore_writeInt(w, o->p.sizelocvars);
+		luaStore_writeInt(w, o->p.sizeupvalues);
 		break;
 	case LUA_TUPVAL:
-		// Upval, serialize this
-		luaStore_writeHeader(obj, f);
+		luaStore_writeByte(w, LUA_TUPVAL);
+		break;
+	case LUA_TUSERDATA:
+		luaStore_writeByte(w, LUA_TUSERDATA);
+		luaStore_writeUint(w, (uint)o->u.uv.len);
+		luaStore_write(w, &o->u + 1, o->u.uv.len);
+		break;
+	case LUA_TTHREAD:
+		luaStore_writeByte(w, LUA_TTHREAD);
+		luaStore_writeByte(w, &o->th == G(w->L)->mainthread);
+		luaStore_writeInt(w, o->th.stacksize);
+		luaStore_writeInt(w, o->th.size_ci);
 		break;
 	default:
-		dbgError("unknown object type %i", obj->gch.tt);
+		dbgError("luaStore - unknown object type %i", o->gch.tt);
 		break;
 	}
 }
 
-void luaStore_writeValue(TValue * v, file& f, std::vector<void *>& functions)
+static void luaStore_writeTable(STORE_WRITER * w, Table * t)
 {
-	uint i;
-	bool found;
-	byte type = ttype(v);
+	int i, count;
 
-	f.write(type);
+	luaStore_writeByte(w, t->dirty);
+	luaStore_writeId(w, t->metatable);
 
-	switch(type)
+	for(i = 0;i < t->sizearray;i++)
+		luaStore_writeValue(w, &t->array[i]);
+
+	for(count = 0, i = 0;i < sizenode(t);i++)
+	{
+		if(!ttisnil(gval(gnode(t, i))))
+			count++;
+	}
+
+	luaStore_writeInt(w, count);
+	for(i = 0;i < sizenode(t);i++)
+	{
+		Node * n = gnode(t, i);
+		if(ttisnil(gval(n)))
+			continue;
+
+		luaStore_writeValue(w, key2tval(n));
+		luaStore_writeValue(w, gval(n));
+	}
+}
+
+static void luaStore_writeProto(STORE_WRITER * w, Proto * p)
+{
+	int i;
+
+	luaStore_writeId(w, p->source);
+	luaStore_writeInt(w, p->linedefined);
+	luaStore_writeInt(w, p->lastlinedefined);
+	luaStore_writeByte(w, p->nups);
+	luaStore_writeByte(w, p->numparams);
+	luaStore_writeByte(w, p->is_vararg);
+	luaStore_writeByte(w, p->maxstacksize);
+	luaStore_writeId(w, p->lazy);
+	luaStore_writeInt(w, p->lazypos);
+
+	luaStore_write(w, p->code, p->sizecode * sizeof(Instruction));
+	for(i = 0;i < p->sizek;i++)
+		luaStore_writeValue(w, &p->k[i]);
+	for(i = 0;i < p->sizep;i++)
+		luaStore_writeId(w, p->p[i]);
+	luaStore_write(w, p->lineinfo, p->sizelineinfo * sizeof(int));
+	for(i = 0;i < p->sizelocvars;i++)
+	{
+		luaStore_writeId(w, p->locvars[i].varname);
+		luaStore_writeInt(w, p->locvars[i].startpc);
+		luaStore_writeInt(w, p->locvars[i].endpc);
+	}
+	for(i = 0;i < p->sizeupvalues;i++)
+		luaStore_writeId(w, p->upvalues[i]);
+}
+
+static void luaStore_writeThread(STORE_WRITER * w, lua_State * T)
+{
+	CallInfo * ci;
+	StkId lim;
+	int i;
+
+	if(T->errorJmp)
+		dbgError("luaStore - a thread is running");
+
+	luaStore_writeByte(w, T->status);
+	luaStore_writeUint(w, T->nCcalls);
+	luaStore_writeUint(w, T->baseCcalls);
+	luaStore_writeByte(w, T->allowhook);
+	luaStore_writeInt(w, (int)T->errfunc);
+	luaStore_writeValue(w, gt(T));
+	// env is only scratch space for LUA_ENVIRONINDEX, it isn't set until that is used and the collector ignores it
+	luaStore_writeByte(w, LUA_TNIL);
+
+	// Above the top, only what the active functions can still see is kept
+	lim = T->top;
+	for(ci = T->base_ci;ci <= T->ci;ci++)
+	{
+		if(ci->top > lim)
+			lim = ci->top;
+	}
+	if(lim > T->stack_last)
+		lim = T->stack_last;
+
+	// Slots above the top are dead, and may never have been written, the collector clears them the same way
+	luaStore_writeStackIndex(w, T, lim);
+	for(i = 0;T->stack + i < lim;i++)
 	{
-	case LUA_TNIL: // nil has no data
+		if(T->stack + i < T->top)
+			luaStore_writeValue(w, T->stack + i);
+		else
+			luaStore_writeByte(w, LUA_TNIL);
+	}
+	luaStore_writeStackIndex(w, T, T->top);
+	luaStore_writeStackIndex(w, T, T->base);
+
+	luaStore_writeInt(w, (int)(T->ci - T->base_ci) + 1);
+	for(ci = T->base_ci;ci <= T->ci;ci++)
+	{
+		luaStore_writeStackIndex(w, T, ci->base);
+		luaStore_writeStackIndex(w, T, ci->func);
+		luaStore_writeStackIndex(w, T, ci->top);
+		luaStore_writePc(w, luaStore_ciProto(ci), ci->savedpc);
+		luaStore_writeInt(w, ci->nresults);
+		luaStore_writeInt(w, ci->tailcalls);
+	}
+
+	// The current pc belongs to the running function, or to the Lua function under a C function
+	for(ci = T->ci;ci > T->base_ci && luaStore_ciProto(ci) == NULL;ci--)
+		;
+	luaStore_writePc(w, luaStore_ciProto(ci), T->savedpc);
+}
+
+static void luaStore_writeContents(STORE_WRITER * w, GCObject * o)
+{
+	int i;
+	int64 offset;
+
+	switch(o->gch.tt)
+	{
+	case LUA_TTABLE:
+		luaStore_writeTable(w, &o->h);
 		break;
-	case LUA_TBOOLEAN:
-		f.write((byte)val_(v).b);
+	case LUA_TFUNCTION:
+		luaStore_writeId(w, o->cl.c.env);
+		if(o->cl.c.isC)
+		{
+			offset = (char *)o->cl.c.f - (char *)luaStore_save;
+			luaStore_write(w, &offset, sizeof(offset));
+			for(i = 0;i < o->cl.c.nupvalues;i++)
+				luaStore_writeValue(w, &o->cl.c.upvalue[i]);
+		}
+		else
+		{
+			luaStore_writeId(w, o->cl.l.p);
+			for(i = 0;i < o->cl.l.nupvalues;i++)
+				luaStore_writeId(w, o->cl.l.upvals[i]);
+		}
 		break;
-	case LUA_TLIGHTUSERDATA: // write the pointer
-		f.write(&val_(v).p, sizeof(void*));
+	case LUA_TPROTO:
+		luaStore_writeProto(w, &o->p);
 		break;
-	case LUA_TNUMBER:
-		f.write(num_(v));
+	case LUA_TUPVAL:
+		// Open upvalues are rebuilt from their thread's stack
+		if(o->uv.v == &o->uv.u.value)
+			luaStore_writeValue(w, o->uv.v);
 		break;
-	case LUA_TSTRING: // write the pointer to gc objects
-	case LUA_TTABLE:
 	case LUA_TUSERDATA:
-	case LUA_TTHREAD:
-		// all gc objects will be flushed to disk later
-		f.write(&val_(v).gc, sizeof(void*));
+		luaStore_writeId(w, o->u.uv.metatable);
+		luaStore_writeId(w, o->u.uv.env);
 		break;
-	case LUA_TLCL:
-		f.write(&val_(v).gc, sizeof(void*)); // this variant is a gc object
+	case LUA_TTHREAD:
+		luaStore_writeThread(w, &o->th);
 		break;
-	case LUA_TLCF: // c-function
-		// look up the function in the bindings list
-		found = false;
-		for(i = 0;i < functions.size();i++)
+	}
+}
+
+void luaStore_save(lua_State * L, lua_Writer writer, void * ud)
+{
+	global_State * g = G(L);
+	STORE_WRITER * w;
+	GCObject * o;
+	lu_mem threshold;
+	int64 check;
+	uint i, threadEnd;
+	int j;
+
+	if(L != g->mainthread || L->ci != L->base_ci)
+		dbgError("luaStore - the state can't be saved while it is running");
+
+	// Only live objects are written, and nothing can be in the middle of a collection
+	// A full collection restarts a stopped collector, so it is stopped again after
+	threshold = g->GCthreshold;
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	if(threshold == MAX_LUMEM)
+		g->GCthreshold = MAX_LUMEM;
+	if(g->tmudata)
+		dbgError("luaStore - userdata is still waiting to be finalized");
+
+	// The writer is big, keep it off the stack
+	w = new STORE_WRITER;
+	w->L = L;
+	w->writer = writer;
+	w->ud = ud;
+	w->used = 0;
+
+	// Number the objects, strings first so they can be interned before anything else is loaded
+	w->objects.reserve(g->strt.nuse + 1024);
+	for(j = 0;j < g->strt.size;j++)
+	{
+		for(o = g->strt.hash[j];o;o = o->gch.next)
+			luaStore_add(w, o);
+	}
+	w->stringCount = w->objects.size();
+
+	for(o = g->rootgc;o;o = o->gch.next)
+		luaStore_add(w, o);
+
+	// Open upvalues are only on their thread's list, they come after every thread
+	threadEnd = w->objects.size();
+	for(i = w->stringCount;i < threadEnd;i++)
+	{
+		if(w->objects[i]->gch.tt != LUA_TTHREAD)
+			continue;
+
+		for(o = w->objects[i]->th.openupval;o;o = o->gch.next)
+			luaStore_add(w, o);
+	}
+
+	luaStore_index(w);
+
+	// Header
+	luaStore_writeUint(w, LUASTORE_MAGIC);
+	luaStore_writeByte(w, sizeof(void *));
+	luaStore_writeByte(w, sizeof(lua_Number));
+	luaStore_writeByte(w, sizeof(Instruction));
+	check = (char *)lua_newstate - (char *)luaStore_save;
+	luaStore_write(w, &check, sizeof(check));
+	luaStore_writeUint(w, w->stringCount);
+	luaStore_writeUint(w, w->objects.size());
+
+	// Shells
+	for(i = 0;i < w->stringCount;i++)
+	{
+		TString * ts = &w->objects[i]->ts;
+		luaStore_writeUint(w, (uint)ts->tsv.len);
+		luaStore_write(w, getstr(ts), ts->tsv.len);
+	}
+	for(i = w->stringCount;i < threadEnd;i++)
+		luaStore_writeShell(w, w->objects[i]);
+	for(i = threadEnd;i < w->objects.size();i++)
+	{
+		lua_State * T = NULL;
+		UpVal * uv = &w->objects[i]->uv;
+		uint k;
+
+		// Find the thread whose stack the upvalue points into
+		for(k = w->stringCount;k < threadEnd;k++)
 		{
-			if(functions[i] == val_(v).f)
+			if(w->objects[k]->gch.tt == LUA_TTHREAD)
 			{
-				// write the index as a short
-				f.write((ushort)i);
-				found = true;
-				break;
+				T = &w->objects[k]->th;
+				if(uv->v >= T->stack && uv->v < T->stack + T->stacksize)
+					break;
 			}
 		}
-		if(!found)
-			dbgError("unknown light function");
-		break;
-	default:
-		dbgError("unknown object type %i", type);
-		break;
+		if(k == threadEnd)
+			dbgError("luaStore - open upvalue doesn't belong to a thread");
+
+		luaStore_writeByte(w, LUASTORE_OPENUPVAL);
+		luaStore_writeUint(w, k + 1);
+		luaStore_writeStackIndex(w, T, uv->v);
 	}
+
+	// Contents
+	for(i = w->stringCount;i < w->objects.size();i++)
+		luaStore_writeContents(w, w->objects[i]);
+
+	// Globals
+	luaStore_writeValue(w, registry(L));
+	for(j = 0;j < NUM_TAGS;j++)
+		luaStore_writeId(w, g->mt[j]);
+
+	luaStore_flush(w);
+	delete w;
 }
 
-void luaStore_writeGC(GCObject * gc, file& f, std::vector<void *>& functions)
+static void luaStore_read(STORE_READER * r, void * data, size_t size)
+{
+	if(luaZ_read(&r->z, data, size) != 0)
+		dbgError("luaStore - heap image is truncated");
+}
+
+static byte luaStore_readByte(STORE_READER * r)
+{
+	byte b;
+	luaStore_read(r, &b, sizeof(b));
+	return b;
+}
+
+static uint luaStore_readUint(STORE_READER * r)
 {
-	GCObject * tmp = gc;
 	uint i;
-	for(i = 0;gc;i++)
-		gc = gc->gch.next;
-	f.write(i); // list size
-	gc = tmp;
-	while(gc)
-	{
-		luaStore_writeObject(gc, f, functions);
-		gc = gc->gch.next;
-	}
+	luaStore_read(r, &i, sizeof(i));
+	return i;
 }
 
-void luaStore_writeThread(lua_State * L, file& f, std::vector<void *>& functions)
+static int luaStore_readInt(STORE_READER * r)
 {
 	int i;
-	StkId stack;
+	luaStore_read(r, &i, sizeof(i));
+	return i;
+}
+
+// The object for an id, checking its type (-1 for any type)
+static GCObject * luaStore_object(STORE_READER * r, uint id, int type)
+{
+	GCObject * o;
+
+	if(id == 0)
+		return NULL;
+	if(id > r->objects.size() || r->objects[id - 1] == NULL)
+		dbgError("luaStore - bad object id %u", id);
+
+	o = r->objects[id - 1];
+	if(type >= 0 && o->gch.tt != type)
+		dbgError("luaStore - object %u is a %i instead of a %i", id, o->gch.tt, type);
+	return o;
+}
 
-	// Write the thread stack
-	stack = L->stack;
-	f.write(L->stacksize);
-	for(i = 0;i < L->stacksize;i++)
+static GCObject * luaStore_readId(STORE_READER * r, int type)
+{
+	return luaStore_object(r, luaStore_readUint(r), type);
+}
+
+static void luaStore_readValue(STORE_READER * r, TValue * o)
+{
+	int type = luaStore_readByte(r);
+
+	switch(type)
 	{
-		luaStore_writeValue(stack, f, functions);
-		stack++;
+	case LUA_TNIL:
+		setnilvalue(o);
+		break;
+	case LUA_TBOOLEAN:
+		setbvalue(o, luaStore_readByte(r));
+		break;
+	case LUA_TLIGHTUSERDATA:
+		luaStore_read(r, &o->value.p, sizeof(void *));
+		o->tt = LUA_TLIGHTUSERDATA;
+		break;
+	case LUA_TNUMBER:
+		luaStore_read(r, &o->value.n, sizeof(lua_Number));
+		o->tt = LUA_TNUMBER;
+		break;
+	case LUA_TSTRING:
+	case LUA_TTABLE:
+	case LUA_TFUNCTION:
+	case LUA_TUSERDATA:
+	case LUA_TTHREAD:
+		o->value.gc = luaStore_readId(r, type);
+		o->tt = type;
+		break;
+	default:
+		dbgError("luaStore - bad value type %i", type);
+		break;
 	}
 }
 
-void luaStore_writeStrings(stringtable * strt, file&f)
+static StkId luaStore_readStackIndex(STORE_READER * r, lua_State * T)
 {
-	GCObject * list;
+	uint i = luaStore_readUint(r);
+
+	if(i >= (uint)T->stacksize)
+		dbgError("luaStore - stack index is out of range");
+	return T->stack + i;
+}
+
+static const Instruction * luaStore_readPc(STORE_READER * r)
+{
+	Proto * p = (Proto *)luaStore_readId(r, LUA_TPROTO);
+	uint offset = luaStore_readUint(r);
+
+	if(p == NULL)
+		return NULL;
+	if(offset > (uint)p->sizecode)
+		dbgError("luaStore - saved pc is out of range");
+	return p->code + offset;
+}
+
+static Proto * luaStore_newProto(STORE_READER * r)
+{
+	lua_State * L = r->L;
+	Proto * p = luaF_newproto(L);
 	int i;
 
-	// The total amount of strings
-	f.write(strt->nuse);
-	
-	for(i = 0;i < strt->size;i++)
+	// Everything the collector could look at starts out empty
+	p->sizecode = luaStore_readInt(r);
+	p->code = luaM_newvector(L, p->sizecode, Instruction);
+	p->sizek = luaStore_readInt(r);
+	p->k = luaM_newvector(L, p->sizek, TValue);
+	for(i = 0;i < p->sizek;i++)
+		setnilvalue(&p->k[i]);
+	p->sizep = luaStore_readInt(r);
+	p->p = luaM_newvector(L, p->sizep, Proto *);
+	for(i = 0;i < p->sizep;i++)
+		p->p[i] = NULL;
+	p->sizelineinfo = luaStore_readInt(r);
+	p->lineinfo = luaM_newvector(L, p->sizelineinfo, int);
+	p->sizelocvars = luaStore_readInt(r);
+	p->locvars = luaM_newvector(L, p->sizelocvars, LocVar);
+	for(i = 0;i < p->sizelocvars;i++)
+		p->locvars[i].varname = NULL;
+	p->sizeupvalues = luaStore_readInt(r);
+	p->upvalues = luaM_newvector(L, p->sizeupvalues, TString *);
+	for(i = 0;i < p->sizeupvalues;i++)
+		p->upvalues[i] = NULL;
+
+	return p;
+}
+
+static GCObject * luaStore_readShell(STORE_READER * r)
+{
+	lua_State * L = r->L;
+	Table * e = hvalue(gt(L));
+	lua_State * T;
+	Udata * u;
+	uint size, nodes;
+	int ci;
+
+	// Environments are filled in with the contents
+	switch(luaStore_readByte(r))
 	{
-		list = strt->hash[i];
-		while(list)
-		{
-			// write the object pointer
-			f.write(&list, sizeof(void*));
+	case LUA_TTABLE:
+		size = luaStore_readUint(r);
+		nodes = luaStore_readUint(r);
+		return obj2gco(luaH_new(L, size, nodes));
 
-			// write the string length
-			if(list->ts.tsv.len > 0xFFFF)
-				dbgError("string too long");
-			f.write((ushort)list->ts.tsv.len);
+	case LUASTORE_LCLOSURE:
+		return obj2gco(luaF_newLclosure(L, luaStore_readByte(r), e));
 
-			// write the string
-			f.write(&list->ts + 1, list->ts.tsv.len);
+	case LUASTORE_CCLOSURE:
+		return obj2gco(luaF_newCclosure(L, luaStore_readByte(r), e));
 
-			// next!
-			list = list->gch.next;
-		}
+	case LUA_TPROTO:
+		return obj2gco(luaStore_newProto(r));
+
+	case LUA_TUPVAL:
+		return obj2gco(luaF_newupval(L));
+
+	case LUASTORE_OPENUPVAL:
+		T = (lua_State *)luaStore_readId(r, LUA_TTHREAD);
+		return obj2gco(luaF_findupval(T, luaStore_readStackIndex(r, T)));
+
+	case LUA_TUSERDATA:
+		size = luaStore_readUint(r);
+		u = luaS_newudata(L, size, e);
+		luaStore_read(r, u + 1, size);
+		return obj2gco(u);
+
+	case LUA_TTHREAD:
+		// The saved main thread becomes the main thread of the new state
+		T = luaStore_readByte(r) ? L : luaE_newthread(L);
+		// luaE_newthread doesn't clear the extra space, the manager sets it on the threads it adopts
+		lua_extraspace(T) = NULL;
+		size = luaStore_readInt(r);
+		ci = luaStore_readInt(r);
+		if(size <= EXTRA_STACK + 1 || ci <= 0)
+			dbgError("luaStore - bad thread size");
+		luaD_reallocstack(T, size - EXTRA_STACK - 1);
+		luaD_reallocCI(T, ci);
+		return obj2gco(T);
 	}
+
+	dbgError("luaStore - bad object type");
+	return NULL;
 }
 
-void luaStore_writeThreadState(LUA_THREAD * thr, file& f)
+static void luaStore_readTable(STORE_READER * r, Table * t)
 {
-	uint i;
-	ushort len;
-	f.write(&thr->L, sizeof(void*));
-	f.write((byte)thr->firstRun);
-	f.write(thr->nargs);
-	f.write((byte)thr->terminate);
-	if(thr->waitEvent.entity)
+	TValue key, value;
+	int i, count;
+	byte dirty;
+
+	dirty = luaStore_readByte(r);
+	t->metatable = (Table *)luaStore_readId(r, LUA_TTABLE);
+
+	for(i = 0;i < t->sizearray;i++)
+		luaStore_readValue(r, &t->array[i]);
+
+	count = luaStore_readInt(r);
+	for(i = 0;i < count;i++)
 	{
-		f.write((ushort)1);
-		len = strlen(thr->waitEvent.event);
-		f.write(&thr->waitEvent.entity, sizeof(void*));
-		f.write(len);
-		f.write(thr->waitEvent.event, len);
+		luaStore_readValue(r, &key);
+		luaStore_readValue(r, &value);
+		if(ttisnil(&key))
+			dbgError("luaStore - table key is nil");
+		setobj2t(r->L, luaH_set(r->L, t, &key), &value);
 	}
+
+	// Tables written since the last delta save are still written
+	if(dirty == TABLE_DIRTY)
+		luaH_linkdirty(r->L, t);
 	else
-		f.write((ushort)0);
+		t->dirty = dirty;
+}
+
+static void luaStore_readProto(STORE_READER * r, Proto * p)
+{
+	int i;
 
-	len = 0;
-	for(i = 0;i < ENDON_EVENT_COUNT;i++)
+	p->source = (TString *)luaStore_readId(r, LUA_TSTRING);
+	p->linedefined = luaStore_readInt(r);
+	p->lastlinedefined = luaStore_readInt(r);
+	p->nups = luaStore_readByte(r);
+	p->numparams = luaStore_readByte(r);
+	p->is_vararg = luaStore_readByte(r);
+	p->maxstacksize = luaStore_readByte(r);
+	p->lazy = (TString *)luaStore_readId(r, LUA_TSTRING);
+	p->lazypos = luaStore_readInt(r);
+
+	luaStore_read(r, p->code, p->sizecode * sizeof(Instruction));
+	for(i = 0;i < p->sizek;i++)
+		luaStore_readValue(r, &p->k[i]);
+	for(i = 0;i < p->sizep;i++)
+		p->p[i] = (Proto *)luaStore_readId(r, LUA_TPROTO);
+	luaStore_read(r, p->lineinfo, p->sizelineinfo * sizeof(int));
+	for(i = 0;i < p->sizelocvars;i++)
 	{
-		if(thr->endonEvents[i].entity)
-			len++;
+		p->locvars[i].varname = (TString *)luaStore_readId(r, LUA_TSTRING);
+		p->locvars[i].startpc = luaStore_readInt(r);
+		p->locvars[i].endpc = luaStore_readInt(r);
 	}
+	for(i = 0;i < p->sizeupvalues;i++)
+		p->upvalues[i] = (TString *)luaStore_readId(r, LUA_TSTRING);
+}
+
+static void luaStore_readThread(STORE_READER * r, lua_State * T)
+{
+	CallInfo * ci;
+	StkId lim, o;
+	int count;
+
+	T->status = luaStore_readByte(r);
+	T->nCcalls = (unsigned short)luaStore_readUint(r);
+	T->baseCcalls = (unsigned short)luaStore_readUint(r);
+	T->allowhook = luaStore_readByte(r);
+	T->errfunc = luaStore_readInt(r);
+	luaStore_readValue(r, gt(T));
+	luaStore_readValue(r, &T->env);
+
+	lim = luaStore_readStackIndex(r, T);
+	for(o = T->stack;o < lim;o++)
+		luaStore_readValue(r, o);
+	T->top = luaStore_readStackIndex(r, T);
+	T->base = luaStore_readStackIndex(r, T);
+
+	count = luaStore_readInt(r);
+	if(count <= 0 || count > T->size_ci)
+		dbgError("luaStore - bad CallInfo count");
+	for(ci = T->base_ci;ci < T->base_ci + count;ci++)
+	{
+		ci->base = luaStore_readStackIndex(r, T);
+		ci->func = luaStore_readStackIndex(r, T);
+		ci->top = luaStore_readStackIndex(r, T);
+		ci->savedpc = luaStore_readPc(r);
+		ci->nresults = luaStore_readInt(r);
+		ci->tailcalls = luaStore_readInt(r);
+	}
+	T->ci = T->base_ci + count - 1;
+	T->savedpc = luaStore_readPc(r);
+
+	// Hooks are set by whoever resumes the thread
+	T->hook = NULL;
+	T->hookmask = 0;
+	T->basehookcount = 0;
+	T->hookcount = 0;
+}
+
+static void luaStore_readContents(STORE_READER * r, GCObject * o)
+{
+	int64 offset;
+	int i;
 
-	f.write(len);
-	for(i = 0;i < ENDON_EVENT_COUNT;i++)
+	switch(o->gch.tt)
 	{
-		if(thr->endonEvents[i].entity)
+	case LUA_TTABLE:
+		luaStore_readTable(r, &o->h);
+		break;
+	case LUA_TFUNCTION:
+		o->cl.c.env = (Table *)luaStore_readId(r, LUA_TTABLE);
+		if(o->cl.c.env == NULL)
+			dbgError("luaStore - function has no environment");
+		if(o->cl.c.isC)
 		{
-			len = strlen(thr->endonEvents[i].event);
-			f.write(&thr->endonEvents[i].entity, sizeof(void*));
-			f.write(len);
-			f.write(thr->endonEvents[i].event, len);
+			luaStore_read(r, &offset, sizeof(offset));
+			o->cl.c.f = (lua_CFunction)((char *)luaStore_save + offset);
+			for(i = 0;i < o->cl.c.nupvalues;i++)
+				luaStore_readValue(r, &o->cl.c.upvalue[i]);
 		}
+		else
+		{
+			o->cl.l.p = (Proto *)luaStore_readId(r, LUA_TPROTO);
+			for(i = 0;i < o->cl.l.nupvalues;i++)
+				o->cl.l.upvals[i] = (UpVal *)luaStore_readId(r, LUA_TUPVAL);
+		}
+		break;
+	case LUA_TPROTO:
+		luaStore_readProto(r, &o->p);
+		break;
+	case LUA_TUPVAL:
+		if(o->uv.v == &o->uv.u.value)
+			luaStore_readValue(r, o->uv.v);
+		break;
+	case LUA_TUSERDATA:
+		o->u.uv.metatable = (Table *)luaStore_readId(r, LUA_TTABLE);
+		o->u.uv.env = (Table *)luaStore_readId(r, LUA_TTABLE);
+		if(o->u.uv.env == NULL)
+			dbgError("luaStore - userdata has no environment");
+		break;
+	case LUA_TTHREAD:
+		luaStore_readThread(r, &o->th);
+		break;
 	}
 }
 
-void luaStore_save(CLuaManager * l, file& f)
+lua_State * luaStore_load(lua_Reader reader, void * ud, lua_Alloc alloc, void * allocud)
 {
-	std::vector<LUA_THREAD>::iterator i;
+	STORE_READER r;
+	global_State * g;
+	lua_State * L;
+	int64 check;
+	uint i, count, length;
+	int j;
+
+	L = lua_newstate(alloc, allocud);
+	if(L == NULL)
+		dbgError("luaStore - unable to create the script state");
+	g = G(L);
+
+	// Nothing is reachable until the image is in, the collector has to stay out of the way
+	lua_gc(L, LUA_GCSTOP, 0);
+
+	r.L = L;
+	luaZ_init(L, &r.z, reader, ud);
+
+	if(luaStore_readUint(&r) != LUASTORE_MAGIC)
+		dbgError("luaStore - not a heap image");
+	if(luaStore_readByte(&r) != sizeof(void *) || luaStore_readByte(&r) != sizeof(lua_Number) || luaStore_readByte(&r) != sizeof(Instruction))
+		dbgError("luaStore - heap image is from another platform");
+	luaStore_read(&r, &check, sizeof(check));
+	if(check != (char *)lua_newstate - (char *)luaStore_save)
+		dbgError("luaStore - heap image is from another build");
+
+	r.stringCount = luaStore_readUint(&r);
+	count = luaStore_readUint(&r);
+	if(r.stringCount > count)
+		dbgError("luaStore - bad object count");
+	r.objects.assign(count, NULL);
+
+	// Strings are interned, the ones the new state made for itself are shared
+	for(i = 0;i < r.stringCount;i++)
+	{
+		length = luaStore_readUint(&r);
+		r.scratch.resize(length + 1);
+		luaStore_read(&r, &r.scratch[0], length);
+		r.objects[i] = obj2gco(luaS_newlstr(L, &r.scratch[0], length));
+	}
 
-	// Before writing, force a full garbage collect
-	lua_gc(l->L, LUA_GCCOLLECT, 0);
+	for(i = r.stringCount;i < count;i++)
+		r.objects[i] = luaStore_readShell(&r);
 
-	// Write string table from global state
-	luaStore_writeStrings(&l->L->l_G->strt, f);
-	// Write global GC list
-	luaStore_writeGC(l->L->l_G->allgc, f, l->functionBindings);
-	
-	// write all thread pointers
-	// main thread
-	luaStore_writeThread(l->L, f, l->functionBindings);
-	// Lists
-	f.write((ushort)(l->luaThreads.size() + l->queueThreads.size()));
-	// first list
-	for(i = l->luaThreads.begin();i != l->luaThreads.end();i++)
-		luaStore_writeThreadState(&(*i), f);
-	// second (queue) list
-	for(i = l->queueThreads.begin();i != l->queueThreads.end();i++)
-		luaStore_writeThreadState(&(*i), f);
-}
+	for(i = r.stringCount;i < count;i++)
+		luaStore_readContents(&r, r.objects[i]);
 
-void luaStore_load(lua_State * L, file& f)
-{
+	// The registry and globals made by lua_newstate are left for the collector
+	luaStore_readValue(&r, registry(L));
+	if(!ttistable(registry(L)))
+		dbgError("luaStore - heap image has no registry");
+	for(j = 0;j < NUM_TAGS;j++)
+		g->mt[j] = (Table *)luaStore_readId(&r, LUA_TTABLE);
+
+	return L;
 }
-#endif
\ No newline at end of file
@@ -1,7 +1,16 @@
 #ifndef _LUASTORE_H
 #define _LUASTORE_H
 
-void luaStore_save(lua_State * L, file& f);
-void luaStore_load(lua_State * L, file& f);
+// Heap images, a raw copy of every object in a lua state
+// This is much faster than pluto, but an image can only be loaded by the build that wrote it
+//   (C functions are stored as code offsets and light userdata as pointers)
 
-#endif
\ No newline at end of file
+// Write the whole state, this runs a full collection first
+// The state can't be running, and every coroutine has to be suspended or finished
+void luaStore_save(lua_State * L, lua_Writer writer, void * ud);
+
+// Build a new state from an image, the old state is left alone
+// The stack of the main thread is restored as well, so whatever was on it when saving is on it again
+lua_State * luaStore_load(lua_Reader reader, void * ud, lua_Alloc alloc, void * allocud);
+
+#endif
@@ -0,0 +1,92 @@
+#include "..\include.h"
+#include "thread.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+
+thread::thread()
+{
+	data = NULL;
+}
+
+thread::~thread()
+{
+	if(data)
+		join();
+}
+
+unsigned long __stdcall thread::entry(void * self)
+{
+	thread * t = (thread *)self;
+
+	t->func(t->param);
+	return 0;
+}
+
+void thread::start(THREAD_FUNC func, void * param)
+{
+	if(data)
+		dbgError("thread::start - thread is already running");
+
+	this->func = func;
+	this->param = param;
+
+	data = CreateThread(NULL, 0, entry, this, 0, NULL);
+	if(data == NULL)
+		dbgError("thread::start - unable to create thread");
+}
+
+void thread::join()
+{
+	if(data == NULL)
+		return;
+
+	WaitForSingleObject((HANDLE)data, INFINITE);
+	CloseHandle((HANDLE)data);
+	data = NULL;
+}
+
+semaphore::semaphore(int count)
+{
+	data = CreateSemaphore(NULL, count, 0x7FFFFFFF, NULL);
+	if(data == NULL)
+		dbgError("semaphore::semaphore - unable to create semaphore");
+}
+
+semaphore::~semaphore()
+{
+	CloseHandle((HANDLE)data);
+}
+
+void semaphore::post()
+{
+	ReleaseSemaphore((HANDLE)data, 1, NULL);
+}
+
+void semaphore::wait()
+{
+	WaitForSingleObject((HANDLE)data, INFINITE);
+}
+
+condition::condition()
+{
+	data = (PCONDITION_VARIABLE)malloc(sizeof(CONDITION_VARIABLE));
+	InitializeConditionVariable((PCONDITION_VARIABLE)data);
+}
+
+condition::~condition()
+{
+	// Condition variables have nothing to release
+	free(data);
+}
+
+void condition::wait(lock& l)
+{
+	SleepConditionVariableCS((PCONDITION_VARIABLE)data, (PCRITICAL_SECTION)l.data, INFINITE);
+}
+
+void condition::wakeAll()
+{
+	WakeAllConditionVariable((PCONDITION_VARIABLE)data);
+}
+#endif
@@ -0,0 +1,56 @@
+#ifndef _THREAD_H
+#define _THREAD_H
+
+typedef void (*THREAD_FUNC)(void * param);
+
+class thread
+{
+public:
+	thread();
+	~thread();
+
+	// Start running func(param) on a new thread
+	void start(THREAD_FUNC func, void * param);
+	// Wait for the thread to return
+	void join();
+
+private:
+	void * data; // platform specific thread data
+	THREAD_FUNC func;
+	void * param;
+
+	static unsigned long __stdcall entry(void * self);
+};
+
+class semaphore
+{
+public:
+	semaphore(int count = 0);
+	~semaphore();
+
+	// Add one to the count, waking a waiter if there is one
+	void post();
+	// Wait for the count to be above 0, then take one from it
+	void wait();
+
+private:
+	void * data; // platform specific semaphore data
+};
+
+// Lets threads holding a lock sleep until another thread changes what they wait on
+class condition
+{
+public:
+	condition();
+	~condition();
+
+	// Leave the lock and sleep until woken, the lock is held again on return
+	void wait(lock& l);
+	// Wake every waiting thread
+	void wakeAll();
+
+private:
+	void * data; // platform specific condition data
+};
+
+#endif